@@ -1,23 +1,525 @@
+#include <string.h>
+
 #include "gmediadb-GMediaDB.h"
 
+static gboolean
+tags_from_object (PyObject *obj, gchar ***tags)
+{
+    PyObject *seq;
+    Py_ssize_t i, n;
+
+    *tags = NULL;
+
+    if (!obj || obj == Py_None) {
+        return TRUE;
+    }
+
+    if (!(seq = PySequence_Fast (obj, "tags must be a sequence of strings"))) {
+        return FALSE;
+    }
+
+    n = PySequence_Fast_GET_SIZE (seq);
+    *tags = g_new0 (gchar*, n + 1);
+
+    for (i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM (seq, i);
+
+        if (!PyString_Check (item)) {
+            PyErr_SetString (PyExc_TypeError, "tags must be a sequence of strings");
+            g_strfreev (*tags);
+            *tags = NULL;
+            Py_DECREF (seq);
+            return FALSE;
+        }
+
+        (*tags)[i] = g_strdup (PyString_AS_STRING (item));
+    }
+
+    Py_DECREF (seq);
+
+    return TRUE;
+}
+
+static GArray*
+ids_from_object (PyObject *obj)
+{
+    PyObject *seq;
+    Py_ssize_t i, n;
+    GArray *ids;
+
+    if (!(seq = PySequence_Fast (obj, "ids must be a sequence of integers"))) {
+        return NULL;
+    }
+
+    n = PySequence_Fast_GET_SIZE (seq);
+    ids = g_array_sized_new (FALSE, FALSE, sizeof (gint), n);
+
+    for (i = 0; i < n; i++) {
+        long id = PyInt_AsLong (PySequence_Fast_GET_ITEM (seq, i));
+        gint val = id;
+
+        if (id == -1 && PyErr_Occurred ()) {
+            g_array_free (ids, TRUE);
+            Py_DECREF (seq);
+            return NULL;
+        }
+
+        g_array_append_val (ids, val);
+    }
+
+    Py_DECREF (seq);
+
+    return ids;
+}
+
+static void
+kvs_free (gchar **kvs, gint len)
+{
+    gint i;
+
+    // Values may be NULL, so g_strfreev would stop early
+    for (i = 0; i < len; i++) {
+        g_free (kvs[i]);
+    }
+
+    g_free (kvs);
+}
+
+// Turns a dict into key, value pairs. Values are converted with str (),
+// None is passed on as NULL when allowed
+static gchar**
+kvs_from_dict (PyObject *dict, gboolean allow_none, gint *len)
+{
+    PyObject *key, *val;
+    Py_ssize_t pos = 0;
+    gchar **kvs;
+    gint i = 0;
+
+    if (!PyDict_Check (dict)) {
+        PyErr_SetString (PyExc_TypeError, "tags must be a dict");
+        return NULL;
+    }
+
+    kvs = g_new0 (gchar*, PyDict_Size (dict) * 2 + 1);
+
+    while (PyDict_Next (dict, &pos, &key, &val)) {
+        PyObject *str;
+
+        if (!PyString_Check (key) || (val == Py_None && !allow_none)) {
+            PyErr_SetString (PyExc_TypeError, "tags must be strings with values");
+            kvs_free (kvs, i);
+            return NULL;
+        }
+
+        kvs[i++] = g_strdup (PyString_AS_STRING (key));
+
+        if (val == Py_None) {
+            kvs[i++] = NULL;
+            continue;
+        }
+
+        if (!(str = PyObject_Str (val))) {
+            kvs_free (kvs, i);
+            return NULL;
+        }
+
+        kvs[i++] = g_strdup (PyString_AS_STRING (str));
+        Py_DECREF (str);
+    }
+
+    *len = i;
+
+    return kvs;
+}
+
+// Values are interned by the database, so each one only becomes a Python
+// string once per call
+static PyObject*
+string_cached (GHashTable *cache, const gchar *str)
+{
+    PyObject *obj = g_hash_table_lookup (cache, str);
+
+    if (!obj) {
+        obj = PyString_FromString (str);
+        g_hash_table_insert (cache, (gpointer) str, obj);
+    }
+
+    Py_XINCREF (obj);
+
+    return obj;
+}
+
+static PyObject*
+row_build (GHashTable *cache, gint id, gchar *tags[], GPtrArray *values, guint *v)
+{
+    PyObject *row, *key, *val;
+    const gchar *str;
+    gint j, n;
+
+    if (tags) {
+        n = g_strv_length (tags);
+        row = PyTuple_New (n);
+
+        for (j = 0; j < n; j++) {
+            str = g_ptr_array_index (values, (*v)++);
+
+            if (!strcmp (tags[j], "id")) {
+                val = PyInt_FromLong (id);
+            } else if (str) {
+                val = string_cached (cache, str);
+            } else {
+                Py_INCREF (Py_None);
+                val = Py_None;
+            }
+
+            PyTuple_SET_ITEM (row, j, val);
+        }
+
+        return row;
+    }
+
+    row = PyDict_New ();
+
+    val = PyInt_FromLong (id);
+    PyDict_SetItemString (row, "id", val);
+    Py_DECREF (val);
+
+    while ((str = g_ptr_array_index (values, (*v)++))) {
+        key = string_cached (cache, str);
+        val = string_cached (cache, g_ptr_array_index (values, (*v)++));
+
+        PyDict_SetItem (row, key, val);
+
+        Py_DECREF (key);
+        Py_DECREF (val);
+    }
+
+    return row;
+}
+
+static PyObject*
+rows_build (GArray *found, gchar *tags[], GPtrArray *values)
+{
+    GHashTable *cache = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+        NULL, (GDestroyNotify) Py_DecRef);
+    PyObject *rows = PyList_New (found->len);
+    guint i, v = 0;
+
+    for (i = 0; i < found->len; i++) {
+        PyList_SET_ITEM (rows, i, row_build (cache,
+            g_array_index (found, gint, i), tags, values, &v));
+    }
+
+    g_hash_table_destroy (cache);
+
+    return rows;
+}
+
+// Collects the rows without the interpreter lock and builds them with it
+static PyObject*
+GMediaDB_rows (gmediadb_GMediaDB *self, GArray *ids, PyObject *match, PyObject *tobj)
+{
+    GArray *found, *qids = NULL;
+    GPtrArray *values;
+    PyObject *rows;
+    gchar **tags, **kvs = NULL;
+    gint len = 0;
+
+    if (!tags_from_object (tobj, &tags)) {
+        return NULL;
+    }
+
+    if (match && !(kvs = kvs_from_dict (match, FALSE, &len))) {
+        g_strfreev (tags);
+        return NULL;
+    }
+
+    found = g_array_new (FALSE, FALSE, sizeof (gint));
+    values = g_ptr_array_new ();
+
+    Py_BEGIN_ALLOW_THREADS
+    gmediadb_lock (self->db);
+
+    if (kvs) {
+        ids = qids = gmediadb_query (self->db, kvs);
+    }
+
+    gmediadb_get_values (self->db, ids, tags, found, values);
+    Py_END_ALLOW_THREADS
+
+    rows = rows_build (found, tags, values);
+
+    gmediadb_unlock (self->db);
+
+    if (qids) {
+        g_array_free (qids, TRUE);
+    }
+
+    if (kvs) {
+        kvs_free (kvs, len);
+    }
+
+    g_array_free (found, TRUE);
+    g_ptr_array_free (values, TRUE);
+    g_strfreev (tags);
+
+    return rows;
+}
+
 int
 GMediaDB_init (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds)
 {
-    PyObject *name;
+    const char *name = NULL;
+    int lazy = 0, shared_strings = 0;
 
-    static char *kwlist[] = { "type" , NULL };
+    static char *kwlist[] = { "type", "lazy", "shared_strings", NULL };
 
-    if (! PyArg_ParseTupleAndKeywords (args, kwds, "|O", kwlist, &name)) {
+    if (! PyArg_ParseTupleAndKeywords (args, kwds, "s|ii", kwlist, &name, &lazy, &shared_strings)) {
         return -1;
     }
 
-    if (name) {
-        self->db = gmediadb_new (PyString_AsString (name));
+    if (self->db) {
+        g_object_unref (self->db);
     }
+
+    Py_BEGIN_ALLOW_THREADS
+    self->db = gmediadb_new_full (name, (lazy ? GMEDIADB_OPEN_LAZY : 0) |
+        (shared_strings ? GMEDIADB_OPEN_SHARED_STRINGS : 0));
+    Py_END_ALLOW_THREADS
+
+    return 0;
 }
 
 void
 GMediaDB_dealloc (gmediadb_GMediaDB *self)
 {
-    g_object_unref (self->db);
+    if (self->db) {
+        g_object_unref (self->db);
+    }
+
+    self->ob_type->tp_free ((PyObject*) self);
+}
+
+PyObject*
+GMediaDB_get_entry (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *tags = NULL, *rows, *row;
+    GArray *ids;
+    int id;
+
+    static char *kwlist[] = { "id", "tags", NULL };
+
+    if (! PyArg_ParseTupleAndKeywords (args, kwds, "i|O", kwlist, &id, &tags)) {
+        return NULL;
+    }
+
+    ids = g_array_new (FALSE, FALSE, sizeof (gint));
+    g_array_append_val (ids, id);
+
+    rows = GMediaDB_rows (self, ids, NULL, tags);
+
+    g_array_free (ids, TRUE);
+
+    if (!rows) {
+        return NULL;
+    }
+
+    if (PyList_GET_SIZE (rows) == 0) {
+        Py_DECREF (rows);
+        Py_RETURN_NONE;
+    }
+
+    row = PyList_GET_ITEM (rows, 0);
+    Py_INCREF (row);
+    Py_DECREF (rows);
+
+    return row;
+}
+
+PyObject*
+GMediaDB_get_entries (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *iobj, *tags = NULL, *rows;
+    GArray *ids;
+
+    static char *kwlist[] = { "ids", "tags", NULL };
+
+    if (! PyArg_ParseTupleAndKeywords (args, kwds, "O|O", kwlist, &iobj, &tags)) {
+        return NULL;
+    }
+
+    if (!(ids = ids_from_object (iobj))) {
+        return NULL;
+    }
+
+    rows = GMediaDB_rows (self, ids, NULL, tags);
+
+    g_array_free (ids, TRUE);
+
+    return rows;
+}
+
+PyObject*
+GMediaDB_get_all_entries (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *tags = NULL;
+
+    static char *kwlist[] = { "tags", NULL };
+
+    if (! PyArg_ParseTupleAndKeywords (args, kwds, "|O", kwlist, &tags)) {
+        return NULL;
+    }
+
+    return GMediaDB_rows (self, NULL, NULL, tags);
+}
+
+PyObject*
+GMediaDB_query (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *match, *tags = NULL;
+
+    static char *kwlist[] = { "match", "tags", NULL };
+
+    if (! PyArg_ParseTupleAndKeywords (args, kwds, "O|O", kwlist, &match, &tags)) {
+        return NULL;
+    }
+
+    return GMediaDB_rows (self, NULL, match, tags);
+}
+
+PyObject*
+GMediaDB_add_entry (gmediadb_GMediaDB *self, PyObject *args)
+{
+    PyObject *dict;
+    gboolean res;
+    gchar **kvs;
+    gint len;
+
+    if (!PyArg_ParseTuple (args, "O", &dict) ||
+        !(kvs = kvs_from_dict (dict, FALSE, &len))) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    gmediadb_lock (self->db);
+    res = gmediadb_add_entry (self->db, kvs);
+    gmediadb_unlock (self->db);
+    Py_END_ALLOW_THREADS
+
+    kvs_free (kvs, len);
+
+    return PyBool_FromLong (res);
+}
+
+PyObject*
+GMediaDB_update_entry (gmediadb_GMediaDB *self, PyObject *args)
+{
+    PyObject *dict;
+    gboolean res;
+    gchar **kvs;
+    gint len;
+    int id;
+
+    if (!PyArg_ParseTuple (args, "iO", &id, &dict) ||
+        !(kvs = kvs_from_dict (dict, TRUE, &len))) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    gmediadb_lock (self->db);
+    res = gmediadb_update_entry (self->db, id, kvs);
+    gmediadb_unlock (self->db);
+    Py_END_ALLOW_THREADS
+
+    kvs_free (kvs, len);
+
+    return PyBool_FromLong (res);
+}
+
+PyObject*
+GMediaDB_remove_entry (gmediadb_GMediaDB *self, PyObject *args)
+{
+    gboolean res;
+    int id;
+
+    if (!PyArg_ParseTuple (args, "i", &id)) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    gmediadb_lock (self->db);
+    res = gmediadb_remove_entry (self->db, id);
+    gmediadb_unlock (self->db);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong (res);
+}
+
+// Signals are emitted from the main loop, which may run without the
+// interpreter lock
+static void
+GMediaDB_signal_cb (GMediaDB *db, guint id, PyObject *callback)
+{
+    PyGILState_STATE state = PyGILState_Ensure ();
+    PyObject *ret = PyObject_CallFunction (callback, "I", id);
+
+    if (ret) {
+        Py_DECREF (ret);
+    } else {
+        PyErr_Print ();
+    }
+
+    PyGILState_Release (state);
+}
+
+static void
+GMediaDB_signal_free (PyObject *callback, GClosure *closure)
+{
+    PyGILState_STATE state = PyGILState_Ensure ();
+
+    Py_DECREF (callback);
+
+    PyGILState_Release (state);
+}
+
+PyObject*
+GMediaDB_connect (gmediadb_GMediaDB *self, PyObject *args)
+{
+    const char *signal;
+    PyObject *callback;
+    gulong handler;
+
+    if (!PyArg_ParseTuple (args, "sO", &signal, &callback)) {
+        return NULL;
+    }
+
+    if (!PyCallable_Check (callback)) {
+        PyErr_SetString (PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+
+    if (!g_signal_lookup (signal, GMEDIADB_TYPE)) {
+        PyErr_Format (PyExc_ValueError, "Unknown signal %s", signal);
+        return NULL;
+    }
+
+    Py_INCREF (callback);
+    handler = g_signal_connect_data (self->db, signal, G_CALLBACK (GMediaDB_signal_cb),
+        callback, (GClosureNotify) GMediaDB_signal_free, 0);
+
+    return PyLong_FromUnsignedLong (handler);
+}
+
+PyObject*
+GMediaDB_disconnect (gmediadb_GMediaDB *self, PyObject *args)
+{
+    unsigned long handler;
+
+    if (!PyArg_ParseTuple (args, "k", &handler)) {
+        return NULL;
+    }
+
+    g_signal_handler_disconnect (self->db, handler);
+
+    Py_RETURN_NONE;
 }
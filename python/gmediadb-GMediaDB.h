@@ -5,13 +5,46 @@
 typedef struct {
     PyObject_HEAD
 
+    // Calls run with the interpreter lock released and the database lock
+    // held, which the main loop takes as well while it applies changes
     GMediaDB *db;
 } gmediadb_GMediaDB;
 
 int GMediaDB_init (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds);
 void GMediaDB_dealloc (gmediadb_GMediaDB *self);
 
+PyObject *GMediaDB_get_entry (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds);
+PyObject *GMediaDB_get_entries (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds);
+PyObject *GMediaDB_get_all_entries (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds);
+PyObject *GMediaDB_query (gmediadb_GMediaDB *self, PyObject *args, PyObject *kwds);
+PyObject *GMediaDB_add_entry (gmediadb_GMediaDB *self, PyObject *args);
+PyObject *GMediaDB_update_entry (gmediadb_GMediaDB *self, PyObject *args);
+PyObject *GMediaDB_remove_entry (gmediadb_GMediaDB *self, PyObject *args);
+PyObject *GMediaDB_connect (gmediadb_GMediaDB *self, PyObject *args);
+PyObject *GMediaDB_disconnect (gmediadb_GMediaDB *self, PyObject *args);
+
 static PyMethodDef GMediaDB_methods[] = {
+    { "get_entry", (PyCFunction) GMediaDB_get_entry, METH_VARARGS | METH_KEYWORDS,
+      "get_entry(id, tags=None) -> tuple of the values of tags, a dict of all "
+      "tags without them, or None" },
+    { "get_entries", (PyCFunction) GMediaDB_get_entries, METH_VARARGS | METH_KEYWORDS,
+      "get_entries(ids, tags=None) -> list of rows for the entries found" },
+    { "get_all_entries", (PyCFunction) GMediaDB_get_all_entries, METH_VARARGS | METH_KEYWORDS,
+      "get_all_entries(tags=None) -> list of rows for every entry" },
+    { "query", (PyCFunction) GMediaDB_query, METH_VARARGS | METH_KEYWORDS,
+      "query(match, tags=None) -> list of rows for the entries having every "
+      "tag value in the match dict" },
+    { "add_entry", (PyCFunction) GMediaDB_add_entry, METH_VARARGS,
+      "add_entry(tags) -> bool" },
+    { "update_entry", (PyCFunction) GMediaDB_update_entry, METH_VARARGS,
+      "update_entry(id, tags) -> bool, None values remove the tag" },
+    { "remove_entry", (PyCFunction) GMediaDB_remove_entry, METH_VARARGS,
+      "remove_entry(id) -> bool" },
+    { "connect", (PyCFunction) GMediaDB_connect, METH_VARARGS,
+      "connect(signal, callable) -> handler id, callable gets the entry id of "
+      "add-entry, update-entry and remove-entry" },
+    { "disconnect", (PyCFunction) GMediaDB_disconnect, METH_VARARGS,
+      "disconnect(handler id)" },
     { NULL }  /* Sentinel */
 };
 
@@ -19,6 +19,9 @@ initgmediadb(void)
 
     g_type_init ();
 
+    // Calls release the interpreter lock and signals take it back
+    PyEval_InitThreads ();
+
     GMediaDBType.tp_new = PyType_GenericNew;
     if (PyType_Ready (&GMediaDBType) < 0)
         return;
@@ -4,7 +4,7 @@ from distutils.core import setup, Extension
 
 module1 = Extension ('gmediadb',
                      include_dirs = ['/usr/include/glib-2.0', '/usr/lib/glib-2.0/include'],
-                     libraries = ['glib-2.0', 'gmediadb'],
+                     libraries = ['glib-2.0', 'gobject-2.0', 'gthread-2.0', 'gmediadb'],
                      sources = ['gmediadb-python.c', 'gmediadb-GMediaDB.c'])
 
 setup (name = 'GMediaDB',
@@ -0,0 +1,280 @@
+/*
+ *      gmediadb-aggregate.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include "gmediadb-aggregate.h"
+#include "gmediadb-private.h"
+
+G_DEFINE_TYPE(GMediaDBAggregate, gmediadb_aggregate, G_TYPE_OBJECT)
+
+typedef struct {
+    const gchar **values;
+    guint n;
+
+    gint count;
+    gint num;
+    gdouble sum;
+
+    // Value to number of entries having it, ordered so the result comes first
+    GTree *tree;
+} GMediaDBGroup;
+
+struct _GMediaDBAggregatePrivate {
+    GMediaDB *db;
+
+    GMediaDBAggregateOp op;
+    gchar *tag;
+    gchar **group_by;
+    guint n;
+
+    GHashTable *groups;
+};
+
+static guint signal_changed;
+
+static void
+group_free (GMediaDBGroup *group)
+{
+    if (group->tree) {
+        g_tree_destroy (group->tree);
+    }
+
+    g_free (group->values);
+    g_free (group);
+}
+
+static guint
+group_hash (const GMediaDBGroup *group)
+{
+    guint i, hash = 0;
+
+    for (i = 0; i < group->n; i++) {
+        hash = hash * 31 + (group->values[i] ? g_str_hash (group->values[i]) : 0);
+    }
+
+    return hash;
+}
+
+static gboolean
+group_equal (const GMediaDBGroup *a, const GMediaDBGroup *b)
+{
+    guint i;
+
+    // Values from the database are interned, so most compare by pointer
+    for (i = 0; i < a->n; i++) {
+        if (a->values[i] != b->values[i] && g_strcmp0 (a->values[i], b->values[i])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gint
+value_compare (const gdouble *a, const gdouble *b, gpointer op)
+{
+    gint res = *a < *b ? -1 : *a > *b;
+
+    return GPOINTER_TO_INT (op) == GMEDIADB_AGGREGATE_MAX ? -res : res;
+}
+
+static gboolean
+value_first (gdouble *value, gpointer count, gdouble *result)
+{
+    *result = *value;
+
+    return TRUE;
+}
+
+static void
+gmediadb_aggregate_finalize (GObject *object)
+{
+    GMediaDBAggregate *self = GMEDIADB_AGGREGATE (object);
+
+    if (self->priv->db) {
+        gmediadb_remove_aggregate (self->priv->db, self);
+        g_object_unref (self->priv->db);
+        self->priv->db = NULL;
+    }
+
+    g_hash_table_destroy (self->priv->groups);
+    self->priv->groups = NULL;
+
+    g_free (self->priv->tag);
+    g_strfreev (self->priv->group_by);
+
+    G_OBJECT_CLASS (gmediadb_aggregate_parent_class)->finalize (object);
+}
+
+static void
+gmediadb_aggregate_class_init (GMediaDBAggregateClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (GMediaDBAggregatePrivate));
+
+    object_class->finalize = gmediadb_aggregate_finalize;
+
+    signal_changed = g_signal_new ("changed", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__POINTER,
+        G_TYPE_NONE, 1, G_TYPE_POINTER);
+}
+
+static void
+gmediadb_aggregate_init (GMediaDBAggregate *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), GMEDIADB_AGGREGATE_TYPE, GMediaDBAggregatePrivate);
+
+    self->priv->db = NULL;
+    self->priv->groups = g_hash_table_new_full ((GHashFunc) group_hash,
+        (GEqualFunc) group_equal, NULL, (GDestroyNotify) group_free);
+}
+
+GMediaDBAggregate*
+gmediadb_aggregate_new (GMediaDB *db, GMediaDBAggregateOp op, const gchar *tag, gchar *group_by[])
+{
+    GMediaDBAggregate *self = g_object_new (GMEDIADB_AGGREGATE_TYPE, NULL);
+
+    self->priv->op = op;
+    self->priv->tag = g_strdup (tag);
+    self->priv->group_by = g_strdupv (group_by);
+    self->priv->n = group_by ? g_strv_length (group_by) : 0;
+
+    // Fills the groups from what is in the database already
+    self->priv->db = g_object_ref (db);
+    gmediadb_add_aggregate (db, self);
+
+    return self;
+}
+
+GPtrArray*
+gmediadb_aggregate_get_groups (GMediaDBAggregate *self)
+{
+    GPtrArray *array = g_ptr_array_sized_new (g_hash_table_size (self->priv->groups));
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->groups);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_ptr_array_add (array, ((GMediaDBGroup*) val)->values);
+    }
+
+    return array;
+}
+
+gboolean
+gmediadb_aggregate_get (GMediaDBAggregate *self, const gchar *group[], gdouble *result)
+{
+    GMediaDBGroup key = { group, self->priv->n };
+    GMediaDBGroup *found = g_hash_table_lookup (self->priv->groups, &key);
+
+    if (!found) {
+        return FALSE;
+    }
+
+    switch (self->priv->op) {
+        case GMEDIADB_AGGREGATE_COUNT:
+            *result = found->count;
+            return TRUE;
+        case GMEDIADB_AGGREGATE_SUM:
+            *result = found->sum;
+            return TRUE;
+        default:
+            if (!found->num) {
+                return FALSE;
+            }
+
+            g_tree_foreach (found->tree, (GTraverseFunc) value_first, result);
+            return TRUE;
+    }
+}
+
+gchar**
+gmediadb_aggregate_get_group_by (GMediaDBAggregate *self)
+{
+    return self->priv->group_by;
+}
+
+const gchar*
+gmediadb_aggregate_get_tag (GMediaDBAggregate *self)
+{
+    return self->priv->tag;
+}
+
+void
+gmediadb_aggregate_clear (GMediaDBAggregate *self)
+{
+    g_hash_table_remove_all (self->priv->groups);
+}
+
+// Adds (sign 1) or takes away (sign -1) one entry of a group
+void
+gmediadb_aggregate_update (GMediaDBAggregate *self, const gchar *group[],
+                           gboolean has_value, gdouble value, gint sign)
+{
+    GMediaDBGroup key = { group, self->priv->n };
+    GMediaDBGroup *found = g_hash_table_lookup (self->priv->groups, &key);
+
+    if (!found) {
+        if (sign < 0) {
+            return;
+        }
+
+        found = g_new0 (GMediaDBGroup, 1);
+        found->values = g_memdup (group, self->priv->n * sizeof (gchar*));
+        found->n = self->priv->n;
+
+        if (self->priv->op == GMEDIADB_AGGREGATE_MIN || self->priv->op == GMEDIADB_AGGREGATE_MAX) {
+            found->tree = g_tree_new_full ((GCompareDataFunc) value_compare,
+                GINT_TO_POINTER (self->priv->op), g_free, NULL);
+        }
+
+        g_hash_table_insert (self->priv->groups, found, found);
+    }
+
+    found->count += sign;
+
+    if (has_value) {
+        found->num += sign;
+        found->sum += sign * value;
+
+        if (found->tree) {
+            gpointer orig, count;
+            gint num = 0;
+
+            if (g_tree_lookup_extended (found->tree, &value, &orig, &count)) {
+                num = GPOINTER_TO_INT (count);
+            }
+
+            if (num + sign == 0) {
+                g_tree_remove (found->tree, &value);
+            } else if (num + sign > 0) {
+                g_tree_replace (found->tree, g_memdup (&value, sizeof (gdouble)),
+                    GINT_TO_POINTER (num + sign));
+            }
+        }
+    }
+
+    if (found->count <= 0) {
+        g_hash_table_remove (self->priv->groups, found);
+    }
+
+    g_signal_emit (self, signal_changed, 0, group);
+}
@@ -0,0 +1,75 @@
+/*
+ *      gmediadb-aggregate.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef __GMEDIADB_AGGREGATE_H__
+#define __GMEDIADB_AGGREGATE_H__
+
+#include <glib-object.h>
+
+#include "gmediadb.h"
+
+#define GMEDIADB_AGGREGATE_TYPE (gmediadb_aggregate_get_type ())
+#define GMEDIADB_AGGREGATE(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GMEDIADB_AGGREGATE_TYPE, GMediaDBAggregate))
+#define GMEDIADB_AGGREGATE_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), GMEDIADB_AGGREGATE_TYPE, GMediaDBAggregateClass))
+#define IS_GMEDIADB_AGGREGATE(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), GMEDIADB_AGGREGATE_TYPE))
+#define IS_GMEDIADB_AGGREGATE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GMEDIADB_AGGREGATE_TYPE))
+#define GMEDIADB_AGGREGATE_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), GMEDIADB_AGGREGATE_TYPE, GMediaDBAggregateClass))
+
+G_BEGIN_DECLS
+
+typedef struct _GMediaDBAggregate GMediaDBAggregate;
+typedef struct _GMediaDBAggregateClass GMediaDBAggregateClass;
+typedef struct _GMediaDBAggregatePrivate GMediaDBAggregatePrivate;
+
+typedef enum {
+    GMEDIADB_AGGREGATE_COUNT,
+    GMEDIADB_AGGREGATE_SUM,
+    GMEDIADB_AGGREGATE_MIN,
+    GMEDIADB_AGGREGATE_MAX,
+} GMediaDBAggregateOp;
+
+struct _GMediaDBAggregate {
+    GObject parent;
+
+    GMediaDBAggregatePrivate *priv;
+};
+
+struct _GMediaDBAggregateClass {
+    GObjectClass parent;
+};
+
+GType gmediadb_aggregate_get_type (void);
+
+/* Groups the entries of db by the values of the group_by tags and keeps op
+ * over tag up to date for each group as entries change. Entries without a
+ * group tag fall in the group with NULL for it, values of tag that are not
+ * numbers are only counted. The "changed" signal passes the values of the
+ * group that changed */
+GMediaDBAggregate *gmediadb_aggregate_new (GMediaDB *db, GMediaDBAggregateOp op,
+    const gchar *tag, gchar *group_by[]);
+
+/* Group values are arrays with one value per group_by tag, owned by the
+ * aggregate until the next change */
+GPtrArray *gmediadb_aggregate_get_groups (GMediaDBAggregate *self);
+gboolean gmediadb_aggregate_get (GMediaDBAggregate *self, const gchar *group[], gdouble *result);
+
+G_END_DECLS
+
+#endif /* __GMEDIADB_AGGREGATE_H__ */
@@ -0,0 +1,582 @@
+/*
+ *      gmediadb-file.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <unistd.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_SSE42 1
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_CRC32C_ARM 1
+#endif
+
+#include "gmediadb-file.h"
+
+// Block header: marker, type, flags, raw length, stored length, checksum.
+// The checksum covers type through stored length and the stored data
+#define BLOCK_MARKER "GMBK"
+#define BLOCK_HEADER_SIZE 18
+
+#define BLOCK_COMPRESSED 0x01
+
+// Chunk size used while scanning for the next block after a damaged one
+#define RESYNC_CHUNK (64 * 1024)
+
+struct _GMediaDBWriter {
+    int fd;
+    goffset pos;
+    guint8 type;
+
+    GByteArray *buf;
+    GByteArray *zbuf;
+};
+
+struct _GMediaDBReader {
+    int fd;
+    goffset pos;
+    goffset end;
+
+    GByteArray *raw;
+    GByteArray *buf;
+    guint off;
+
+    guint8 type;
+    guint8 flags;
+    guint32 raw_len;
+
+    guint blocks;
+    guint damaged;
+};
+
+static guint32 crc_table[8][256];
+
+static void
+crc32c_init (void)
+{
+    static gsize init = 0;
+
+    if (g_once_init_enter (&init)) {
+        guint32 i, j, crc;
+
+        for (i = 0; i < 256; i++) {
+            crc = i;
+            for (j = 0; j < 8; j++) {
+                crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+            }
+            crc_table[0][i] = crc;
+        }
+
+        for (i = 0; i < 256; i++) {
+            crc = crc_table[0][i];
+            for (j = 1; j < 8; j++) {
+                crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+                crc_table[j][i] = crc;
+            }
+        }
+
+        g_once_init_leave (&init, 1);
+    }
+}
+
+static guint32
+crc32c_soft (guint32 crc, const guint8 *data, gsize len)
+{
+    crc32c_init ();
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+    // Slicing by 8, a word at a time
+    while (len >= 8) {
+        guint64 word;
+        memcpy (&word, data, sizeof (guint64));
+        word ^= crc;
+
+        crc = crc_table[7][word & 0xff] ^
+              crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^
+              crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^
+              crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^
+              crc_table[0][word >> 56];
+
+        data += 8;
+        len -= 8;
+    }
+#endif
+
+    while (len--) {
+        crc = crc_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__ ((target ("sse4.2")))
+static guint32
+crc32c_sse42 (guint32 crc, const guint8 *data, gsize len)
+{
+#ifdef __x86_64__
+    guint64 crc64 = crc;
+
+    while (len >= 8) {
+        guint64 word;
+        memcpy (&word, data, sizeof (guint64));
+        crc64 = _mm_crc32_u64 (crc64, word);
+
+        data += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+#endif
+
+    while (len >= 4) {
+        guint32 word;
+        memcpy (&word, data, sizeof (guint32));
+        crc = _mm_crc32_u32 (crc, word);
+
+        data += 4;
+        len -= 4;
+    }
+
+    while (len--) {
+        crc = _mm_crc32_u8 (crc, *data++);
+    }
+
+    return crc;
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARM
+static guint32
+crc32c_arm (guint32 crc, const guint8 *data, gsize len)
+{
+    while (len >= 8) {
+        guint64 word;
+        memcpy (&word, data, sizeof (guint64));
+        crc = __crc32cd (crc, word);
+
+        data += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = __crc32cb (crc, *data++);
+    }
+
+    return crc;
+}
+#endif
+
+guint32
+gmediadb_crc32c (guint32 crc, gconstpointer data, gsize len)
+{
+    crc = ~crc;
+
+#if defined(HAVE_CRC32C_SSE42)
+    if (__builtin_cpu_supports ("sse4.2")) {
+        return ~crc32c_sse42 (crc, data, len);
+    }
+#elif defined(HAVE_CRC32C_ARM)
+    return ~crc32c_arm (crc, data, len);
+#endif
+
+    return ~crc32c_soft (crc, data, len);
+}
+
+static void
+writer_flush_block (GMediaDBWriter *w)
+{
+    guint8 head[BLOCK_HEADER_SIZE];
+    guint32 raw_len = w->buf->len, len = w->buf->len;
+    guint8 *data = w->buf->data;
+
+    if (!raw_len) {
+        return;
+    }
+
+    memcpy (head, BLOCK_MARKER, 4);
+    head[4] = w->type;
+    head[5] = 0;
+
+#ifdef HAVE_ZLIB
+    uLongf zlen = compressBound (raw_len);
+    g_byte_array_set_size (w->zbuf, zlen);
+
+    // Keep blocks that do not shrink as they are
+    if (compress2 (w->zbuf->data, &zlen, data, raw_len, Z_BEST_SPEED) == Z_OK && zlen < raw_len) {
+        head[5] |= BLOCK_COMPRESSED;
+        data = w->zbuf->data;
+        len = zlen;
+    }
+#endif
+
+    memcpy (head + 6, &raw_len, sizeof (guint32));
+    memcpy (head + 10, &len, sizeof (guint32));
+
+    guint32 crc = gmediadb_crc32c (0, head + 4, 10);
+    crc = gmediadb_crc32c (crc, data, len);
+    memcpy (head + 14, &crc, sizeof (guint32));
+
+    write (w->fd, head, BLOCK_HEADER_SIZE);
+    write (w->fd, data, len);
+
+    w->pos += BLOCK_HEADER_SIZE + len;
+
+    g_byte_array_set_size (w->buf, 0);
+}
+
+GMediaDBWriter*
+gmediadb_writer_new (int fd)
+{
+    GMediaDBWriter *w = g_new0 (GMediaDBWriter, 1);
+
+    w->fd = fd;
+    w->pos = lseek (fd, 0, SEEK_CUR);
+    w->buf = g_byte_array_sized_new (GMEDIADB_BLOCK_SIZE + 1024);
+    w->zbuf = g_byte_array_new ();
+
+    return w;
+}
+
+void
+gmediadb_writer_free (GMediaDBWriter *w)
+{
+    writer_flush_block (w);
+
+    g_byte_array_free (w->buf, TRUE);
+    g_byte_array_free (w->zbuf, TRUE);
+    g_free (w);
+}
+
+void
+gmediadb_writer_begin (GMediaDBWriter *w, guint8 type)
+{
+    writer_flush_block (w);
+    w->type = type;
+}
+
+void
+gmediadb_writer_end_record (GMediaDBWriter *w)
+{
+    // Records never straddle blocks, so each block decodes on its own
+    if (w->buf->len >= GMEDIADB_BLOCK_SIZE) {
+        writer_flush_block (w);
+    }
+}
+
+// Where the block the next record goes into will start
+goffset
+gmediadb_writer_tell (GMediaDBWriter *w)
+{
+    return w->pos;
+}
+
+void
+gmediadb_writer_put_uint (GMediaDBWriter *w, guint64 val)
+{
+    guint8 bytes[10];
+    gint i = 0;
+
+    do {
+        bytes[i] = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            bytes[i] |= 0x80;
+        }
+        i++;
+    } while (val);
+
+    g_byte_array_append (w->buf, bytes, i);
+}
+
+void
+gmediadb_writer_put_string (GMediaDBWriter *w, const gchar *str)
+{
+    gsize len = strlen (str);
+
+    // Keep the terminator so readers can hand out strings in place
+    gmediadb_writer_put_uint (w, len);
+    g_byte_array_append (w->buf, (const guint8*) str, len + 1);
+}
+
+void
+gmediadb_writer_put_data (GMediaDBWriter *w, gconstpointer data, gsize len)
+{
+    g_byte_array_append (w->buf, data, len);
+}
+
+GMediaDBReader*
+gmediadb_reader_new (int fd, goffset start, goffset end)
+{
+    GMediaDBReader *r = g_new0 (GMediaDBReader, 1);
+
+    r->fd = fd;
+    r->pos = start;
+    r->end = end;
+    r->raw = g_byte_array_new ();
+    r->buf = g_byte_array_new ();
+
+    return r;
+}
+
+void
+gmediadb_reader_free (GMediaDBReader *r)
+{
+    g_byte_array_free (r->raw, TRUE);
+    g_byte_array_free (r->buf, TRUE);
+    g_free (r);
+}
+
+// Reads the block at pos into raw and moves past it, FALSE when it is damaged
+static gboolean
+reader_load (GMediaDBReader *r)
+{
+    guint8 head[BLOCK_HEADER_SIZE];
+    guint32 len, crc;
+
+    if (pread (r->fd, head, BLOCK_HEADER_SIZE, r->pos) != BLOCK_HEADER_SIZE ||
+        memcmp (head, BLOCK_MARKER, 4)) {
+        return FALSE;
+    }
+
+    memcpy (&r->raw_len, head + 6, sizeof (guint32));
+    memcpy (&len, head + 10, sizeof (guint32));
+    memcpy (&crc, head + 14, sizeof (guint32));
+
+    if (r->raw_len > GMEDIADB_BLOCK_MAX || len > GMEDIADB_BLOCK_MAX ||
+        (r->end && r->pos + BLOCK_HEADER_SIZE + len > r->end)) {
+        return FALSE;
+    }
+
+    g_byte_array_set_size (r->raw, len);
+
+    if (pread (r->fd, r->raw->data, len, r->pos + BLOCK_HEADER_SIZE) != len ||
+        gmediadb_crc32c (gmediadb_crc32c (0, head + 4, 10), r->raw->data, len) != crc) {
+        return FALSE;
+    }
+
+    r->type = head[4];
+    r->flags = head[5];
+    r->pos += BLOCK_HEADER_SIZE + len;
+
+    return TRUE;
+}
+
+// Scans forward from a damaged block for the next block marker
+static gboolean
+reader_resync (GMediaDBReader *r)
+{
+    guint8 buf[RESYNC_CHUNK + 3];
+    goffset pos = r->pos + 1;
+    gssize len;
+
+    while ((len = pread (r->fd, buf, sizeof (buf), pos)) >= 4) {
+        gssize i;
+
+        if (r->end && pos >= r->end) {
+            break;
+        }
+
+        for (i = 0; i + 4 <= len; i++) {
+            if (buf[i] == BLOCK_MARKER[0] && !memcmp (buf + i, BLOCK_MARKER, 4)) {
+                r->pos = pos + i;
+                return TRUE;
+            }
+        }
+
+        // Overlap chunks so a marker across the boundary is still found
+        pos += len - 3;
+    }
+
+    return FALSE;
+}
+
+// Finds the next intact block, counting the damaged ones skipped on the way
+static gboolean
+reader_next (GMediaDBReader *r)
+{
+    guint8 byte;
+
+    while (!(r->end && r->pos >= r->end)) {
+        if (reader_load (r)) {
+            r->blocks++;
+            return TRUE;
+        }
+
+        // Clean end of the file
+        if (pread (r->fd, &byte, 1, r->pos) != 1) {
+            return FALSE;
+        }
+
+        r->damaged++;
+
+        if (!reader_resync (r)) {
+            return FALSE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Decompresses the loaded block into buf, FALSE when that fails
+static gboolean
+reader_unpack (GMediaDBReader *r)
+{
+    if (r->flags & BLOCK_COMPRESSED) {
+#ifdef HAVE_ZLIB
+        uLongf dlen = r->raw_len;
+
+        g_byte_array_set_size (r->buf, r->raw_len);
+
+        if (uncompress (r->buf->data, &dlen, r->raw->data, r->raw->len) != Z_OK ||
+            dlen != r->raw_len) {
+            return FALSE;
+        }
+#else
+        g_printerr ("Store block is compressed but zlib support is missing\n");
+        return FALSE;
+#endif
+    } else {
+        GByteArray *tmp = r->buf;
+        r->buf = r->raw;
+        r->raw = tmp;
+    }
+
+    r->off = 0;
+
+    return TRUE;
+}
+
+gboolean
+gmediadb_reader_next_block (GMediaDBReader *r, guint8 *type)
+{
+    while (reader_next (r)) {
+        if (!reader_unpack (r)) {
+            r->damaged++;
+            continue;
+        }
+
+        *type = r->type;
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+// Reads just the block at pos, without looking any further when it is damaged
+gboolean
+gmediadb_reader_block_at (GMediaDBReader *r, goffset pos, guint8 *type)
+{
+    r->pos = pos;
+
+    if (!reader_load (r) || !reader_unpack (r)) {
+        r->damaged++;
+        return FALSE;
+    }
+
+    r->blocks++;
+    *type = r->type;
+
+    return TRUE;
+}
+
+void
+gmediadb_reader_verify (GMediaDBReader *r)
+{
+    while (reader_next (r));
+}
+
+guint
+gmediadb_reader_blocks (GMediaDBReader *r)
+{
+    return r->blocks;
+}
+
+guint
+gmediadb_reader_damaged (GMediaDBReader *r)
+{
+    return r->damaged;
+}
+
+gboolean
+gmediadb_reader_done (GMediaDBReader *r)
+{
+    return r->off >= r->buf->len;
+}
+
+gboolean
+gmediadb_reader_get_uint (GMediaDBReader *r, guint64 *val)
+{
+    gint shift = 0;
+
+    *val = 0;
+
+    while (r->off < r->buf->len && shift < 64) {
+        guint8 byte = r->buf->data[r->off++];
+
+        *val |= ((guint64) (byte & 0x7f)) << shift;
+        if (!(byte & 0x80)) {
+            return TRUE;
+        }
+
+        shift += 7;
+    }
+
+    return FALSE;
+}
+
+const gchar*
+gmediadb_reader_get_string (GMediaDBReader *r)
+{
+    guint64 len;
+    const gchar *str;
+
+    if (!gmediadb_reader_get_uint (r, &len) || len >= r->buf->len - r->off ||
+        r->buf->data[r->off + len] != '\0') {
+        return NULL;
+    }
+
+    str = (const gchar*) r->buf->data + r->off;
+    r->off += len + 1;
+
+    return str;
+}
+
+gboolean
+gmediadb_reader_get_data (GMediaDBReader *r, gpointer data, gsize len)
+{
+    if (len > r->buf->len - r->off) {
+        return FALSE;
+    }
+
+    memcpy (data, r->buf->data + r->off, len);
+    r->off += len;
+
+    return TRUE;
+}
@@ -0,0 +1,75 @@
+/*
+ *      gmediadb-file.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef __GMEDIADB_FILE_H__
+#define __GMEDIADB_FILE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// Records are appended to a block until it grows past this size
+#define GMEDIADB_BLOCK_SIZE (64 * 1024)
+
+// Anything larger is taken to be a damaged block header
+#define GMEDIADB_BLOCK_MAX (64 * 1024 * 1024)
+
+enum {
+    GMEDIADB_BLOCK_SCHEMA = 1,
+    GMEDIADB_BLOCK_TAGS,
+    GMEDIADB_BLOCK_VALUES,
+    GMEDIADB_BLOCK_ENTRIES,
+    GMEDIADB_BLOCK_DIRECTORY,
+};
+
+guint32 gmediadb_crc32c (guint32 crc, gconstpointer data, gsize len);
+
+typedef struct _GMediaDBWriter GMediaDBWriter;
+typedef struct _GMediaDBReader GMediaDBReader;
+
+GMediaDBWriter *gmediadb_writer_new (int fd);
+void gmediadb_writer_free (GMediaDBWriter *w);
+
+void gmediadb_writer_begin (GMediaDBWriter *w, guint8 type);
+void gmediadb_writer_end_record (GMediaDBWriter *w);
+goffset gmediadb_writer_tell (GMediaDBWriter *w);
+
+void gmediadb_writer_put_uint (GMediaDBWriter *w, guint64 val);
+void gmediadb_writer_put_string (GMediaDBWriter *w, const gchar *str);
+void gmediadb_writer_put_data (GMediaDBWriter *w, gconstpointer data, gsize len);
+
+GMediaDBReader *gmediadb_reader_new (int fd, goffset start, goffset end);
+void gmediadb_reader_free (GMediaDBReader *r);
+
+gboolean gmediadb_reader_next_block (GMediaDBReader *r, guint8 *type);
+gboolean gmediadb_reader_block_at (GMediaDBReader *r, goffset pos, guint8 *type);
+gboolean gmediadb_reader_done (GMediaDBReader *r);
+
+void gmediadb_reader_verify (GMediaDBReader *r);
+guint gmediadb_reader_blocks (GMediaDBReader *r);
+guint gmediadb_reader_damaged (GMediaDBReader *r);
+
+gboolean gmediadb_reader_get_uint (GMediaDBReader *r, guint64 *val);
+const gchar *gmediadb_reader_get_string (GMediaDBReader *r);
+gboolean gmediadb_reader_get_data (GMediaDBReader *r, gpointer data, gsize len);
+
+G_END_DECLS
+
+#endif /* __GMEDIADB_FILE_H__ */
@@ -0,0 +1,67 @@
+/*
+ *      gmediadb-private.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef __GMEDIADB_PRIVATE_H__
+#define __GMEDIADB_PRIVATE_H__
+
+#include "gmediadb.h"
+#include "gmediadb-aggregate.h"
+
+G_BEGIN_DECLS
+
+// Values longer than this live in the blob region and are loaded on demand
+#define GMEDIADB_BLOB_THRESHOLD 1024
+
+// Key listing, newline separated, the large tags left out of a change
+#define GMEDIADB_BLOB_TAGS "gmediadb:blobs"
+
+// Seconds without changes before the owner writes the store in the background
+#define GMEDIADB_FLUSH_DELAY 5
+
+// Change calls carrying more entries than this are handled as bulk work,
+// a slice of which runs for at most this many milliseconds at a time
+#define GMEDIADB_INTERACTIVE_OPS 16
+#define GMEDIADB_BULK_SLICE 10
+
+// Fewest scanned records a rescan gives each thread
+#define GMEDIADB_RECONCILE_SLICE 4096
+
+// Fewest entries an ad-hoc scan gives each thread
+#define GMEDIADB_SCAN_SLICE 16384
+
+const gchar *gmediadb_lookup_value (GMediaDB *self, guint id, const gchar *tag);
+void gmediadb_flush_wait (GMediaDB *self);
+gboolean gmediadb_match (GMediaDB *self, guint id, gchar *kvs[]);
+guint gmediadb_upsert_info (GMediaDB *self, const gchar *key_tag, GHashTable *info);
+guint gmediadb_reserve_ids (GMediaDB *self, guint count);
+void gmediadb_claim_id (GMediaDB *self, guint id);
+
+void gmediadb_add_aggregate (GMediaDB *self, GMediaDBAggregate *agg);
+void gmediadb_remove_aggregate (GMediaDB *self, GMediaDBAggregate *agg);
+
+gchar **gmediadb_aggregate_get_group_by (GMediaDBAggregate *self);
+const gchar *gmediadb_aggregate_get_tag (GMediaDBAggregate *self);
+void gmediadb_aggregate_clear (GMediaDBAggregate *self);
+void gmediadb_aggregate_update (GMediaDBAggregate *self, const gchar *group[],
+    gboolean has_value, gdouble value, gint sign);
+
+G_END_DECLS
+
+#endif /* __GMEDIADB_PRIVATE_H__ */
@@ -0,0 +1,411 @@
+/*
+ *      gmediadb-sorted-view.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <string.h>
+
+#include "gmediadb-sorted-view.h"
+#include "gmediadb-private.h"
+
+G_DEFINE_TYPE(GMediaDBSortedView, gmediadb_sorted_view, G_TYPE_OBJECT)
+
+typedef struct {
+    gboolean set;
+    gchar *str;
+    gdouble num;
+} GMediaDBSortKey;
+
+typedef struct {
+    guint id;
+    GMediaDBSortKey *keys;
+    guint n;
+} GMediaDBSortItem;
+
+struct _GMediaDBSortedViewPrivate {
+    GMediaDB *db;
+
+    gchar **tags;
+    gboolean *numeric;
+    gboolean *desc;
+    guint n;
+
+    GSequence *seq;
+
+    // Entry id to its place in seq
+    GHashTable *iters;
+};
+
+static guint signal_items_changed;
+
+static void entry_added_cb (GMediaDB *db, guint id, GMediaDBSortedView *self);
+static void entry_updated_cb (GMediaDB *db, guint id, GMediaDBSortedView *self);
+static void entry_removed_cb (GMediaDB *db, guint id, GMediaDBSortedView *self);
+static void tag_type_changed_cb (GMediaDB *db, const gchar *tag, GMediaDBSortedView *self);
+
+// glib has no marshaller for three uints
+static void
+marshal_VOID__UINT_UINT_UINT (GClosure *closure,
+                              GValue *return_value,
+                              guint n_param_values,
+                              const GValue *param_values,
+                              gpointer invocation_hint,
+                              gpointer marshal_data)
+{
+    typedef void (*Func) (gpointer data1, guint arg1, guint arg2, guint arg3, gpointer data2);
+    GCClosure *cc = (GCClosure*) closure;
+    gpointer data1, data2;
+
+    if (G_CCLOSURE_SWAP_DATA (closure)) {
+        data1 = closure->data;
+        data2 = g_value_peek_pointer (param_values);
+    } else {
+        data1 = g_value_peek_pointer (param_values);
+        data2 = closure->data;
+    }
+
+    Func callback = (Func) (marshal_data ? marshal_data : cc->callback);
+    callback (data1, g_value_get_uint (param_values + 1),
+        g_value_get_uint (param_values + 2), g_value_get_uint (param_values + 3), data2);
+}
+
+static void
+item_clear_keys (GMediaDBSortItem *item)
+{
+    guint i;
+
+    for (i = 0; i < item->n; i++) {
+        g_free (item->keys[i].str);
+        item->keys[i].str = NULL;
+    }
+}
+
+static void
+item_set_keys (GMediaDBSortedView *self, GMediaDBSortItem *item, const gchar **values)
+{
+    guint i;
+
+    for (i = 0; i < self->priv->n; i++) {
+        GMediaDBSortKey *key = &item->keys[i];
+
+        if (!strcmp (self->priv->tags[i], "id")) {
+            key->set = TRUE;
+            key->num = item->id;
+        } else if (!values[i]) {
+            key->set = FALSE;
+        } else if (self->priv->numeric[i]) {
+            key->set = TRUE;
+            key->num = g_ascii_strtod (values[i], NULL);
+        } else {
+            key->set = TRUE;
+            key->str = g_utf8_collate_key (values[i], -1);
+        }
+    }
+}
+
+static void
+item_update (GMediaDBSortedView *self, GMediaDBSortItem *item)
+{
+    const gchar **values = g_newa (const gchar*, self->priv->n);
+    guint i;
+
+    for (i = 0; i < self->priv->n; i++) {
+        values[i] = gmediadb_lookup_value (self->priv->db, item->id, self->priv->tags[i]);
+    }
+
+    item_clear_keys (item);
+    item_set_keys (self, item, values);
+}
+
+static gint item_compare (GMediaDBSortItem *a, GMediaDBSortItem *b, GMediaDBSortedView *self);
+
+// Tags may be retyped after the view was made, which changes the kind of
+// key their values sort by. Every key is made again and the order with it
+static void
+view_check_types (GMediaDBSortedView *self)
+{
+    gboolean changed = FALSE;
+    guint i;
+
+    for (i = 0; i < self->priv->n; i++) {
+        gboolean numeric = gmediadb_get_tag_type (self->priv->db,
+            self->priv->tags[i]) != GMEDIADB_TAG_STRING;
+
+        if (numeric != self->priv->numeric[i]) {
+            self->priv->numeric[i] = numeric;
+            changed = TRUE;
+        }
+    }
+
+    if (!changed) {
+        return;
+    }
+
+    GSequenceIter *iter = g_sequence_get_begin_iter (self->priv->seq);
+    for (; !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter)) {
+        item_update (self, (GMediaDBSortItem*) g_sequence_get (iter));
+    }
+
+    g_sequence_sort (self->priv->seq, (GCompareDataFunc) item_compare, self);
+
+    guint len = g_sequence_get_length (self->priv->seq);
+    g_signal_emit (self, signal_items_changed, 0, 0, len, len);
+}
+
+static gint
+item_compare (GMediaDBSortItem *a, GMediaDBSortItem *b, GMediaDBSortedView *self)
+{
+    guint i;
+
+    for (i = 0; i < self->priv->n; i++) {
+        GMediaDBSortKey *ka = &a->keys[i], *kb = &b->keys[i];
+        gint res;
+
+        if (!ka->set || !kb->set) {
+            res = ka->set - kb->set;
+        } else if (ka->str) {
+            res = strcmp (ka->str, kb->str);
+        } else {
+            res = ka->num < kb->num ? -1 : ka->num > kb->num;
+        }
+
+        if (res) {
+            return self->priv->desc[i] ? -res : res;
+        }
+    }
+
+    return a->id < b->id ? -1 : a->id > b->id;
+}
+
+static GMediaDBSortItem*
+item_new (GMediaDBSortedView *self, guint id)
+{
+    GMediaDBSortItem *item = g_new0 (GMediaDBSortItem, 1);
+
+    item->id = id;
+    item->keys = g_new0 (GMediaDBSortKey, self->priv->n);
+    item->n = self->priv->n;
+
+    return item;
+}
+
+static void
+item_free (GMediaDBSortItem *item)
+{
+    item_clear_keys (item);
+    g_free (item->keys);
+    g_free (item);
+}
+
+static void
+gmediadb_sorted_view_finalize (GObject *object)
+{
+    GMediaDBSortedView *self = GMEDIADB_SORTED_VIEW (object);
+
+    if (self->priv->db) {
+        g_signal_handlers_disconnect_by_func (self->priv->db, entry_added_cb, self);
+        g_signal_handlers_disconnect_by_func (self->priv->db, entry_updated_cb, self);
+        g_signal_handlers_disconnect_by_func (self->priv->db, entry_removed_cb, self);
+        g_signal_handlers_disconnect_by_func (self->priv->db, tag_type_changed_cb, self);
+
+        g_object_unref (self->priv->db);
+        self->priv->db = NULL;
+    }
+
+    g_hash_table_destroy (self->priv->iters);
+    self->priv->iters = NULL;
+
+    g_sequence_free (self->priv->seq);
+    self->priv->seq = NULL;
+
+    g_strfreev (self->priv->tags);
+    g_free (self->priv->numeric);
+    g_free (self->priv->desc);
+
+    G_OBJECT_CLASS (gmediadb_sorted_view_parent_class)->finalize (object);
+}
+
+static void
+gmediadb_sorted_view_class_init (GMediaDBSortedViewClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (GMediaDBSortedViewPrivate));
+
+    object_class->finalize = gmediadb_sorted_view_finalize;
+
+    signal_items_changed = g_signal_new ("items-changed", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, marshal_VOID__UINT_UINT_UINT,
+        G_TYPE_NONE, 3, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_UINT);
+}
+
+static void
+gmediadb_sorted_view_init (GMediaDBSortedView *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), GMEDIADB_SORTED_VIEW_TYPE, GMediaDBSortedViewPrivate);
+
+    self->priv->db = NULL;
+    self->priv->seq = g_sequence_new ((GDestroyNotify) item_free);
+    self->priv->iters = g_hash_table_new (g_direct_hash, g_direct_equal);
+}
+
+GMediaDBSortedView*
+gmediadb_sorted_view_new (GMediaDB *db, gchar *sort_by[])
+{
+    GMediaDBSortedView *self = g_object_new (GMEDIADB_SORTED_VIEW_TYPE, NULL);
+    guint i;
+
+    self->priv->n = sort_by ? g_strv_length (sort_by) : 0;
+    self->priv->tags = g_new0 (gchar*, self->priv->n + 1);
+    self->priv->numeric = g_new0 (gboolean, self->priv->n);
+    self->priv->desc = g_new0 (gboolean, self->priv->n);
+
+    for (i = 0; i < self->priv->n; i++) {
+        self->priv->desc[i] = sort_by[i][0] == '-';
+        self->priv->tags[i] = g_strdup (sort_by[i] + self->priv->desc[i]);
+        self->priv->numeric[i] = gmediadb_get_tag_type (db, self->priv->tags[i]) != GMEDIADB_TAG_STRING;
+    }
+
+    self->priv->db = g_object_ref (db);
+
+    GArray *found = g_array_new (FALSE, FALSE, sizeof (gint));
+    GPtrArray *values = g_ptr_array_new ();
+
+    if (self->priv->n) {
+        gmediadb_get_values (db, NULL, self->priv->tags, found, values);
+    } else {
+        GArray *all = gmediadb_query (db, NULL);
+        g_array_append_vals (found, all->data, all->len);
+        g_array_free (all, TRUE);
+    }
+
+    // Appending unsorted and sorting once beats inserting one by one
+    for (i = 0; i < found->len; i++) {
+        GMediaDBSortItem *item = item_new (self, g_array_index (found, gint, i));
+
+        item_set_keys (self, item, (const gchar**) values->pdata + i * self->priv->n);
+        g_hash_table_insert (self->priv->iters, GUINT_TO_POINTER (item->id),
+            g_sequence_append (self->priv->seq, item));
+    }
+
+    g_sequence_sort (self->priv->seq, (GCompareDataFunc) item_compare, self);
+
+    g_array_free (found, TRUE);
+    g_ptr_array_free (values, TRUE);
+
+    g_signal_connect (db, "add-entry", G_CALLBACK (entry_added_cb), self);
+    g_signal_connect (db, "update-entry", G_CALLBACK (entry_updated_cb), self);
+    g_signal_connect (db, "remove-entry", G_CALLBACK (entry_removed_cb), self);
+    g_signal_connect (db, "tag-type-changed", G_CALLBACK (tag_type_changed_cb), self);
+
+    return self;
+}
+
+guint
+gmediadb_sorted_view_get_length (GMediaDBSortedView *self)
+{
+    return g_sequence_get_length (self->priv->seq);
+}
+
+guint
+gmediadb_sorted_view_get_id (GMediaDBSortedView *self, guint position)
+{
+    if (position >= g_sequence_get_length (self->priv->seq)) {
+        return 0;
+    }
+
+    GSequenceIter *iter = g_sequence_get_iter_at_pos (self->priv->seq, position);
+
+    return ((GMediaDBSortItem*) g_sequence_get (iter))->id;
+}
+
+gint
+gmediadb_sorted_view_get_position (GMediaDBSortedView *self, guint id)
+{
+    GSequenceIter *iter = g_hash_table_lookup (self->priv->iters, GUINT_TO_POINTER (id));
+
+    return iter ? g_sequence_iter_get_position (iter) : -1;
+}
+
+// Database callbacks
+static void
+entry_added_cb (GMediaDB *db, guint id, GMediaDBSortedView *self)
+{
+    if (g_hash_table_lookup (self->priv->iters, GUINT_TO_POINTER (id))) {
+        entry_updated_cb (db, id, self);
+        return;
+    }
+
+    GMediaDBSortItem *item = item_new (self, id);
+    item_update (self, item);
+
+    GSequenceIter *iter = g_sequence_insert_sorted (self->priv->seq, item,
+        (GCompareDataFunc) item_compare, self);
+    g_hash_table_insert (self->priv->iters, GUINT_TO_POINTER (id), iter);
+
+    g_signal_emit (self, signal_items_changed, 0, g_sequence_iter_get_position (iter), 0, 1);
+}
+
+static void
+entry_updated_cb (GMediaDB *db, guint id, GMediaDBSortedView *self)
+{
+    GSequenceIter *iter = g_hash_table_lookup (self->priv->iters, GUINT_TO_POINTER (id));
+
+    if (!iter) {
+        entry_added_cb (db, id, self);
+        return;
+    }
+
+    guint from = g_sequence_iter_get_position (iter);
+
+    item_update (self, (GMediaDBSortItem*) g_sequence_get (iter));
+    g_sequence_sort_changed (iter, (GCompareDataFunc) item_compare, self);
+
+    guint to = g_sequence_iter_get_position (iter);
+
+    if (from == to) {
+        g_signal_emit (self, signal_items_changed, 0, from, 1, 1);
+    } else {
+        g_signal_emit (self, signal_items_changed, 0, from, 1, 0);
+        g_signal_emit (self, signal_items_changed, 0, to, 0, 1);
+    }
+}
+
+static void
+entry_removed_cb (GMediaDB *db, guint id, GMediaDBSortedView *self)
+{
+    GSequenceIter *iter = g_hash_table_lookup (self->priv->iters, GUINT_TO_POINTER (id));
+
+    if (!iter) {
+        return;
+    }
+
+    guint pos = g_sequence_iter_get_position (iter);
+
+    g_hash_table_remove (self->priv->iters, GUINT_TO_POINTER (id));
+    g_sequence_remove (iter);
+
+    g_signal_emit (self, signal_items_changed, 0, pos, 1, 0);
+}
+
+static void
+tag_type_changed_cb (GMediaDB *db, const gchar *tag, GMediaDBSortedView *self)
+{
+    view_check_types (self);
+}
@@ -0,0 +1,69 @@
+/*
+ *      gmediadb-sorted-view.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef __GMEDIADB_SORTED_VIEW_H__
+#define __GMEDIADB_SORTED_VIEW_H__
+
+#include <glib-object.h>
+
+#include "gmediadb.h"
+
+#define GMEDIADB_SORTED_VIEW_TYPE (gmediadb_sorted_view_get_type ())
+#define GMEDIADB_SORTED_VIEW(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GMEDIADB_SORTED_VIEW_TYPE, GMediaDBSortedView))
+#define GMEDIADB_SORTED_VIEW_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), GMEDIADB_SORTED_VIEW_TYPE, GMediaDBSortedViewClass))
+#define IS_GMEDIADB_SORTED_VIEW(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), GMEDIADB_SORTED_VIEW_TYPE))
+#define IS_GMEDIADB_SORTED_VIEW_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GMEDIADB_SORTED_VIEW_TYPE))
+#define GMEDIADB_SORTED_VIEW_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), GMEDIADB_SORTED_VIEW_TYPE, GMediaDBSortedViewClass))
+
+G_BEGIN_DECLS
+
+typedef struct _GMediaDBSortedView GMediaDBSortedView;
+typedef struct _GMediaDBSortedViewClass GMediaDBSortedViewClass;
+typedef struct _GMediaDBSortedViewPrivate GMediaDBSortedViewPrivate;
+
+struct _GMediaDBSortedView {
+    GObject parent;
+
+    GMediaDBSortedViewPrivate *priv;
+};
+
+struct _GMediaDBSortedViewClass {
+    GObjectClass parent;
+};
+
+GType gmediadb_sorted_view_get_type (void);
+
+/* Keeps every entry of db ordered by the sort_by tags, a leading '-' sorts
+ * a tag in descending order. Numeric tags and "id" compare as numbers,
+ * strings by collation, entries missing a tag come first and ties go by
+ * id. As entries change "items-changed" passes the position, the number
+ * of rows removed there and the number added, a row that changed in place
+ * is removed and added at once */
+GMediaDBSortedView *gmediadb_sorted_view_new (GMediaDB *db, gchar *sort_by[]);
+
+/* Both lookups walk the balanced tree, O(log n). get_id gives 0 past the
+ * end and get_position -1 for unknown ids */
+guint gmediadb_sorted_view_get_length (GMediaDBSortedView *self);
+guint gmediadb_sorted_view_get_id (GMediaDBSortedView *self, guint position);
+gint gmediadb_sorted_view_get_position (GMediaDBSortedView *self, guint id);
+
+G_END_DECLS
+
+#endif /* __GMEDIADB_SORTED_VIEW_H__ */
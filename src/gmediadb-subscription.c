@@ -0,0 +1,257 @@
+/*
+ *      gmediadb-subscription.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-bindings.h>
+
+#include "gmediadb-subscription.h"
+
+G_DEFINE_TYPE(GMediaDBSubscription, gmediadb_subscription, G_TYPE_OBJECT)
+
+struct _GMediaDBSubscriptionPrivate {
+    DBusGConnection *conn;
+    DBusGProxy *db_proxy;
+
+    DBusGProxy *mo_proxy;
+    DBusGProxy *sub_proxy;
+    gchar *dbus_mo_name;
+    gchar *dbus_mo_path;
+
+    gchar **tags;
+    gchar **filter;
+    guint handle;
+
+    // The subscribe call still waiting for its answer
+    DBusGProxyCall *call;
+};
+
+static guint signal_added, signal_updated, signal_removed;
+
+static void
+sub_added_cb (DBusGProxy *proxy, guint id, GHashTable *info, GMediaDBSubscription *self)
+{
+    g_signal_emit (self, signal_added, 0, id, info);
+}
+
+static void
+sub_updated_cb (DBusGProxy *proxy, guint id, GHashTable *info, GMediaDBSubscription *self)
+{
+    g_signal_emit (self, signal_updated, 0, id, info);
+}
+
+static void
+sub_removed_cb (DBusGProxy *proxy, guint id, GMediaDBSubscription *self)
+{
+    g_signal_emit (self, signal_removed, 0, id);
+}
+
+static void
+subscription_stop (GMediaDBSubscription *self)
+{
+    if (self->priv->call) {
+        dbus_g_proxy_cancel_call (self->priv->mo_proxy, self->priv->call);
+        self->priv->call = NULL;
+    }
+
+    if (!self->priv->sub_proxy) {
+        return;
+    }
+
+    dbus_g_proxy_disconnect_signal (self->priv->sub_proxy, "media_added",
+        G_CALLBACK (sub_added_cb), self);
+    dbus_g_proxy_disconnect_signal (self->priv->sub_proxy, "media_updated",
+        G_CALLBACK (sub_updated_cb), self);
+    dbus_g_proxy_disconnect_signal (self->priv->sub_proxy, "media_removed",
+        G_CALLBACK (sub_removed_cb), self);
+
+    g_object_unref (self->priv->sub_proxy);
+    self->priv->sub_proxy = NULL;
+    self->priv->handle = 0;
+}
+
+static void
+subscription_started (DBusGProxy *proxy, DBusGProxyCall *call, GMediaDBSubscription *self)
+{
+    GError *err = NULL;
+
+    self->priv->call = NULL;
+
+    if (!dbus_g_proxy_end_call (proxy, call, &err,
+        G_TYPE_UINT, &self->priv->handle,
+        G_TYPE_INVALID)) {
+        // Nobody has the database open, wait for an owner to show up
+        g_printerr ("Unable to subscribe to %s: %s\n", self->priv->dbus_mo_name, err->message);
+        g_error_free (err);
+        return;
+    }
+
+    // Bound to the owner itself, so the matches it sent right after the
+    // reply are not dropped while the name is looked up
+    gchar *path = g_strdup_printf ("%s/subscriptions/%u", self->priv->dbus_mo_path, self->priv->handle);
+    self->priv->sub_proxy = dbus_g_proxy_new_for_name_owner (self->priv->conn,
+        self->priv->dbus_mo_name, path, "org.gnome.GMediaDB.MediaObject", &err);
+    g_free (path);
+
+    if (!self->priv->sub_proxy) {
+        g_printerr ("Unable to follow subscription %d: %s\n", self->priv->handle, err->message);
+        g_error_free (err);
+        self->priv->handle = 0;
+        return;
+    }
+
+    dbus_g_proxy_add_signal (self->priv->sub_proxy, "media_added",
+        G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
+    dbus_g_proxy_add_signal (self->priv->sub_proxy, "media_updated",
+        G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
+    dbus_g_proxy_add_signal (self->priv->sub_proxy, "media_removed",
+        G_TYPE_UINT, G_TYPE_INVALID);
+
+    dbus_g_proxy_connect_signal (self->priv->sub_proxy, "media_added",
+        G_CALLBACK (sub_added_cb), self, NULL);
+    dbus_g_proxy_connect_signal (self->priv->sub_proxy, "media_updated",
+        G_CALLBACK (sub_updated_cb), self, NULL);
+    dbus_g_proxy_connect_signal (self->priv->sub_proxy, "media_removed",
+        G_CALLBACK (sub_removed_cb), self, NULL);
+}
+
+// Not waited for, the owner may be this very process
+static void
+subscription_start (GMediaDBSubscription *self)
+{
+    self->priv->call = dbus_g_proxy_begin_call (self->priv->mo_proxy, "subscribe",
+        (DBusGProxyCallNotify) subscription_started, self, NULL,
+        G_TYPE_STRV, self->priv->tags,
+        G_TYPE_STRV, self->priv->filter,
+        G_TYPE_INVALID);
+}
+
+static void
+gmediadb_subscription_name_owner_changed (DBusGProxy *proxy,
+                                          gchar *name,
+                                          gchar *oowner,
+                                          gchar *nowner,
+                                          GMediaDBSubscription *self)
+{
+    if (g_strcmp0 (name, self->priv->dbus_mo_name)) {
+        return;
+    }
+
+    // Subscriptions do not carry over to the next owner
+    subscription_stop (self);
+
+    if (nowner && nowner[0]) {
+        subscription_start (self);
+    }
+}
+
+static void
+gmediadb_subscription_finalize (GObject *object)
+{
+    GMediaDBSubscription *self = GMEDIADB_SUBSCRIPTION (object);
+
+    if (self->priv->handle) {
+        dbus_g_proxy_call_no_reply (self->priv->mo_proxy, "unsubscribe",
+            G_TYPE_UINT, self->priv->handle, G_TYPE_INVALID);
+    }
+
+    subscription_stop (self);
+
+    dbus_g_proxy_disconnect_signal (self->priv->db_proxy, "NameOwnerChanged",
+        G_CALLBACK (gmediadb_subscription_name_owner_changed), self);
+
+    g_object_unref (self->priv->db_proxy);
+    g_object_unref (self->priv->mo_proxy);
+    dbus_g_connection_unref (self->priv->conn);
+
+    g_free (self->priv->dbus_mo_name);
+    g_free (self->priv->dbus_mo_path);
+    g_strfreev (self->priv->tags);
+    g_strfreev (self->priv->filter);
+
+    G_OBJECT_CLASS (gmediadb_subscription_parent_class)->finalize (object);
+}
+
+static void
+gmediadb_subscription_class_init (GMediaDBSubscriptionClass *klass)
+{
+    GObjectClass *object_class;
+    object_class = G_OBJECT_CLASS (klass);
+
+    g_type_class_add_private ((gpointer) klass, sizeof (GMediaDBSubscriptionPrivate));
+
+    object_class->finalize = gmediadb_subscription_finalize;
+
+    // The connection is shared with databases used from other threads
+    dbus_g_thread_init ();
+
+    signal_added = g_signal_new ("entry-added", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT_POINTER,
+        G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_POINTER);
+
+    signal_updated = g_signal_new ("entry-updated", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT_POINTER,
+        G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_POINTER);
+
+    signal_removed = g_signal_new ("entry-removed", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
+        G_TYPE_NONE, 1, G_TYPE_UINT);
+}
+
+static void
+gmediadb_subscription_init (GMediaDBSubscription *self)
+{
+    self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), GMEDIADB_SUBSCRIPTION_TYPE, GMediaDBSubscriptionPrivate);
+
+    self->priv->sub_proxy = NULL;
+    self->priv->handle = 0;
+    self->priv->call = NULL;
+}
+
+GMediaDBSubscription*
+gmediadb_subscription_new (const gchar *mediatype, gchar *tags[], gchar *filter[])
+{
+    GMediaDBSubscription *self = g_object_new (GMEDIADB_SUBSCRIPTION_TYPE, NULL);
+    gchar *none[] = { NULL };
+
+    self->priv->tags = g_strdupv (tags ? tags : none);
+    self->priv->filter = g_strdupv (filter ? filter : none);
+
+    self->priv->conn = dbus_g_bus_get (DBUS_BUS_SESSION, NULL);
+    self->priv->db_proxy = dbus_g_proxy_new_for_name (self->priv->conn,
+        DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS);
+
+    self->priv->dbus_mo_name = g_strdup_printf ("org.gnome.GMediaDB.%s", mediatype);
+    self->priv->dbus_mo_path = g_strdup_printf ("/org/gnome/GMediaDB/%s", mediatype);
+
+    self->priv->mo_proxy = dbus_g_proxy_new_for_name (self->priv->conn,
+        self->priv->dbus_mo_name, self->priv->dbus_mo_path, "org.gnome.GMediaDB.MediaObject");
+
+    dbus_g_object_register_marshaller (g_cclosure_marshal_VOID__UINT_POINTER,
+        G_TYPE_NONE, G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
+
+    dbus_g_proxy_add_signal (self->priv->db_proxy, "NameOwnerChanged",
+        G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INVALID);
+    dbus_g_proxy_connect_signal (self->priv->db_proxy, "NameOwnerChanged",
+        G_CALLBACK (gmediadb_subscription_name_owner_changed), self, NULL);
+
+    subscription_start (self);
+
+    return self;
+}
@@ -0,0 +1,64 @@
+/*
+ *      gmediadb-subscription.h
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This library is free software; you can redistribute it and/or
+ *      modify it under the terms of the GNU Lesser General Public
+ *      License as published by the Free Software Foundation; either
+ *      version 2 of the License, or (at your option) any later version.
+ *
+ *      This library is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *      Lesser General Public License for more details.
+ *
+ *      You should have received a copy of the GNU Lesser General Public
+ *      License along with this library; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef __GMEDIADB_SUBSCRIPTION_H__
+#define __GMEDIADB_SUBSCRIPTION_H__
+
+#include <glib-object.h>
+
+#define GMEDIADB_SUBSCRIPTION_TYPE (gmediadb_subscription_get_type ())
+#define GMEDIADB_SUBSCRIPTION(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GMEDIADB_SUBSCRIPTION_TYPE, GMediaDBSubscription))
+#define GMEDIADB_SUBSCRIPTION_CLASS(klass) (G_TYPE_CHECK_CLASS_CAST ((klass), GMEDIADB_SUBSCRIPTION_TYPE, GMediaDBSubscriptionClass))
+#define IS_GMEDIADB_SUBSCRIPTION(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), GMEDIADB_SUBSCRIPTION_TYPE))
+#define IS_GMEDIADB_SUBSCRIPTION_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GMEDIADB_SUBSCRIPTION_TYPE))
+#define GMEDIADB_SUBSCRIPTION_GET_CLASS(obj) (G_TYPE_INSTANCE_GET_CLASS ((obj), GMEDIADB_SUBSCRIPTION_TYPE, GMediaDBSubscriptionClass))
+
+G_BEGIN_DECLS
+
+typedef struct _GMediaDBSubscription GMediaDBSubscription;
+typedef struct _GMediaDBSubscriptionClass GMediaDBSubscriptionClass;
+typedef struct _GMediaDBSubscriptionPrivate GMediaDBSubscriptionPrivate;
+
+struct _GMediaDBSubscription {
+    GObject parent;
+
+    GMediaDBSubscriptionPrivate *priv;
+};
+
+struct _GMediaDBSubscriptionClass {
+    GObjectClass parent;
+};
+
+GType gmediadb_subscription_get_type (void);
+
+/* Asks the process owning the mediatype database for changes to the entries
+ * whose tags have all the values in filter (tag, value pairs), without
+ * opening the store or following every change on the bus. "entry-added"
+ * and "entry-updated" pass the id and only the tags asked for, or every
+ * small value when tags is NULL. Updates that change none of those tags
+ * are not sent, "entry-removed" also comes when an entry stops matching.
+ * Everything that matches is added first, and again after the database
+ * changes owner */
+GMediaDBSubscription *gmediadb_subscription_new (const gchar *mediatype,
+    gchar *tags[], gchar *filter[]);
+
+G_END_DECLS
+
+#endif /* __GMEDIADB_SUBSCRIPTION_H__ */
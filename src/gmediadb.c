@@ -19,13 +19,205 @@
  */
 
 #include <sys/file.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
 #include <dbus/dbus-glib.h>
 
 #include "gmediadb.h"
+#include "gmediadb-private.h"
+#include "gmediadb-file.h"
 #include "media-object.h"
 
 G_DEFINE_TYPE(GMediaDB, gmediadb, G_TYPE_OBJECT)
 
+#define GMEDIADB_MAGIC "GMDB"
+#define GMEDIADB_VERSION 4
+
+// Set on a value length when the value lives in the blob region
+#define GMEDIADB_BLOB_FLAG 0x80000000
+
+// Set on a value length when the value is stored as a native number
+#define GMEDIADB_TYPED_FLAG 0x40000000
+
+// Tags with more distinct values than this, most of them unique, are
+// written literally instead of through a value dictionary
+#define GMEDIADB_DICT_LIMIT 4096
+
+// How long replicas wait on bulk calls, which the owner works through in
+// slices between other calls and so may take longer than the default
+#define GMEDIADB_BULK_TIMEOUT (10 * 60 * 1000)
+
+// Replicas reserve ids from the owner at least this many at a time
+#define GMEDIADB_ID_BLOCK 64
+
+// How a value is stored in a snapshot entry, kept in the low tag id bits
+enum {
+    VALUE_STRING,
+    VALUE_DICT,
+    VALUE_TYPED,
+    VALUE_BLOB,
+};
+
+typedef struct {
+    guint id;
+    guint count;
+    GHashTable *values;
+} GMediaDBDict;
+
+typedef struct {
+    gboolean set;
+    union {
+        gint64 i;
+        gdouble d;
+    } v;
+} GMediaDBValue;
+
+typedef struct {
+    gchar *tag;
+    gint slot;
+    GMediaDBTagType type;
+} GMediaDBField;
+
+// Names are resolved to the keys entries use once known, NULL names
+// stand for "id"
+struct _GMediaDBProjection {
+    gchar **names;
+    const gchar **tags;
+    guint n;
+};
+
+typedef struct {
+    gint ref;
+
+    GHashTable *tags;
+    GHashTable *blobs;
+
+    GMediaDBValue *values;
+    gint num_values;
+} GMediaDBEntry;
+
+typedef struct {
+    goffset offset;
+    gint len;
+    gchar *data;
+
+    // Tells a value written by a flush from one set since
+    guint serial;
+
+    // On replicas, one past the flushes seen when a change last named it.
+    // The store only has the current value once the owner flushed since
+    guint stale;
+} GMediaDBBlob;
+
+typedef struct {
+    goffset pos;
+    GArray *ids;
+} GMediaDBBlock;
+
+// What a lazily opened store needs to decode its entries later on
+typedef struct {
+    GMediaDBReader *r;
+    GPtrArray *tags;
+    GPtrArray *dicts;
+    goffset bstart;
+
+    GPtrArray *blocks;
+    GHashTable *pending;
+} GMediaDBSnapshot;
+
+// The slice of a rescan one thread compares against the table
+typedef struct {
+    GMediaDB *self;
+    GThread *thread;
+
+    const gchar *key_tag;
+    GHashTable *index;
+    GPtrArray *records;
+    guint start, end;
+
+    // Set for records whose key a later record repeats
+    const gboolean *dropped;
+
+    GArray *added;
+    GArray *changed;
+    GArray *changed_pos;
+    GArray *seen;
+
+    // Entries whose large values have to be loaded to tell, and the
+    // positions of their records
+    GArray *unsure;
+    GArray *unsure_pos;
+} GMediaDBReconcile;
+
+// A change a replica sent that the owner went away without answering
+typedef struct {
+    const gchar *method;
+    guint id;
+    GHashTable *info;
+} GMediaDBPending;
+
+// Remembers the last few values tested, which are interned, so a tag with
+// few distinct values is only compared once for each of them
+#define GMEDIADB_SCAN_CACHE 256
+
+// The slice of the table one thread of a scan tests
+typedef struct {
+    GMediaDB *self;
+    GThread *thread;
+
+    const gchar *tag;
+    GMediaDBField *field;
+    GMediaDBScanOp op;
+    const gchar *needle;
+    gsize len;
+    gdouble number;
+
+    GArray *ids;
+    GPtrArray *entries;
+    guint start, end;
+
+    GArray *found;
+
+    // Large values only the owner can hand over, tested by the caller
+    GArray *later;
+
+    const gchar *cache[GMEDIADB_SCAN_CACHE];
+    gboolean hits[GMEDIADB_SCAN_CACHE];
+} GMediaDBScan;
+
+typedef struct {
+    gint id;
+    GMediaDBEntry *entry;
+} GMediaDBFlushItem;
+
+typedef struct {
+    gint id;
+    const gchar *tag;
+    guint serial;
+    goffset offset;
+} GMediaDBFlushBlob;
+
+// The table as it was when a flush started. Entries are shared with the
+// table and copied before they change, so a worker thread can write them.
+// A job running in the background holds a reference until flush_done
+typedef struct {
+    GMediaDB *self;
+    GThread *thread;
+
+    gchar *fpath;
+    int fd;
+    gint version;
+
+    GHashTable *schema;
+    GArray *items;
+
+    GHashTable *lost;
+    GArray *blobs;
+    gboolean ok;
+} GMediaDBFlush;
+
 struct _GMediaDBPrivate {
     DBusGConnection *conn;
     DBusGProxy *db_proxy;
@@ -37,52 +229,186 @@ struct _GMediaDBPrivate {
     gchar *dbus_mo_path;
 
     GHashTable *table;
+    GMediaDBSnapshot *lazy;
 
     gchar *mtype;
     gchar *fpath;
     int fd;
+    gint version;
+
+    // Flushing renames a new store over the old one, so processes lock
+    // this file instead, which stays the same
+    int lock_fd;
 
     GStringChunk *sc;
+    guint32 pool_bit;
+
+    // Every tag name entries use, to the interned copy that is their key.
+    // Entries compare keys by pointer, so a name is resolved once
+    GHashTable *tag_names;
+
+    GHashTable *schema;
+    gint num_slots;
+
+    // Slots of tags retyped back to strings, given to the next typed tag
+    GSList *free_slots;
+
+    GMediaDBFlush *flush_job;
+    gboolean flush_again;
+    guint blob_serial;
+
+    GList *aggregates;
+
+    // Unique indexes, tag to a table of value to id
+    GHashTable *indexes;
+
+    // Lowest id not handed out yet, covering adds the owner has queued
+    // and ranges replicas reserved but did not send yet
+    gint id_floor;
+
+    // On replicas, ids the owner reserved for us that are still unused
+    guint reserved_next, reserved_end;
+
+    // Where lazily decoded entries go instead of the table while scanning
+    GHashTable *scan;
+
+    // Held while changes from the main loop are applied, for callers on
+    // other threads
+    GStaticRecMutex lock;
+
+    // Changes to send again once the name has a new owner, and whether the
+    // owner changed anything since it last said the store was written
+    GQueue *pending;
+    gboolean unflushed;
+    guint flushes;
 };
 
 static guint signal_add;
 static guint signal_update;
 static guint signal_remove;
-
-void write_entry (int fd, gint id, GHashTable *table);
-GHashTable *read_entry (int fd, int *id, GStringChunk *sc);
+static guint signal_tag_type;
+
+// Strings shared by the databases opened with GMEDIADB_OPEN_SHARED_STRINGS.
+// Each of those databases takes a bit of pool_slots, and every string
+// carries the bits of the databases holding it just in front of it. A
+// database closing frees the strings only it held
+#define GMEDIADB_POOL_HOLDERS(str) (((guint32*) (str))[-1])
+
+static GStaticMutex pool_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *pool = NULL;
+static guint32 pool_slots = 0;
+
+// The database open for each media type in this process. The bus name is
+// held per connection, so a second one could only call itself
+static GStaticMutex instances_lock = G_STATIC_MUTEX_INIT;
+static GHashTable *instances = NULL;
+
+static void write_header (int fd, gint num, goffset bstart, goffset dstart);
+static gint read_header (int fd, gint *num, goffset *bstart, goffset *dstart);
+static void read_schema (int fd, GMediaDB *self);
+static GMediaDBEntry *read_entry (int fd, gint *id, GMediaDB *self, goffset bstart);
+static void write_snapshot (int fd, GMediaDBFlush *job, goffset *boff, goffset *dstart);
+static void read_snapshot (GMediaDB *self, goffset start, goffset bstart, goffset dstart);
+static gboolean read_snapshot_record (GMediaDBReader *r, guint8 type, GMediaDB *self,
+    GPtrArray *tags, GPtrArray *dicts, goffset bstart);
+static void snapshot_free (GMediaDBSnapshot *snap);
+static void lazy_load_all (GMediaDB *self);
+static GHashTable *lazy_scan_block (GMediaDB *self, GMediaDBBlock *block);
+static void write_blobs (int fd, GMediaDBFlush *job, GMediaDBFlushItem *item);
+static gboolean read_blob_header (int fd, goffset *pos, gint *id, gchar **key, gint *vlen);
+static gchar *blob_read (int fd, GMediaDBBlob *blob, gint version);
+static void reindex_blobs (GMediaDB *self);
+static const gchar *index_taken (GMediaDB *self, gchar *kvs[], guint id);
+
+static gchar *intern (GMediaDB *self, const gchar *str);
+static const gchar *intern_tag (GMediaDB *self, const gchar *tag);
+static const gchar *tag_key (GMediaDB *self, const gchar *tag);
+static const gchar *entry_tag (GMediaDB *self, GMediaDBEntry *entry, const gchar *tag);
+static void intern_release (GMediaDB *self);
+
+static GMediaDBEntry *entry_new (void);
+static void entry_unref (GMediaDBEntry *entry);
+static GMediaDBEntry *entry_writable (GMediaDB *self, guint id, GMediaDBEntry *entry);
+static GMediaDBEntry *entry_lookup (GMediaDB *self, guint id);
+static gboolean entry_exists (GMediaDB *self, guint id);
+static gboolean entry_remove (GMediaDB *self, guint id);
+static void aggregates_feed (GMediaDB *self, GMediaDBEntry *entry, gint sign);
+static void entry_feed (GMediaDB *self, guint id, GMediaDBEntry *entry, gint sign);
+static gboolean tag_equal (gconstpointer a, gconstpointer b);
+static const gchar *canonical_value (GMediaDB *self, const gchar *tag, const gchar *str);
+static const gchar *canonical_format (GMediaDB *self, const gchar *tag, const gchar *str, gchar *buf);
+static const gchar *value_format (GMediaDBTagType type, GMediaDBValue *value, gchar *buf);
+static void entry_set_value (GMediaDB *self, GMediaDBEntry *entry, const gchar *tag, const gchar *val);
+static gboolean schema_apply (GMediaDB *self, const gchar *tag, GMediaDBTagType type);
+static GMediaDBValue *entry_get_typed (GMediaDBEntry *entry, GMediaDBField *field);
+static gboolean value_parse (GMediaDBTagType type, const gchar *str, GMediaDBValue *value);
+static const gchar *value_to_string (GMediaDB *self, GMediaDBTagType type, GMediaDBValue *value);
+static const gchar *entry_get_value (GMediaDB *self, guint id, GMediaDBEntry *entry, const gchar *tag);
+static gchar **entry_to_strv (GMediaDB *self, guint id, GMediaDBEntry *entry, GMediaDBProjection *proj);
+static GHashTable *entry_to_info (GMediaDB *self, GMediaDBEntry *entry);
+static void entry_load_info (GMediaDB *self, GMediaDBEntry *entry, GHashTable *info);
 
 void media_added_cb (gpointer obj, guint id, GHashTable *info, GMediaDB *self);
 void media_updated_cb (gpointer obj, guint id, GHashTable *info, GMediaDB *self);
 void media_removed_cb (gpointer obj, guint id, GMediaDB *self);
-void gmediadb_flush_cb (gpointer obj, GMediaDB *self);
+void tag_type_changed_cb (gpointer obj, guint type, const gchar *tag, GMediaDB *self);
+void gmediadb_flush_cb (gpointer obj, gboolean background, GMediaDB *self);
 
 static void gmediadb_dbus_name_owner_changed (DBusGProxy *proxy, gchar *name,
     gchar *oowner, gchar *nowner, GMediaDB *self);
 static void gmediadb_dbus_name_acquired (DBusGProxy *proxy, gchar *name, GMediaDB *self);
+static void gmediadb_dbus_flushed (DBusGProxy *proxy, GMediaDB *self);
 static void gmediadb_dbus_connect (GMediaDB *self);
+static void gmediadb_dbus_connect_owner (GMediaDB *self);
+static void gmediadb_dbus_disconnect_owner (GMediaDB *self);
+static void pending_push (GMediaDB *self, GError *err, const gchar *method, guint id, GHashTable *info);
+static void pending_free (GMediaDBPending *pending);
+static void pending_replay (GMediaDB *self);
+
+static void
+gmediadb_dispose (GObject *object)
+{
+    GMediaDB *self = GMEDIADB (object);
+
+    g_static_mutex_lock (&instances_lock);
+    if (instances && g_hash_table_lookup (instances, self->priv->mtype) == self) {
+        g_hash_table_remove (instances, self->priv->mtype);
+    }
+    g_static_mutex_unlock (&instances_lock);
+
+    G_OBJECT_CLASS (gmediadb_parent_class)->dispose (object);
+}
 
 static void
 gmediadb_finalize (GObject *object)
 {
     GMediaDB *self = GMEDIADB (object);
 
-    gmediadb_flush_cb (NULL, self);
+    // Changes still queued from replicas have to reach the table first
+    if (!self->priv->mo_proxy) {
+        media_object_drain (self->priv->mo);
+    }
 
-    if (self->priv->mo_proxy) {
-        dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_added",
-           G_CALLBACK (media_added_cb), self);
-        dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_updated",
-            G_CALLBACK (media_updated_cb), self);
-        dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_removed",
-            G_CALLBACK (media_removed_cb), self);
+    // Replicas would have to pull every large value over the bus to write
+    // the store, and the owner holds the same data anyway. A lazily opened
+    // store that was only read is left as it is rather than decoded
+    if (!self->priv->mo_proxy &&
+        (!self->priv->lazy || media_object_is_modified (self->priv->mo))) {
+        gmediadb_flush_cb (NULL, FALSE, self);
+    }
 
+    gmediadb_flush_wait (self);
+
+    if (self->priv->mo_proxy) {
         dbus_g_proxy_call (self->priv->mo_proxy, "unref", NULL,
             G_TYPE_INVALID, G_TYPE_INVALID);
-        g_object_unref (self->priv->mo_proxy);
-        self->priv->mo_proxy = NULL;
+        gmediadb_dbus_disconnect_owner (self);
     }
 
+    g_queue_foreach (self->priv->pending, (GFunc) pending_free, NULL);
+    g_queue_free (self->priv->pending);
+    self->priv->pending = NULL;
+
     if (self->priv->mo) {
         g_object_unref (self->priv->mo);
         self->priv->mo = NULL;
@@ -91,7 +417,16 @@ gmediadb_finalize (GObject *object)
     g_hash_table_destroy (self->priv->table);
     self->priv->table = NULL;
 
+    g_hash_table_destroy (self->priv->indexes);
+    self->priv->indexes = NULL;
+
+    if (self->priv->lazy) {
+        snapshot_free (self->priv->lazy);
+        self->priv->lazy = NULL;
+    }
+
     close (self->priv->fd);
+    close (self->priv->lock_fd);
 
     if (self->priv->db_proxy) {
         g_object_unref (self->priv->db_proxy);
@@ -109,9 +444,24 @@ gmediadb_finalize (GObject *object)
     g_free (self->priv->fpath);
     self->priv->fpath = NULL;
 
+    g_hash_table_destroy (self->priv->tag_names);
+    self->priv->tag_names = NULL;
+
     g_string_chunk_free (self->priv->sc);
     self->priv->sc = NULL;
 
+    g_hash_table_destroy (self->priv->schema);
+    self->priv->schema = NULL;
+
+    g_slist_free (self->priv->free_slots);
+    self->priv->free_slots = NULL;
+
+    if (self->priv->pool_bit) {
+        intern_release (self);
+    }
+
+    g_static_rec_mutex_free (&self->priv->lock);
+
     G_OBJECT_CLASS (gmediadb_parent_class)->finalize (object);
 }
 
@@ -123,8 +473,19 @@ gmediadb_class_init (GMediaDBClass *klass)
 
     g_type_class_add_private ((gpointer) klass, sizeof (GMediaDBPrivate));
 
+    object_class->dispose = gmediadb_dispose;
     object_class->finalize = gmediadb_finalize;
 
+    // Flushes, rescans and scans use worker threads. Since GLib 2.24
+    // threads may be set up after other GLib calls, which configure checks
+    if (!g_thread_supported ()) {
+        g_thread_init (NULL);
+    }
+
+    // Those threads and the main loop share the session connection, which
+    // only locks once told to before the first bus is opened
+    dbus_g_thread_init ();
+
     signal_add = g_signal_new ("add-entry", G_TYPE_FROM_CLASS (klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
         G_TYPE_NONE, 1, G_TYPE_UINT);
@@ -136,6 +497,10 @@ gmediadb_class_init (GMediaDBClass *klass)
     signal_remove = g_signal_new ("remove-entry", G_TYPE_FROM_CLASS (klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT,
         G_TYPE_NONE, 1, G_TYPE_UINT);
+
+    signal_tag_type = g_signal_new ("tag-type-changed", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__STRING,
+        G_TYPE_NONE, 1, G_TYPE_STRING);
 }
 
 static void
@@ -143,8 +508,29 @@ gmediadb_init (GMediaDB *self)
 {
     self->priv = G_TYPE_INSTANCE_GET_PRIVATE((self), GMEDIADB_TYPE, GMediaDBPrivate);
 
-    self->priv->table = g_hash_table_new_full (g_int_hash, g_int_equal, g_free, (GDestroyNotify) g_hash_table_destroy);
+    self->priv->table = g_hash_table_new_full (g_int_hash, g_int_equal, g_free, (GDestroyNotify) entry_unref);
+    self->priv->lazy = NULL;
     self->priv->sc = g_string_chunk_new (5 * 1024);
+    self->priv->pool_bit = 0;
+    self->priv->tag_names = g_hash_table_new (g_str_hash, g_str_equal);
+    self->priv->schema = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    self->priv->num_slots = 0;
+    self->priv->free_slots = NULL;
+
+    self->priv->flush_job = NULL;
+    self->priv->flush_again = FALSE;
+
+    g_static_rec_mutex_init (&self->priv->lock);
+
+    self->priv->pending = g_queue_new ();
+    self->priv->unflushed = FALSE;
+    self->priv->blob_serial = 0;
+    self->priv->aggregates = NULL;
+    self->priv->indexes = g_hash_table_new_full (g_str_hash, g_str_equal,
+        NULL, (GDestroyNotify) g_hash_table_destroy);
+    self->priv->scan = NULL;
+    self->priv->id_floor = 1;
+    self->priv->reserved_next = self->priv->reserved_end = 0;
 
     self->priv->conn = NULL;
     self->priv->db_proxy = NULL;
@@ -152,12 +538,57 @@ gmediadb_init (GMediaDB *self)
     self->priv->mo = NULL;
 }
 
+static gchar*
+store_path (const gchar *mediatype)
+{
+    return g_strdup_printf ("%s/gmediadb/%s.db", g_get_user_config_dir (), mediatype);
+}
+
 GMediaDB*
 gmediadb_new (const gchar *mediatype)
 {
-    GMediaDB *self = g_object_new (GMEDIADB_TYPE, NULL);
+    return gmediadb_new_full (mediatype, 0);
+}
+
+GMediaDB*
+gmediadb_new_full (const gchar *mediatype, GMediaDBOpenFlags flags)
+{
+    GMediaDB *self;
+
+    g_static_mutex_lock (&instances_lock);
 
+    if (!instances) {
+        instances = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+    if ((self = g_hash_table_lookup (instances, mediatype))) {
+        g_object_ref (self);
+        g_static_mutex_unlock (&instances_lock);
+        return self;
+    }
+
+    self = g_object_new (GMEDIADB_TYPE, NULL);
     self->priv->mtype = g_strdup (mediatype);
+    g_hash_table_insert (instances, self->priv->mtype, self);
+
+    if (flags & GMEDIADB_OPEN_SHARED_STRINGS) {
+        g_static_mutex_lock (&pool_lock);
+
+        guint32 free_slots = ~pool_slots;
+
+        if (free_slots) {
+            self->priv->pool_bit = free_slots & -free_slots;
+            pool_slots |= self->priv->pool_bit;
+
+            if (!pool) {
+                pool = g_hash_table_new (g_str_hash, g_str_equal);
+            }
+        } else {
+            g_printerr ("Too many databases share strings, %s keeps its own\n", mediatype);
+        }
+
+        g_static_mutex_unlock (&pool_lock);
+    }
 
     gmediadb_dbus_connect (self);
 
@@ -167,364 +598,3235 @@ gmediadb_new (const gchar *mediatype)
     }
     g_free (path);
 
-    self->priv->fpath = g_strdup_printf ("%s/gmediadb/%s.db", g_get_user_config_dir (), self->priv->mtype);
+    self->priv->fpath = store_path (self->priv->mtype);
 
-    self->priv->fd = open (self->priv->fpath, O_CREAT | O_RDONLY, 0644);
-    flock (self->priv->fd, LOCK_EX);
+    gchar *lpath = g_strdup_printf ("%s.lock", self->priv->fpath);
+    self->priv->lock_fd = open (lpath, O_CREAT | O_RDWR, 0644);
+    g_free (lpath);
 
+    // Flushing replaces the file, so only open it once that is done. The
+    // owner answers after working through its queued calls first
     if (self->priv->mo_proxy) {
-        dbus_g_proxy_call (self->priv->mo_proxy, "flush_store", NULL,
-            G_TYPE_INVALID, G_TYPE_INVALID);
+        dbus_g_proxy_call_with_timeout (self->priv->mo_proxy, "flush_store",
+            GMEDIADB_BULK_TIMEOUT, NULL, G_TYPE_INVALID, G_TYPE_INVALID);
     }
 
+    self->priv->fd = open (self->priv->fpath, O_CREAT | O_RDONLY, 0644);
+    flock (self->priv->lock_fd, LOCK_EX);
+
     if (self->priv->fd != -1) {
-        GHashTable *info;
-        gint rid;
-        while ((info = read_entry (self->priv->fd, &rid, self->priv->sc)) != NULL) {
-            gint *id = g_new0 (gint, 1);
-            *id = rid;
-            g_hash_table_insert (self->priv->table, id, info);
+        GMediaDBEntry *entry;
+        goffset bstart = 0, dstart = 0;
+        gint rid, remaining = -1;
+
+        gint version = read_header (self->priv->fd, &remaining, &bstart, &dstart);
+        self->priv->version = version;
+
+        if (version >= 3) {
+            read_snapshot (self, lseek (self->priv->fd, 0, SEEK_CUR), bstart,
+                flags & GMEDIADB_OPEN_LAZY ? dstart : 0);
+        } else {
+            if (version == 2) {
+                read_schema (self->priv->fd, self);
+            }
+
+            // Stores written before the header was introduced run until EOF
+            while (remaining-- != 0 &&
+                   (entry = read_entry (self->priv->fd, &rid, self, bstart)) != NULL) {
+                gint *id = g_new0 (gint, 1);
+                *id = rid;
+                g_hash_table_insert (self->priv->table, id, entry);
+            }
         }
 
-        flock (self->priv->fd, LOCK_UN);
     } else {
         g_print ("Init Error Occured\n");
     }
 
+    flock (self->priv->lock_fd, LOCK_UN);
+
+    // Held until here, so nobody else gets a database still loading
+    g_static_mutex_unlock (&instances_lock);
+
     return self;
 }
 
-GPtrArray*
-gmediadb_get_entries (GMediaDB *self, GArray *ids, gchar *tags[])
+gboolean
+gmediadb_verify (const gchar *mediatype, guint *blocks, guint *damaged)
 {
-    GPtrArray *array = g_ptr_array_new ();
+    gchar *fpath = store_path (mediatype);
+    int fd = open (fpath, O_RDONLY);
+    goffset bstart = 0, dstart;
+    gint num;
 
-    gint i, j;
-    for (i = 0; i < ids->len; i++) {
-        gchar **entry;
-        GHashTable *tentry = g_hash_table_lookup (self->priv->table, &g_array_index (ids, gint, i));
+    g_free (fpath);
 
-        if (!tentry) {
-            continue;
-        }
+    if (fd == -1) {
+        return FALSE;
+    }
 
-        if (tags) {
-            gint num_keys = 0;
-            while (tags[num_keys++]);
-            num_keys--;
+    // Older stores carry no checksums
+    if (read_header (fd, &num, &bstart, &dstart) < 3) {
+        close (fd);
+        return FALSE;
+    }
 
-            entry = g_new0 (gchar*, num_keys);
+    GMediaDBReader *r = gmediadb_reader_new (fd, lseek (fd, 0, SEEK_CUR), bstart);
+    gmediadb_reader_verify (r);
 
-            for (j = 0; j < num_keys; j++) {
-                if (!g_strcmp0 (tags[j], "id")) {
-                    entry[j] = g_strdup_printf ("%d", g_array_index (ids, gint, i));
-                } else {
-                    entry[j] = g_hash_table_lookup (tentry, tags[j]);
-                }
-            }
-        } else {
-            gint num_keys = g_hash_table_size (tentry);
+    *blocks = gmediadb_reader_blocks (r);
+    *damaged = gmediadb_reader_damaged (r);
+
+    gmediadb_reader_free (r);
 
-            entry = g_new0 (gchar*, num_keys * 2 + 3);
+    if (bstart) {
+        goffset pos = bstart;
+        gchar *k, *data = NULL;
+        gint id, vlen;
+        guint32 crc;
 
-            entry[0] = "id";
-            entry[1] = g_strdup_printf ("%d", g_array_index (ids, gint, i));
+        while (read_blob_header (fd, &pos, &id, &k, &vlen)) {
+            data = g_realloc (data, vlen + sizeof (guint32));
 
-            j = 2;
+            if (pread (fd, data, vlen + sizeof (guint32), pos) != vlen + sizeof (guint32)) {
+                (*damaged)++;
+                g_free (k);
+                break;
+            }
 
-            GHashTableIter iter;
-            gpointer key, val;
-            g_hash_table_iter_init (&iter, tentry);
-            while (g_hash_table_iter_next (&iter, &key, &val)) {
-                entry[j++] = (gchar*) key;
-                entry[j++] = (gchar*) val;
+            memcpy (&crc, data + vlen, sizeof (guint32));
+            if (crc != gmediadb_crc32c (0, data, vlen)) {
+                (*damaged)++;
             }
+
+            (*blocks)++;
+            pos += vlen + sizeof (guint32);
+            g_free (k);
         }
 
-        g_ptr_array_add (array, entry);
+        g_free (data);
     }
 
-    return array;
+    close (fd);
+
+    return TRUE;
 }
 
-gchar**
-gmediadb_get_entry (GMediaDB *self, guint id, gchar *tags[])
+void
+gmediadb_set_flush_delay (GMediaDB *self, guint seconds)
 {
-    gchar **entry;
-    gint j;
-    GHashTable *tentry = g_hash_table_lookup (self->priv->table, &id);
+    media_object_set_flush_delay (self->priv->mo, seconds);
+}
+
+GMediaDBProjection*
+gmediadb_projection_new (GMediaDB *self, gchar *tags[])
+{
+    GMediaDBProjection *proj;
+    guint i;
 
-    if (!tentry) {
+    // The getters read every small value without one
+    if (!tags) {
         return NULL;
     }
 
-    if (tags) {
-        gint num_keys = 0;
-        while (tags[num_keys++]);
-        num_keys--;
-
-        entry = g_new0 (gchar*, num_keys);
+    proj = g_new0 (GMediaDBProjection, 1);
+    proj->n = g_strv_length (tags);
+    proj->names = g_new0 (gchar*, proj->n);
+    proj->tags = g_new0 (const gchar*, proj->n);
 
-        for (j = 0; j < num_keys; j++) {
-            if (!g_strcmp0 (tags[j], "id")) {
-                entry[j] = g_strdup_printf ("%d", id);
-            } else {
-                entry[j] = g_hash_table_lookup (tentry, tags[j]);
-            }
+    // Names no entry uses yet are only looked up, until one does
+    for (i = 0; i < proj->n; i++) {
+        if (g_strcmp0 (tags[i], "id")) {
+            proj->names[i] = g_strdup (tags[i]);
+            proj->tags[i] = tag_key (self, tags[i]);
         }
-    } else {
-        gint num_keys = g_hash_table_size (tentry);
+    }
 
-        entry = g_new0 (gchar*, num_keys * 2 + 3);
+    return proj;
+}
 
-        entry[0] = "id";
-        entry[1] = g_strdup_printf ("%d", id);
-        j = 2;
+void
+gmediadb_projection_free (GMediaDBProjection *proj)
+{
+    guint i;
 
-        GHashTableIter iter;
-        gpointer key, val;
-        g_hash_table_iter_init (&iter, tentry);
-        while (g_hash_table_iter_next (&iter, &key, &val)) {
-            entry[j++] = (gchar*) key;
-            entry[j++] = (gchar*) val;
-        }
+    if (!proj) {
+        return;
     }
 
-    return entry;
+    for (i = 0; i < proj->n; i++) {
+        g_free (proj->names[i]);
+    }
+
+    g_free (proj->names);
+    g_free (proj->tags);
+    g_free (proj);
+}
+
+// The value of column j, NULL when the entry lacks it
+static const gchar*
+projection_value (GMediaDB *self, GMediaDBProjection *proj, guint j, guint id, GMediaDBEntry *entry)
+{
+    if (!proj->tags[j] && !(proj->tags[j] = tag_key (self, proj->names[j]))) {
+        return NULL;
+    }
+
+    return entry_get_value (self, id, entry, proj->tags[j]);
 }
 
 GPtrArray*
-gmediadb_get_all_entries (GMediaDB *self, gchar *tags[])
+gmediadb_get_entries_projected (GMediaDB *self, GArray *ids, GMediaDBProjection *proj)
 {
-    GList *iter, *values, *i2, *keys;
-    gint i, j, num_keys = 0;
+    GPtrArray *array = g_ptr_array_sized_new (ids->len);
+
+    gint i;
+    for (i = 0; i < ids->len; i++) {
+        guint id = g_array_index (ids, gint, i);
+        GMediaDBEntry *entry = entry_lookup (self, id);
 
-    GPtrArray *array = g_ptr_array_new ();
+        if (!entry) {
+            continue;
+        }
+
+        g_ptr_array_add (array, entry_to_strv (self, id, entry, proj));
+    }
 
-    values = g_hash_table_get_values (self->priv->table);
-    keys = g_hash_table_get_keys (self->priv->table);
+    return array;
+}
 
-    for (iter = values, i2 = keys; iter; iter = iter->next, i2 = i2->next) {
-        gchar **entry;
-        GHashTable *tentry = (GHashTable*) iter->data;
+gchar**
+gmediadb_get_entry_projected (GMediaDB *self, guint id, GMediaDBProjection *proj)
+{
+    GMediaDBEntry *entry = entry_lookup (self, id);
 
-        if (tags) {
-            while (tags[num_keys++]);
-            num_keys--;
+    if (!entry) {
+        return NULL;
+    }
 
-            entry = g_new0 (gchar*, num_keys);
+    return entry_to_strv (self, id, entry, proj);
+}
 
-            for (j = 0; j < num_keys; j++) {
-                if (!g_strcmp0 (tags[j], "id")) {
-                    entry[j] = g_strdup_printf ("%d", *((gint*) i2->data));
-                } else {
-                    entry[j] = g_hash_table_lookup (tentry, tags[j]);
-                }
-            }
-        } else {
-            gint num_keys = g_hash_table_size (tentry);
+GPtrArray*
+gmediadb_get_all_entries_projected (GMediaDB *self, GMediaDBProjection *proj)
+{
+    lazy_load_all (self);
 
-            entry = g_new0 (gchar*, num_keys * 2 + 3);
+    GPtrArray *array = g_ptr_array_sized_new (g_hash_table_size (self->priv->table));
 
-            entry[0] = "id";
-            entry[1] = g_strdup_printf ("%d", *((gint*) i2->data));
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_ptr_array_add (array, entry_to_strv (self, *((gint*) key), (GMediaDBEntry*) val, proj));
+    }
 
-            j = 2;
+    return array;
+}
 
-            GHashTableIter iter;
-            gpointer key, val;
-            g_hash_table_iter_init (&iter, tentry);
-            while (g_hash_table_iter_next (&iter, &key, &val)) {
-                entry[j++] = (gchar*) key;
-                entry[j++] = (gchar*) val;
-            }
-        }
+GPtrArray*
+gmediadb_get_entries (GMediaDB *self, GArray *ids, gchar *tags[])
+{
+    GMediaDBProjection *proj = tags ? gmediadb_projection_new (self, tags) : NULL;
+    GPtrArray *array = gmediadb_get_entries_projected (self, ids, proj);
 
-        g_ptr_array_add (array, entry);
+    if (proj) {
+        gmediadb_projection_free (proj);
     }
 
     return array;
 }
 
-gboolean
-gmediadb_add_entry (GMediaDB *self, gchar *kvs[])
+gchar**
+gmediadb_get_entry (GMediaDB *self, guint id, gchar *tags[])
 {
-    GHashTable *nentry = g_hash_table_new (g_str_hash, g_str_equal);
+    GMediaDBProjection *proj = tags ? gmediadb_projection_new (self, tags) : NULL;
+    gchar **strv = gmediadb_get_entry_projected (self, id, proj);
 
-    gint i;
-    for (i = 0; kvs[i]; i += 2) {
-        if (g_strcmp0 (kvs[i], "id")) {
-            g_hash_table_insert (nentry,
-                g_string_chunk_insert_const (self->priv->sc, kvs[i]),
-                g_string_chunk_insert_const (self->priv->sc, kvs[i+1]));
-        }
+    if (proj) {
+        gmediadb_projection_free (proj);
     }
 
-    flock (self->priv->fd, LOCK_EX);
+    return strv;
+}
 
-    gint *nid = g_new0 (gint, 1);
-    *nid = 1;
+GPtrArray*
+gmediadb_get_all_entries (GMediaDB *self, gchar *tags[])
+{
+    GMediaDBProjection *proj = tags ? gmediadb_projection_new (self, tags) : NULL;
+    GPtrArray *array = gmediadb_get_all_entries_projected (self, proj);
 
-    GList *kl = g_hash_table_get_keys (self->priv->table);
-    for (; kl; kl = kl->next) {
-        if (*((gint*) kl->data) >= *nid) {
-            *nid = *((gint*) kl->data) + 1;
-        }
+    if (proj) {
+        gmediadb_projection_free (proj);
     }
 
-    g_hash_table_insert (self->priv->table, nid, nentry);
+    return array;
+}
 
-    if (self->priv->mo_proxy) {
-        GError *err = NULL;
-        if (!dbus_g_proxy_call (self->priv->mo_proxy, "add_entry", &err,
-            G_TYPE_UINT, *nid,
-            DBUS_TYPE_G_STRING_STRING_HASHTABLE, nentry,
-            G_TYPE_INVALID,
-            G_TYPE_INVALID)) {
-            g_printerr ("Unable to send add MediaObject: %d: %s\n", *nid, err->message);
-            g_error_free (err);
-            err = NULL;
+static void
+entry_get_values (GMediaDB *self, guint id, GMediaDBEntry *entry, GMediaDBProjection *proj, GPtrArray *values)
+{
+    guint j;
+
+    if (proj) {
+        for (j = 0; j < proj->n; j++) {
+            g_ptr_array_add (values, proj->names[j] ?
+                (gpointer) projection_value (self, proj, j, id, entry) : NULL);
         }
-    } else {
-        media_object_add_entry (self->priv->mo, *nid, nentry, NULL);
+
+        return;
     }
 
-    flock (self->priv->fd, LOCK_UN);
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, entry->tags);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_ptr_array_add (values, key);
+        g_ptr_array_add (values, val);
+    }
 
-    return TRUE;
+    g_ptr_array_add (values, NULL);
 }
 
-gboolean
-gmediadb_update_entry (GMediaDB *self, guint id, gchar *kvs[])
+void
+gmediadb_get_values_projected (GMediaDB *self, GArray *ids, GMediaDBProjection *proj,
+                               GArray *found, GPtrArray *values)
 {
-    GHashTable *entry = g_hash_table_lookup (self->priv->table, &id);
+    guint i;
 
-    if (!entry) {
-        return FALSE;
-    }
+    if (ids) {
+        for (i = 0; i < ids->len; i++) {
+            guint id = g_array_index (ids, gint, i);
+            GMediaDBEntry *entry = entry_lookup (self, id);
 
-    gint i;
-    for (i = 0; kvs[i]; i += 2) {
-        if (g_strcmp0 (kvs[i], "id")) {
-            if (kvs[i+1]) {
-                g_hash_table_insert (entry,
-                    g_string_chunk_insert_const (self->priv->sc, kvs[i]),
-                    g_string_chunk_insert_const (self->priv->sc, kvs[i+1]));
-            } else {
-                g_hash_table_remove (entry, kvs[i]);
+            if (entry) {
+                g_array_append_val (found, id);
+                entry_get_values (self, id, entry, proj, values);
             }
         }
-    }
-
-    flock (self->priv->fd, LOCK_EX);
 
-    if (self->priv->mo_proxy) {
-        GError *err = NULL;
-        if (!dbus_g_proxy_call (self->priv->mo_proxy, "update_entry", &err,
-            G_TYPE_UINT, id, DBUS_TYPE_G_STRING_STRING_HASHTABLE, entry,
-            G_TYPE_INVALID, G_TYPE_INVALID)) {
-            g_printerr ("Unable to send update MediaObject: %d: %s\n", id, err->message);
-            g_error_free (err);
-            err = NULL;
-        }
-    } else {
-        media_object_update_entry (self->priv->mo, id, entry, NULL);
+        return;
     }
 
-    flock (self->priv->fd, LOCK_UN);
+    lazy_load_all (self);
 
-    return TRUE;
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_array_append_val (found, *((gint*) key));
+        entry_get_values (self, *((gint*) key), (GMediaDBEntry*) val, proj, values);
+    }
 }
 
-gboolean
-gmediadb_remove_entry (GMediaDB *self, guint id)
+void
+gmediadb_get_values (GMediaDB *self, GArray *ids, gchar *tags[], GArray *found, GPtrArray *values)
 {
-    if (!g_hash_table_remove (self->priv->table, &id)) {
-        return FALSE;
-    }
+    GMediaDBProjection *proj = tags ? gmediadb_projection_new (self, tags) : NULL;
 
-    flock (self->priv->fd, LOCK_EX);
+    gmediadb_get_values_projected (self, ids, proj, found, values);
 
-    if (self->priv->mo_proxy) {
-        if (!dbus_g_proxy_call (self->priv->mo_proxy, "remove_entry", NULL,
-            G_TYPE_UINT, id,
-            G_TYPE_INVALID,
-            G_TYPE_INVALID)) {
-            g_printerr ("Unable to send remove MediaObject: %d\n", id);
-        }
-    } else {
-        media_object_remove_entry (self->priv->mo, id, NULL);
+    if (proj) {
+        gmediadb_projection_free (proj);
     }
+}
 
-    flock (self->priv->fd, LOCK_UN);
+static void
+foreach_table (GMediaDB *self, GHashTable *table, GMediaDBProjection *proj,
+               GMediaDBForeachFunc func, gpointer data)
+{
+    GPtrArray *row = g_ptr_array_new ();
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_ptr_array_set_size (row, 0);
+        entry_get_values (self, *((gint*) key), (GMediaDBEntry*) val, proj, row);
+        func (*((gint*) key), (const gchar**) row->pdata, data);
+    }
 
-    return TRUE;
+    g_ptr_array_free (row, TRUE);
 }
 
-// File Methods
 void
-write_entry (int fd, gint id, GHashTable *table)
+gmediadb_foreach (GMediaDB *self, GMediaDBProjection *proj, GMediaDBForeachFunc func, gpointer data)
 {
-    GList *ki, *vi;
-    gint i, size;
-    gchar *str;
-
-    size = g_hash_table_size (table);
-    ki = g_hash_table_get_keys (table);
-    vi = g_hash_table_get_values (table);
+    guint i;
 
-    write (fd, &id, sizeof (gint));
-    write (fd, &size, sizeof (gint));
+    foreach_table (self, self->priv->table, proj, func, data);
 
-    for (; ki && vi; ki = ki->next, vi = vi->next) {
-        str = (gchar*) ki->data;
-        for (i = 0; str[i]; i++);
-        write (fd, &i, sizeof (gint));
-        write (fd, str, i);
+    // Blocks not decoded yet are decoded one at a time and dropped again
+    for (i = 0; self->priv->lazy && i < self->priv->lazy->blocks->len; i++) {
+        GMediaDBBlock *block = g_ptr_array_index (self->priv->lazy->blocks, i);
 
-        str = (gchar*) vi->data;
-        for (i = 0; str[i]; i++);
-        write (fd, &i, sizeof (gint));
-        write (fd, str, i);
+        if (block->ids) {
+            GHashTable *table = lazy_scan_block (self, block);
+            foreach_table (self, table, proj, func, data);
+            g_hash_table_destroy (table);
+        }
     }
 }
 
-GHashTable*
-read_entry (int fd, int *id, GStringChunk *sc)
+static void
+large_tags_table (GHashTable *table, GHashTable *names)
 {
-    gint len, num, slen;
-    gint i, j;
+    GHashTableIter iter, biter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBEntry *entry = (GMediaDBEntry*) val;
 
-    len = read (fd, id, sizeof (gint));
-    if (len <= 0)
-        return NULL;
+        if (!entry->blobs) {
+            continue;
+        }
 
-    len = read (fd, &num, sizeof (gint));
+        g_hash_table_iter_init (&biter, entry->blobs);
+        while (g_hash_table_iter_next (&biter, &key, &val)) {
+            g_hash_table_insert (names, key, NULL);
+        }
+    }
+}
+
+gchar**
+gmediadb_get_large_tags (GMediaDB *self)
+{
+    GHashTable *names = g_hash_table_new (g_str_hash, g_str_equal);
+    guint i, n = 0;
+
+    large_tags_table (self->priv->table, names);
+
+    for (i = 0; self->priv->lazy && i < self->priv->lazy->blocks->len; i++) {
+        GMediaDBBlock *block = g_ptr_array_index (self->priv->lazy->blocks, i);
+
+        if (block->ids) {
+            GHashTable *table = lazy_scan_block (self, block);
+            large_tags_table (table, names);
+            g_hash_table_destroy (table);
+        }
+    }
+
+    gchar **tags = g_new0 (gchar*, g_hash_table_size (names) + 1);
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, names);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        tags[n++] = g_strdup (key);
+    }
+
+    g_hash_table_destroy (names);
+
+    return tags;
+}
+
+// want gets the value of each pair and keys its tag as entries know it
+static const gchar**
+query_prepare (GMediaDB *self, gchar *kvs[], gint *n, const gchar ***keys)
+{
+    gint i;
+
+    *n = kvs ? g_strv_length (kvs) / 2 : 0;
+    const gchar **want = g_new0 (const gchar*, *n + 1);
+    *keys = g_new0 (const gchar*, *n + 1);
+
+    for (i = 0; i < *n; i++) {
+        want[i] = canonical_value (self, kvs[2 * i], kvs[2 * i + 1]);
+        (*keys)[i] = tag_key (self, kvs[2 * i]);
+    }
+
+    return want;
+}
+
+static gboolean
+query_match (gchar *kvs[], const gchar **keys, const gchar **want, gint n, gint id, GMediaDBEntry *entry)
+{
+    gint i;
+
+    for (i = 0; i < n; i++) {
+        if (!g_strcmp0 (kvs[2 * i], "id")) {
+            if (id != g_ascii_strtoll (want[i], NULL, 10)) {
+                return FALSE;
+            }
+        } else if (!keys[i] || g_strcmp0 (g_hash_table_lookup (entry->tags, keys[i]), want[i])) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+GArray*
+gmediadb_query (GMediaDB *self, gchar *kvs[])
+{
+    GArray *ids = g_array_new (FALSE, FALSE, sizeof (gint));
+    gint n;
+    const gchar **keys;
+    const gchar **want = query_prepare (self, kvs, &n, &keys);
+
+    lazy_load_all (self);
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        gint id = *((gint*) key);
+
+        if (query_match (kvs, keys, want, n, id, (GMediaDBEntry*) val)) {
+            g_array_append_val (ids, id);
+        }
+    }
+
+    g_free (keys);
+    g_free (want);
+
+    return ids;
+}
+
+// Candidates come from memchr, which libc runs a word or vector at a time
+static gboolean
+scan_find_nocase (const gchar *str, const gchar *needle, gsize len)
+{
+    const gchar *end = str + strlen (str), *p = str, *a, *b;
+    gchar lower = needle[0], upper = g_ascii_toupper (needle[0]);
+
+    if (!len) {
+        return TRUE;
+    }
+
+    while ((gsize) (end - p) >= len) {
+        const gchar *limit = end - len + 1;
+
+        a = memchr (p, lower, limit - p);
+        b = lower == upper ? NULL : memchr (p, upper, (a ? a : limit) - p);
+
+        if (!(p = b ? b : a)) {
+            return FALSE;
+        }
+
+        if (!g_ascii_strncasecmp (p + 1, needle + 1, len - 1)) {
+            return TRUE;
+        }
+
+        p++;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+scan_number (GMediaDBScan *job, gdouble number)
+{
+    return job->op == GMEDIADB_SCAN_LESS ? number < job->number : number > job->number;
+}
+
+static gboolean
+scan_string (GMediaDBScan *job, const gchar *str)
+{
+    gchar *end;
+    gdouble number;
+
+    switch (job->op) {
+        case GMEDIADB_SCAN_EQUAL:
+            return !strcmp (str, job->needle);
+        case GMEDIADB_SCAN_CONTAINS:
+            return strstr (str, job->needle) != NULL;
+        case GMEDIADB_SCAN_CONTAINS_NOCASE:
+            return scan_find_nocase (str, job->needle, job->len);
+        default:
+            number = g_ascii_strtod (str, &end);
+            return end != str && !*end && scan_number (job, number);
+    }
+}
+
+static gpointer
+scan_thread (GMediaDBScan *job)
+{
+    gboolean numeric = job->op == GMEDIADB_SCAN_LESS || job->op == GMEDIADB_SCAN_GREATER;
+    guint i;
+
+    for (i = job->start; i < job->end; i++) {
+        GMediaDBEntry *entry = g_ptr_array_index (job->entries, i);
+        gboolean hit;
+
+        // Typed tags are compared as the numbers they are stored as
+        if (numeric && job->field) {
+            GMediaDBValue *value = entry_get_typed (entry, job->field);
+
+            if (!value) {
+                continue;
+            }
+
+            hit = scan_number (job, job->field->type == GMEDIADB_TAG_DOUBLE ?
+                value->v.d : (gdouble) value->v.i);
+        } else {
+            const gchar *str = job->tag ? g_hash_table_lookup (entry->tags, job->tag) : NULL;
+            GMediaDBBlob *blob;
+
+            // Large values are read from the store rather than kept
+            if (!str && job->tag && entry->blobs &&
+                (blob = g_hash_table_lookup (entry->blobs, job->tag))) {
+                gchar *data = NULL;
+
+                if (!(str = g_atomic_pointer_get ((gpointer*) &blob->data)) &&
+                    (job->self->priv->mo_proxy || !(str = data = blob_read (job->self->priv->fd,
+                        blob, job->self->priv->version)))) {
+                    g_array_append_val (job->later, i);
+                    continue;
+                }
+
+                hit = scan_string (job, str);
+                g_free (data);
+
+                if (hit) {
+                    g_array_append_val (job->found, g_array_index (job->ids, gint, i));
+                }
+
+                continue;
+            }
+
+            if (!str) {
+                continue;
+            }
+
+            guint slot = (GPOINTER_TO_UINT (str) >> 3) % GMEDIADB_SCAN_CACHE;
+
+            if (job->cache[slot] == str) {
+                hit = job->hits[slot];
+            } else {
+                hit = job->hits[slot] = scan_string (job, str);
+                job->cache[slot] = str;
+            }
+        }
+
+        if (hit) {
+            g_array_append_val (job->found, g_array_index (job->ids, gint, i));
+        }
+    }
+
+    return NULL;
+}
+
+GArray*
+gmediadb_scan (GMediaDB *self, const gchar *tag, GMediaDBScanOp op, const gchar *value)
+{
+    GArray *found = g_array_new (FALSE, FALSE, sizeof (gint));
+    GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+    gchar *needle;
+    guint i, n;
+
+    switch (op) {
+        case GMEDIADB_SCAN_EQUAL:
+            needle = g_strdup (canonical_value (self, tag, value));
+            break;
+        case GMEDIADB_SCAN_CONTAINS_NOCASE:
+            needle = g_ascii_strdown (value, -1);
+            break;
+        default:
+            needle = g_strdup (value);
+            break;
+    }
+
+    lazy_load_all (self);
+
+    // Entries are laid out in arrays first so each thread can take a range
+    n = g_hash_table_size (self->priv->table);
+    GArray *ids = g_array_sized_new (FALSE, FALSE, sizeof (gint), n);
+    GPtrArray *entries = g_ptr_array_sized_new (n);
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_array_append_val (ids, *((gint*) key));
+        g_ptr_array_add (entries, val);
+    }
+
+    n = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+    n = MAX (1, MIN (n, entries->len / GMEDIADB_SCAN_SLICE));
+
+    GMediaDBScan *jobs = g_new0 (GMediaDBScan, n);
+
+    for (i = 0; i < n; i++) {
+        GMediaDBScan *job = &jobs[i];
+
+        job->self = self;
+        job->tag = tag_key (self, tag);
+        job->field = field;
+        job->op = op;
+        job->needle = needle;
+        job->len = strlen (needle);
+        job->number = g_ascii_strtod (needle, NULL);
+
+        job->ids = ids;
+        job->entries = entries;
+        job->start = entries->len * i / n;
+        job->end = entries->len * (i + 1) / n;
+        job->found = g_array_new (FALSE, FALSE, sizeof (gint));
+        job->later = g_array_new (FALSE, FALSE, sizeof (guint));
+
+        if (i > 0) {
+            GError *err = NULL;
+            job->thread = g_thread_create ((GThreadFunc) scan_thread, job, TRUE, &err);
+
+            if (!job->thread) {
+                g_printerr ("Unable to start scan thread: %s\n", err->message);
+                g_error_free (err);
+            }
+        }
+    }
+
+    scan_thread (&jobs[0]);
+
+    for (i = 0; i < n; i++) {
+        if (jobs[i].thread) {
+            g_thread_join (jobs[i].thread);
+        } else if (i > 0) {
+            scan_thread (&jobs[i]);
+        }
+
+        g_array_append_vals (found, jobs[i].found->data, jobs[i].found->len);
+        g_array_free (jobs[i].found, TRUE);
+    }
+
+    // Fetching goes over the bus, so only this thread does it
+    for (i = 0; i < n; i++) {
+        guint j;
+
+        for (j = 0; j < jobs[i].later->len; j++) {
+            guint pos = g_array_index (jobs[i].later, guint, j);
+            gint id = g_array_index (ids, gint, pos);
+            const gchar *str = entry_get_value (self, id, g_ptr_array_index (entries, pos), jobs[i].tag);
+
+            if (str && scan_string (&jobs[i], str)) {
+                g_array_append_val (found, id);
+            }
+        }
+
+        g_array_free (jobs[i].later, TRUE);
+    }
+
+    g_free (jobs);
+    g_free (needle);
+    g_ptr_array_free (entries, TRUE);
+    g_array_free (ids, TRUE);
+
+    return found;
+}
+
+gboolean
+gmediadb_match (GMediaDB *self, guint id, gchar *kvs[])
+{
+    GMediaDBEntry *entry = entry_lookup (self, id);
+    gboolean res = FALSE;
+    gint n;
+
+    if (entry) {
+        const gchar **keys;
+        const gchar **want = query_prepare (self, kvs, &n, &keys);
+        res = query_match (kvs, keys, want, n, id, entry);
+        g_free (keys);
+        g_free (want);
+    }
+
+    return res;
+}
+
+// Changes the schema of this process only, returns whether it changed
+static gboolean
+schema_apply (GMediaDB *self, const gchar *tag, GMediaDBTagType type)
+{
+    GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+
+    if (field ? field->type == type : type == GMEDIADB_TAG_STRING) {
+        return FALSE;
+    }
+
+    // Convert what is already there, none of it shared with a flush
+    lazy_load_all (self);
+    gmediadb_flush_wait (self);
+    GHashTableIter iter;
+    gpointer key, val;
+
+    if (type == GMEDIADB_TAG_STRING) {
+        // Entries keep the values as strings as well, only the numbers go
+        g_hash_table_iter_init (&iter, self->priv->table);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            GMediaDBEntry *entry = (GMediaDBEntry*) val;
+
+            if (field->slot < entry->num_values) {
+                entry->values[field->slot].set = FALSE;
+            }
+        }
+
+        self->priv->free_slots = g_slist_prepend (self->priv->free_slots,
+            GINT_TO_POINTER (field->slot));
+        g_hash_table_remove (self->priv->schema, tag);
+    } else {
+        if (!field) {
+            field = g_new0 (GMediaDBField, 1);
+            field->tag = (gchar*) intern_tag (self, tag);
+
+            if (self->priv->free_slots) {
+                field->slot = GPOINTER_TO_INT (self->priv->free_slots->data);
+                self->priv->free_slots = g_slist_delete_link (self->priv->free_slots,
+                    self->priv->free_slots);
+            } else {
+                field->slot = self->priv->num_slots++;
+            }
+
+            g_hash_table_insert (self->priv->schema, field->tag, field);
+        }
+
+        field->type = type;
+
+        g_hash_table_iter_init (&iter, self->priv->table);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            GMediaDBEntry *entry = (GMediaDBEntry*) val;
+            const gchar *str = g_hash_table_lookup (entry->tags, field->tag);
+
+            if (str) {
+                entry_set_value (self, entry, field->tag, str);
+            }
+        }
+    }
+
+    // Values may have changed form, so aggregates and indexes start over
+    GList *l;
+    for (l = self->priv->aggregates; l; l = l->next) {
+        gmediadb_aggregate_clear (l->data);
+    }
+
+    g_hash_table_iter_init (&iter, self->priv->indexes);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_hash_table_remove_all ((GHashTable*) val);
+    }
+
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        entry_feed (self, *((gint*) key), (GMediaDBEntry*) val, 1);
+    }
+
+    g_signal_emit (self, signal_tag_type, 0, tag);
+
+    return TRUE;
+}
+
+// Every process has to agree on the schema, so the owner applies it and
+// tells the others
+void
+gmediadb_set_tag_type (GMediaDB *self, const gchar *tag, GMediaDBTagType type)
+{
+    if (self->priv->mo_proxy) {
+        GError *err = NULL;
+        if (!dbus_g_proxy_call (self->priv->mo_proxy, "set_tag_type", &err,
+            G_TYPE_STRING, tag,
+            G_TYPE_UINT, type,
+            G_TYPE_INVALID,
+            G_TYPE_INVALID)) {
+            g_printerr ("Unable to send tag type MediaObject: %s: %s\n", tag, err->message);
+            g_error_free (err);
+            return;
+        }
+
+        // Seen here before the owner's signal comes back
+        schema_apply (self, tag, type);
+    } else if (schema_apply (self, tag, type)) {
+        media_object_tag_type_changed (self->priv->mo, tag, type);
+    }
+}
+
+void
+tag_type_changed_cb (gpointer obj, guint type, const gchar *tag, GMediaDB *self)
+{
+    g_static_rec_mutex_lock (&self->priv->lock);
+    schema_apply (self, tag, type);
+    g_static_rec_mutex_unlock (&self->priv->lock);
+}
+
+void
+gmediadb_add_aggregate (GMediaDB *self, GMediaDBAggregate *agg)
+{
+    GList *aggregates = self->priv->aggregates;
+
+    // Aggregates follow every entry, so nothing is left to decode lazily
+    lazy_load_all (self);
+
+    self->priv->aggregates = g_list_prepend (NULL, agg);
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        aggregates_feed (self, (GMediaDBEntry*) val, 1);
+    }
+
+    self->priv->aggregates = g_list_concat (self->priv->aggregates, aggregates);
+}
+
+void
+gmediadb_remove_aggregate (GMediaDB *self, GMediaDBAggregate *agg)
+{
+    self->priv->aggregates = g_list_remove (self->priv->aggregates, agg);
+}
+
+GMediaDBTagType
+gmediadb_get_tag_type (GMediaDB *self, const gchar *tag)
+{
+    GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+
+    return field ? field->type : GMEDIADB_TAG_STRING;
+}
+
+gboolean
+gmediadb_get_int (GMediaDB *self, guint id, const gchar *tag, gint64 *value)
+{
+    GMediaDBEntry *entry = entry_lookup (self, id);
+    GMediaDBField *field;
+    GMediaDBValue *typed;
+
+    if (!entry) {
+        return FALSE;
+    }
+
+    if (!g_strcmp0 (tag, "id")) {
+        *value = id;
+        return TRUE;
+    }
+
+    field = g_hash_table_lookup (self->priv->schema, tag);
+    if (!field || !(typed = entry_get_typed (entry, field))) {
+        return FALSE;
+    }
+
+    *value = field->type == GMEDIADB_TAG_DOUBLE ? (gint64) typed->v.d : typed->v.i;
+
+    return TRUE;
+}
+
+gboolean
+gmediadb_get_double (GMediaDB *self, guint id, const gchar *tag, gdouble *value)
+{
+    GMediaDBEntry *entry = entry_lookup (self, id);
+    GMediaDBField *field;
+    GMediaDBValue *typed;
+
+    if (!entry) {
+        return FALSE;
+    }
+
+    if (!g_strcmp0 (tag, "id")) {
+        *value = id;
+        return TRUE;
+    }
+
+    field = g_hash_table_lookup (self->priv->schema, tag);
+    if (!field || !(typed = entry_get_typed (entry, field))) {
+        return FALSE;
+    }
+
+    *value = field->type == GMEDIADB_TAG_DOUBLE ? typed->v.d : (gdouble) typed->v.i;
+
+    return TRUE;
+}
+
+// One past the highest id in use, decoded or not
+static gint
+next_id (GMediaDB *self)
+{
+    gint id = self->priv->id_floor;
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        if (*((gint*) key) >= id) {
+            id = *((gint*) key) + 1;
+        }
+    }
+
+    if (self->priv->lazy) {
+        g_hash_table_iter_init (&iter, self->priv->lazy->pending);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            if (*((gint*) key) >= id) {
+                id = *((gint*) key) + 1;
+            }
+        }
+    }
+
+    return id;
+}
+
+guint
+gmediadb_reserve_ids (GMediaDB *self, guint count)
+{
+    gint first = next_id (self);
+
+    self->priv->id_floor = first + count;
+
+    return first;
+}
+
+void
+gmediadb_claim_id (GMediaDB *self, guint id)
+{
+    if ((gint) id >= self->priv->id_floor) {
+        self->priv->id_floor = id + 1;
+    }
+}
+
+// Only the owner knows every id in use, replicas ask it for theirs a
+// block at a time and hand them out until the block runs out
+static guint
+reserve_ids (GMediaDB *self, guint count)
+{
+    guint first = 0;
+
+    if (self->priv->mo_proxy) {
+        if (count <= self->priv->reserved_end - self->priv->reserved_next) {
+            first = self->priv->reserved_next;
+            self->priv->reserved_next += count;
+            return first;
+        }
+
+        guint n = MAX (count, GMEDIADB_ID_BLOCK);
+        GError *err = NULL;
+
+        if (dbus_g_proxy_call (self->priv->mo_proxy, "reserve_ids", &err,
+            G_TYPE_UINT, n, G_TYPE_INVALID,
+            G_TYPE_UINT, &first, G_TYPE_INVALID)) {
+            self->priv->reserved_next = first + count;
+            self->priv->reserved_end = first + n;
+            self->priv->id_floor = MAX (self->priv->id_floor, (gint) (first + n));
+
+            return first;
+        }
+
+        g_printerr ("Unable to reserve ids from MediaObject: %s\n", err->message);
+        g_error_free (err);
+    }
+
+    first = next_id (self);
+    self->priv->id_floor = first + count;
+
+    return first;
+}
+
+static GMediaDBEntry*
+entry_from_kvs (GMediaDB *self, gchar *kvs[])
+{
+    GMediaDBEntry *nentry = entry_new ();
+
+    gint i;
+    for (i = 0; kvs[i]; i += 2) {
+        if (g_strcmp0 (kvs[i], "id")) {
+            entry_set_value (self, nentry, kvs[i], kvs[i+1]);
+        }
+    }
+
+    return nentry;
+}
+
+static guint
+add_entry (GMediaDB *self, gchar *kvs[])
+{
+    const gchar *taken = index_taken (self, kvs, 0);
+
+    if (taken) {
+        g_printerr ("Unable to add entry, another one has its %s\n", taken);
+        return 0;
+    }
+
+    GMediaDBEntry *nentry = entry_from_kvs (self, kvs);
+
+    gint *nid = g_new0 (gint, 1);
+    *nid = reserve_ids (self, 1);
+
+    g_hash_table_insert (self->priv->table, nid, nentry);
+    entry_feed (self, *nid, nentry, 1);
+
+    GHashTable *info = entry_to_info (self, nentry);
+
+    if (self->priv->mo_proxy) {
+        pending_replay (self);
+
+        GError *err = NULL;
+        if (!dbus_g_proxy_call (self->priv->mo_proxy, "add_entry", &err,
+            G_TYPE_UINT, *nid,
+            DBUS_TYPE_G_STRING_STRING_HASHTABLE, info,
+            G_TYPE_INVALID,
+            G_TYPE_INVALID)) {
+            g_printerr ("Unable to send add MediaObject: %d: %s\n", *nid, err->message);
+            pending_push (self, err, "add_entry", *nid, info);
+            g_error_free (err);
+            err = NULL;
+        }
+    } else {
+        media_object_add_entry (self->priv->mo, *nid, info, NULL);
+    }
+
+    g_hash_table_destroy (info);
+
+    return *nid;
+}
+
+gboolean
+gmediadb_add_entry (GMediaDB *self, gchar *kvs[])
+{
+    return add_entry (self, kvs) != 0;
+}
+
+guint
+gmediadb_add_entries (GMediaDB *self, GPtrArray *entries)
+{
+    GArray *ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), entries->len);
+    GPtrArray *infos = g_ptr_array_sized_new (entries->len);
+    guint i;
+
+    guint first = reserve_ids (self, entries->len);
+
+    for (i = 0; i < entries->len; i++) {
+        const gchar *taken = index_taken (self, g_ptr_array_index (entries, i), 0);
+
+        // Earlier entries of the batch are in the indexes already
+        if (taken) {
+            g_printerr ("Unable to add entry %d of %d, another one has its %s\n",
+                i + 1, entries->len, taken);
+            continue;
+        }
+
+        GMediaDBEntry *nentry = entry_from_kvs (self, g_ptr_array_index (entries, i));
+
+        gint *nid = g_new0 (gint, 1);
+        *nid = first + i;
+
+        g_hash_table_insert (self->priv->table, nid, nentry);
+        entry_feed (self, *nid, nentry, 1);
+
+        g_array_append_val (ids, *nid);
+        g_ptr_array_add (infos, entry_to_info (self, nentry));
+    }
+
+    if (self->priv->mo_proxy) {
+        pending_replay (self);
+
+        GError *err = NULL;
+        if (!dbus_g_proxy_call_with_timeout (self->priv->mo_proxy, "add_entries", GMEDIADB_BULK_TIMEOUT, &err,
+            DBUS_TYPE_G_UINT_ARRAY, ids,
+            dbus_g_type_get_collection ("GPtrArray", DBUS_TYPE_G_STRING_STRING_HASHTABLE), infos,
+            G_TYPE_INVALID,
+            G_TYPE_INVALID)) {
+            g_printerr ("Unable to send add MediaObject: %d entries: %s\n", entries->len, err->message);
+            for (i = 0; i < ids->len; i++) {
+                pending_push (self, err, "add_entry", g_array_index (ids, guint, i),
+                    g_ptr_array_index (infos, i));
+            }
+            g_error_free (err);
+            err = NULL;
+        }
+    } else {
+        media_object_add_entries (self->priv->mo, ids, infos, NULL);
+    }
+
+    g_ptr_array_foreach (infos, (GFunc) g_hash_table_destroy, NULL);
+    g_ptr_array_free (infos, TRUE);
+    g_array_free (ids, TRUE);
+
+    return first;
+}
+
+gboolean
+gmediadb_update_entry (GMediaDB *self, guint id, gchar *kvs[])
+{
+    GMediaDBEntry *entry = entry_lookup (self, id);
+    const gchar *taken;
+
+    if (!entry) {
+        return FALSE;
+    }
+
+    if ((taken = index_taken (self, kvs, id))) {
+        g_printerr ("Unable to update %d, another entry has its %s\n", id, taken);
+        return FALSE;
+    }
+
+    entry = entry_writable (self, id, entry);
+    entry_feed (self, id, entry, -1);
+
+    gint i;
+    for (i = 0; kvs[i]; i += 2) {
+        if (g_strcmp0 (kvs[i], "id")) {
+            entry_set_value (self, entry, kvs[i], kvs[i+1]);
+        }
+    }
+
+    entry_feed (self, id, entry, 1);
+
+    GHashTable *info = entry_to_info (self, entry);
+
+    if (self->priv->mo_proxy) {
+        pending_replay (self);
+
+        GError *err = NULL;
+        if (!dbus_g_proxy_call (self->priv->mo_proxy, "update_entry", &err,
+            G_TYPE_UINT, id, DBUS_TYPE_G_STRING_STRING_HASHTABLE, info,
+            G_TYPE_INVALID, G_TYPE_INVALID)) {
+            g_printerr ("Unable to send update MediaObject: %d: %s\n", id, err->message);
+            pending_push (self, err, "update_entry", id, info);
+            g_error_free (err);
+            err = NULL;
+        }
+    } else {
+        media_object_update_entry (self->priv->mo, id, info, NULL);
+    }
+
+    g_hash_table_destroy (info);
+
+    return TRUE;
+}
+
+gboolean
+gmediadb_remove_entry (GMediaDB *self, guint id)
+{
+    if (!entry_remove (self, id)) {
+        return FALSE;
+    }
+
+    if (self->priv->mo_proxy) {
+        pending_replay (self);
+
+        GError *err = NULL;
+        if (!dbus_g_proxy_call (self->priv->mo_proxy, "remove_entry", &err,
+            G_TYPE_UINT, id,
+            G_TYPE_INVALID,
+            G_TYPE_INVALID)) {
+            g_printerr ("Unable to send remove MediaObject: %d\n", id);
+            pending_push (self, err, "remove_entry", id, NULL);
+            g_error_free (err);
+        }
+    } else {
+        media_object_remove_entry (self->priv->mo, id, NULL);
+    }
+
+    return TRUE;
+}
+
+// Values of an index belong to one entry. Changes made here are refused
+// before that could change, so this only happens to changes that came in
+// from other processes, which have to be applied anyway
+static void
+index_add (GHashTable *index, const gchar *tag, gpointer value, guint id)
+{
+    guint old = GPOINTER_TO_UINT (g_hash_table_lookup (index, value));
+
+    if (old && old != id) {
+        g_printerr ("%s %s of %d is held by %d as well\n", tag, (gchar*) value, id, old);
+    }
+
+    g_hash_table_insert (index, value, GUINT_TO_POINTER (id));
+}
+
+static void
+index_remove (GHashTable *index, gpointer value, guint id)
+{
+    if (GPOINTER_TO_UINT (g_hash_table_lookup (index, value)) == id) {
+        g_hash_table_remove (index, value);
+    }
+}
+
+// The first tag of kvs whose value another entry than id holds in an
+// index, NULL when there is none
+static const gchar*
+index_taken (GMediaDB *self, gchar *kvs[], guint id)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    GHashTable *index;
+    gint i;
+
+    for (i = 0; kvs[i]; i += 2) {
+        if (!(index = g_hash_table_lookup (self->priv->indexes, kvs[i]))) {
+            continue;
+        }
+
+        guint holder = GPOINTER_TO_UINT (g_hash_table_lookup (index,
+            canonical_format (self, kvs[i], kvs[i + 1], buf)));
+
+        if (holder && holder != id) {
+            return kvs[i];
+        }
+    }
+
+    return NULL;
+}
+
+void
+gmediadb_add_index (GMediaDB *self, const gchar *tag)
+{
+    if (g_hash_table_lookup (self->priv->indexes, tag)) {
+        return;
+    }
+
+    GHashTable *index = g_hash_table_new (g_str_hash, tag_equal);
+    const gchar *key_tag = intern_tag (self, tag);
+
+    // Indexes cover every entry, so nothing is left to decode lazily
+    lazy_load_all (self);
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        gpointer value = g_hash_table_lookup (((GMediaDBEntry*) val)->tags, key_tag);
+
+        if (value) {
+            index_add (index, key_tag, value, *((gint*) key));
+        }
+    }
+
+    g_hash_table_insert (self->priv->indexes, (gpointer) key_tag, index);
+}
+
+guint
+gmediadb_lookup (GMediaDB *self, const gchar *tag, const gchar *value)
+{
+    gmediadb_add_index (self, tag);
+
+    GHashTable *index = g_hash_table_lookup (self->priv->indexes, tag);
+
+    return GPOINTER_TO_UINT (g_hash_table_lookup (index, canonical_value (self, tag, value)));
+}
+
+static guint
+upsert_entry (GMediaDB *self, const gchar *key_tag, gchar *kvs[])
+{
+    gint i;
+
+    for (i = 0; kvs[i]; i += 2) {
+        if (!g_strcmp0 (kvs[i], key_tag)) {
+            break;
+        }
+    }
+
+    if (!kvs[i]) {
+        g_printerr ("Upsert without a %s value\n", key_tag);
+        return 0;
+    }
+
+    guint id = gmediadb_lookup (self, key_tag, kvs[i + 1]);
+
+    if (id) {
+        return gmediadb_update_entry (self, id, kvs) ? id : 0;
+    }
+
+    return add_entry (self, kvs);
+}
+
+guint
+gmediadb_upsert_entry (GMediaDB *self, const gchar *key_tag, gchar *kvs[])
+{
+    if (!self->priv->mo_proxy) {
+        return upsert_entry (self, key_tag, kvs);
+    }
+
+    // The owner decides, so two replicas can not both insert the key
+    GHashTable *info = g_hash_table_new (g_str_hash, g_str_equal);
+    GError *err = NULL;
+    guint id = 0;
+    gint i;
+
+    for (i = 0; kvs[i]; i += 2) {
+        g_hash_table_insert (info, kvs[i], kvs[i + 1]);
+    }
+
+    pending_replay (self);
+
+    if (!dbus_g_proxy_call (self->priv->mo_proxy, "upsert_entry", &err,
+        G_TYPE_STRING, key_tag,
+        DBUS_TYPE_G_STRING_STRING_HASHTABLE, info,
+        G_TYPE_INVALID,
+        G_TYPE_UINT, &id,
+        G_TYPE_INVALID)) {
+        g_printerr ("Unable to send upsert MediaObject: %s\n", err->message);
+        g_error_free (err);
+        id = 0;
+    }
+
+    g_hash_table_destroy (info);
+
+    return id;
+}
+
+guint
+gmediadb_upsert_info (GMediaDB *self, const gchar *key_tag, GHashTable *info)
+{
+    gchar **kvs = g_new0 (gchar*, 2 * g_hash_table_size (info) + 1);
+    gint i = 0;
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, info);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        kvs[i++] = key;
+        kvs[i++] = val;
+    }
+
+    guint id = upsert_entry (self, key_tag, kvs);
+
+    g_free (kvs);
+
+    return id;
+}
+
+// Large values still on disk are compared by length and by the checksum
+// stored after them, which only touches the file. -1 when neither tells
+static gint
+blob_differs (GMediaDB *self, GMediaDBBlob *blob, const gchar *val)
+{
+    const gchar *data = g_atomic_pointer_get ((gpointer*) &blob->data);
+    guint32 crc;
+
+    if (data) {
+        return strcmp (data, val) != 0;
+    }
+
+    if (strlen (val) != (gsize) blob->len) {
+        return TRUE;
+    }
+
+    if (blob->offset < 0 || self->priv->version < 3 ||
+        pread (self->priv->fd, &crc, sizeof (guint32), blob->offset + blob->len) != sizeof (guint32)) {
+        return -1;
+    }
+
+    return crc != gmediadb_crc32c (0, val, blob->len);
+}
+
+// TRUE when the record changes the entry, -1 when only loading its large
+// values can tell
+static gint
+reconcile_differs (GMediaDB *self, GMediaDBEntry *entry, const gchar *key_tag, gchar *kvs[])
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    GMediaDBBlob *blob;
+    gint i, res = FALSE;
+
+    for (i = 0; kvs[i]; i += 2) {
+        if (!g_strcmp0 (kvs[i], "id") || !g_strcmp0 (kvs[i], key_tag)) {
+            continue;
+        }
+
+        const gchar *have = entry_tag (self, entry, kvs[i]);
+        const gchar *want = canonical_format (self, kvs[i], kvs[i + 1], buf);
+
+        if (!have && entry->blobs && (blob = g_hash_table_lookup (entry->blobs, kvs[i]))) {
+            gint d = blob_differs (self, blob, want);
+
+            if (d > 0) {
+                return TRUE;
+            } else if (d < 0) {
+                res = -1;
+            }
+        } else if (g_strcmp0 (have, want)) {
+            return TRUE;
+        }
+    }
+
+    return res;
+}
+
+// Only reads the table, which nothing changes while the threads run
+static gpointer
+reconcile_thread (GMediaDBReconcile *job)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    guint i;
+    gint j;
+
+    for (i = job->start; i < job->end; i++) {
+        gchar **kvs = g_ptr_array_index (job->records, i);
+
+        if (job->dropped[i]) {
+            continue;
+        }
+
+        for (j = 0; kvs[j] && g_strcmp0 (kvs[j], job->key_tag); j += 2);
+
+        if (!kvs[j]) {
+            continue;
+        }
+
+        guint id = GPOINTER_TO_UINT (g_hash_table_lookup (job->index,
+            canonical_format (job->self, job->key_tag, kvs[j + 1], buf)));
+
+        if (!id) {
+            g_array_append_val (job->added, i);
+            continue;
+        }
+
+        g_array_append_val (job->seen, id);
+
+        gint d = reconcile_differs (job->self, g_hash_table_lookup (job->self->priv->table, &id),
+            job->key_tag, kvs);
+
+        if (d > 0) {
+            g_array_append_val (job->changed, id);
+            g_array_append_val (job->changed_pos, i);
+        } else if (d < 0) {
+            g_array_append_val (job->unsure, id);
+            g_array_append_val (job->unsure_pos, i);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+reconcile_apply (GMediaDB *self, GPtrArray *records, GArray *added,
+                 GArray *changed, GArray *changed_pos, GArray *missing)
+{
+    GArray *add_ids = g_array_sized_new (FALSE, FALSE, sizeof (guint), added->len);
+    GPtrArray *adds = g_ptr_array_sized_new (added->len);
+    GPtrArray *updates = g_ptr_array_sized_new (changed->len);
+    guint i;
+    gint j;
+
+    guint first = added->len ? reserve_ids (self, added->len) : 0;
+
+    for (i = 0; i < added->len; i++) {
+        GMediaDBEntry *nentry = entry_from_kvs (self,
+            g_ptr_array_index (records, g_array_index (added, guint, i)));
+
+        gint *nid = g_new0 (gint, 1);
+        *nid = first + i;
+
+        g_hash_table_insert (self->priv->table, nid, nentry);
+        entry_feed (self, *nid, nentry, 1);
+
+        g_array_append_val (add_ids, *nid);
+        g_ptr_array_add (adds, entry_to_info (self, nentry));
+    }
+
+    for (i = 0; i < changed->len; i++) {
+        guint id = g_array_index (changed, guint, i);
+        gchar **kvs = g_ptr_array_index (records, g_array_index (changed_pos, guint, i));
+        GMediaDBEntry *entry = entry_writable (self, id, entry_lookup (self, id));
+
+        entry_feed (self, id, entry, -1);
+
+        for (j = 0; kvs[j]; j += 2) {
+            if (g_strcmp0 (kvs[j], "id")) {
+                entry_set_value (self, entry, kvs[j], kvs[j+1]);
+            }
+        }
+
+        entry_feed (self, id, entry, 1);
+
+        g_ptr_array_add (updates, entry_to_info (self, entry));
+    }
+
+    for (i = 0; i < missing->len; i++) {
+        entry_remove (self, g_array_index (missing, guint, i));
+    }
+
+    if (self->priv->mo_proxy) {
+        pending_replay (self);
+
+        GError *err = NULL;
+        if (!dbus_g_proxy_call_with_timeout (self->priv->mo_proxy, "apply_changes", GMEDIADB_BULK_TIMEOUT, &err,
+            DBUS_TYPE_G_UINT_ARRAY, add_ids,
+            dbus_g_type_get_collection ("GPtrArray", DBUS_TYPE_G_STRING_STRING_HASHTABLE), adds,
+            DBUS_TYPE_G_UINT_ARRAY, changed,
+            dbus_g_type_get_collection ("GPtrArray", DBUS_TYPE_G_STRING_STRING_HASHTABLE), updates,
+            DBUS_TYPE_G_UINT_ARRAY, missing,
+            G_TYPE_INVALID,
+            G_TYPE_INVALID)) {
+            g_printerr ("Unable to send changes MediaObject: %s\n", err->message);
+            for (i = 0; i < add_ids->len; i++) {
+                pending_push (self, err, "add_entry", g_array_index (add_ids, guint, i),
+                    g_ptr_array_index (adds, i));
+            }
+            for (i = 0; i < changed->len; i++) {
+                pending_push (self, err, "update_entry", g_array_index (changed, guint, i),
+                    g_ptr_array_index (updates, i));
+            }
+            for (i = 0; i < missing->len; i++) {
+                pending_push (self, err, "remove_entry", g_array_index (missing, guint, i), NULL);
+            }
+            g_error_free (err);
+            err = NULL;
+        }
+    } else {
+        media_object_apply_changes (self->priv->mo, add_ids, adds, changed, updates, missing, NULL);
+    }
+
+    g_ptr_array_foreach (adds, (GFunc) g_hash_table_destroy, NULL);
+    g_ptr_array_foreach (updates, (GFunc) g_hash_table_destroy, NULL);
+    g_ptr_array_free (adds, TRUE);
+    g_ptr_array_free (updates, TRUE);
+    g_array_free (add_ids, TRUE);
+}
+
+void
+gmediadb_reconcile (GMediaDB *self, const gchar *key_tag, GPtrArray *records,
+                    gboolean apply, GArray *added, GArray *changed, GArray *missing,
+                    GArray *duplicates)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+    GArray *changed_pos = g_array_new (FALSE, FALSE, sizeof (guint));
+    GHashTable *seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+    guint i, j, n;
+
+    gmediadb_add_index (self, key_tag);
+
+    // Keys are unique, so of records sharing one only the last is used
+    gboolean *dropped = g_new0 (gboolean, records->len);
+    GHashTable *last = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < records->len; i++) {
+        gchar **kvs = g_ptr_array_index (records, i);
+        gpointer prev;
+
+        for (j = 0; kvs[j] && g_strcmp0 (kvs[j], key_tag); j += 2);
+
+        if (!kvs[j]) {
+            continue;
+        }
+
+        gchar *k = g_strdup (canonical_format (self, key_tag, kvs[j + 1], buf));
+
+        if ((prev = g_hash_table_lookup (last, k))) {
+            guint pos = GPOINTER_TO_UINT (prev) - 1;
+
+            dropped[pos] = TRUE;
+            if (duplicates) {
+                g_array_append_val (duplicates, pos);
+            }
+        }
+
+        g_hash_table_insert (last, k, GUINT_TO_POINTER (i + 1));
+    }
+
+    g_hash_table_destroy (last);
+
+    // Small scans are not worth a thread
+    n = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+    n = MAX (1, MIN (n, records->len / GMEDIADB_RECONCILE_SLICE));
+
+    GMediaDBReconcile *jobs = g_new0 (GMediaDBReconcile, n);
+
+    for (i = 0; i < n; i++) {
+        GMediaDBReconcile *job = &jobs[i];
+
+        job->self = self;
+        job->key_tag = key_tag;
+        job->index = g_hash_table_lookup (self->priv->indexes, key_tag);
+        job->records = records;
+        job->dropped = dropped;
+        job->start = records->len * i / n;
+        job->end = records->len * (i + 1) / n;
+
+        job->added = g_array_new (FALSE, FALSE, sizeof (guint));
+        job->changed = g_array_new (FALSE, FALSE, sizeof (guint));
+        job->changed_pos = g_array_new (FALSE, FALSE, sizeof (guint));
+        job->seen = g_array_new (FALSE, FALSE, sizeof (guint));
+        job->unsure = g_array_new (FALSE, FALSE, sizeof (guint));
+        job->unsure_pos = g_array_new (FALSE, FALSE, sizeof (guint));
+
+        if (i > 0) {
+            GError *err = NULL;
+            job->thread = g_thread_create ((GThreadFunc) reconcile_thread, job, TRUE, &err);
+
+            if (!job->thread) {
+                g_printerr ("Unable to start rescan thread: %s\n", err->message);
+                g_error_free (err);
+            }
+        }
+    }
+
+    reconcile_thread (&jobs[0]);
+
+    // Slices are merged in order, so added keeps the order of records
+    for (i = 0; i < n; i++) {
+        GMediaDBReconcile *job = &jobs[i];
+
+        if (job->thread) {
+            g_thread_join (job->thread);
+        } else if (i > 0) {
+            reconcile_thread (job);
+        }
+
+        g_array_append_vals (added, job->added->data, job->added->len);
+
+        g_array_append_vals (changed, job->changed->data, job->changed->len);
+        g_array_append_vals (changed_pos, job->changed_pos->data, job->changed_pos->len);
+
+        // Loading goes through the owner for replicas, so it is done here
+        for (j = 0; j < job->unsure->len; j++) {
+            guint id = g_array_index (job->unsure, guint, j);
+            guint pos = g_array_index (job->unsure_pos, guint, j);
+            gchar **kvs = g_ptr_array_index (records, pos);
+            GMediaDBEntry *entry = g_hash_table_lookup (self->priv->table, &id);
+            gint k;
+
+            for (k = 0; kvs[k]; k += 2) {
+                const gchar *tag = tag_key (self, kvs[k]);
+
+                if (tag) {
+                    entry_get_value (self, id, entry, tag);
+                }
+            }
+
+            if (reconcile_differs (self, entry, key_tag, kvs)) {
+                g_array_append_val (changed, id);
+                g_array_append_val (changed_pos, pos);
+            }
+        }
+
+        for (j = 0; j < job->seen->len; j++) {
+            g_hash_table_insert (seen, GUINT_TO_POINTER (g_array_index (job->seen, guint, j)),
+                GINT_TO_POINTER (TRUE));
+        }
+    }
+
+    // Entries sharing a scanned key with the one indexed go as well
+    const gchar *key = tag_key (self, key_tag);
+
+    GHashTableIter iter;
+    gpointer id_key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (key && g_hash_table_iter_next (&iter, &id_key, &val)) {
+        guint id = *((gint*) id_key);
+
+        if (g_hash_table_lookup (((GMediaDBEntry*) val)->tags, key) &&
+            !g_hash_table_lookup (seen, GUINT_TO_POINTER (id))) {
+            g_array_append_val (missing, id);
+        }
+    }
+
+    if (apply) {
+        reconcile_apply (self, records, added, changed, changed_pos, missing);
+    }
+
+    for (i = 0; i < n; i++) {
+        g_array_free (jobs[i].added, TRUE);
+        g_array_free (jobs[i].changed, TRUE);
+        g_array_free (jobs[i].changed_pos, TRUE);
+        g_array_free (jobs[i].seen, TRUE);
+        g_array_free (jobs[i].unsure, TRUE);
+        g_array_free (jobs[i].unsure_pos, TRUE);
+    }
+
+    g_free (jobs);
+    g_free (dropped);
+    g_hash_table_destroy (seen);
+    g_array_free (changed_pos, TRUE);
+}
+
+const gchar*
+gmediadb_lookup_value (GMediaDB *self, guint id, const gchar *tag)
+{
+    GMediaDBEntry *entry = entry_lookup (self, id);
+
+    if (!entry || !(tag = tag_key (self, tag))) {
+        return NULL;
+    }
+
+    return entry_get_value (self, id, entry, tag);
+}
+
+// String Methods
+static gchar*
+intern (GMediaDB *self, const gchar *str)
+{
+    gchar *key;
+
+    if (!self->priv->pool_bit) {
+        return g_string_chunk_insert_const (self->priv->sc, str);
+    }
+
+    g_static_mutex_lock (&pool_lock);
+
+    if (!(key = g_hash_table_lookup (pool, str))) {
+        gsize len = strlen (str);
+        guint32 *mem = g_malloc (sizeof (guint32) + len + 1);
+
+        key = (gchar*) (mem + 1);
+        memcpy (key, str, len + 1);
+        *mem = 0;
+
+        g_hash_table_insert (pool, key, key);
+    }
+
+    GMEDIADB_POOL_HOLDERS (key) |= self->priv->pool_bit;
+
+    g_static_mutex_unlock (&pool_lock);
+
+    return key;
+}
+
+static const gchar*
+intern_tag (GMediaDB *self, const gchar *tag)
+{
+    const gchar *key = g_hash_table_lookup (self->priv->tag_names, tag);
+
+    if (!key) {
+        key = intern (self, tag);
+        g_hash_table_insert (self->priv->tag_names, (gpointer) key, (gpointer) key);
+    }
+
+    return key;
+}
+
+// The key entries hold tag under, NULL when none ever had it
+static const gchar*
+tag_key (GMediaDB *self, const gchar *tag)
+{
+    return g_hash_table_lookup (self->priv->tag_names, tag);
+}
+
+static const gchar*
+entry_tag (GMediaDB *self, GMediaDBEntry *entry, const gchar *tag)
+{
+    const gchar *key = tag_key (self, tag);
+
+    return key ? g_hash_table_lookup (entry->tags, key) : NULL;
+}
+
+// Strings no other database holds are freed
+static void
+intern_release (GMediaDB *self)
+{
+    g_static_mutex_lock (&pool_lock);
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, pool);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        if (!(GMEDIADB_POOL_HOLDERS (key) &= ~self->priv->pool_bit)) {
+            g_hash_table_iter_remove (&iter);
+            g_free ((guint32*) key - 1);
+        }
+    }
+
+    pool_slots &= ~self->priv->pool_bit;
+
+    if (!pool_slots) {
+        g_hash_table_destroy (pool);
+        pool = NULL;
+    }
+
+    g_static_mutex_unlock (&pool_lock);
+
+    self->priv->pool_bit = 0;
+}
+
+// Entry Methods
+static void
+lazy_load_block (GMediaDB *self, GMediaDBBlock *block)
+{
+    GMediaDBSnapshot *snap = self->priv->lazy;
+    guint8 type;
+    guint i;
+
+    if (!block->ids) {
+        return;
+    }
+
+    if (gmediadb_reader_block_at (snap->r, block->pos, &type) &&
+        type == GMEDIADB_BLOCK_ENTRIES) {
+        while (!gmediadb_reader_done (snap->r) &&
+               read_snapshot_record (snap->r, type, self, snap->tags, snap->dicts, snap->bstart));
+    } else {
+        g_printerr ("Skipped damaged block at %" G_GINT64_FORMAT " in %s\n",
+            (gint64) block->pos, self->priv->fpath);
+    }
+
+    // Anything the block did not give back is lost
+    for (i = 0; i < block->ids->len; i++) {
+        gint id = g_array_index (block->ids, gint, i);
+
+        if (g_hash_table_lookup (snap->pending, &id) == block) {
+            g_hash_table_remove (snap->pending, &id);
+        }
+    }
+
+    g_array_free (block->ids, TRUE);
+    block->ids = NULL;
+
+    if (g_hash_table_size (snap->pending) == 0) {
+        snapshot_free (snap);
+        self->priv->lazy = NULL;
+    }
+}
+
+// Decodes a block into its own table, leaving the entries pending
+static GHashTable*
+lazy_scan_block (GMediaDB *self, GMediaDBBlock *block)
+{
+    GMediaDBSnapshot *snap = self->priv->lazy;
+    guint8 type;
+
+    self->priv->scan = g_hash_table_new_full (g_int_hash, g_int_equal,
+        g_free, (GDestroyNotify) entry_unref);
+
+    if (gmediadb_reader_block_at (snap->r, block->pos, &type) &&
+        type == GMEDIADB_BLOCK_ENTRIES) {
+        while (!gmediadb_reader_done (snap->r) &&
+               read_snapshot_record (snap->r, type, self, snap->tags, snap->dicts, snap->bstart));
+    } else {
+        g_printerr ("Skipped damaged block at %" G_GINT64_FORMAT " in %s\n",
+            (gint64) block->pos, self->priv->fpath);
+    }
+
+    GHashTable *table = self->priv->scan;
+    self->priv->scan = NULL;
+
+    return table;
+}
+
+static void
+lazy_load_all (GMediaDB *self)
+{
+    guint i;
+
+    for (i = 0; self->priv->lazy && i < self->priv->lazy->blocks->len; i++) {
+        lazy_load_block (self, g_ptr_array_index (self->priv->lazy->blocks, i));
+    }
+}
+
+// Finds an entry, decoding its block first when the store was opened lazily
+static GMediaDBEntry*
+entry_lookup (GMediaDB *self, guint id)
+{
+    GMediaDBEntry *entry = g_hash_table_lookup (self->priv->table, &id);
+    GMediaDBBlock *block;
+
+    if (!entry && self->priv->lazy &&
+        (block = g_hash_table_lookup (self->priv->lazy->pending, &id))) {
+        lazy_load_block (self, block);
+        entry = g_hash_table_lookup (self->priv->table, &id);
+    }
+
+    return entry;
+}
+
+static gboolean
+entry_exists (GMediaDB *self, guint id)
+{
+    return g_hash_table_lookup (self->priv->table, &id) ||
+        (self->priv->lazy && g_hash_table_lookup (self->priv->lazy->pending, &id));
+}
+
+static gboolean
+entry_remove (GMediaDB *self, guint id)
+{
+    GMediaDBEntry *entry = g_hash_table_lookup (self->priv->table, &id);
+    gboolean removed = FALSE;
+
+    if (entry) {
+        entry_feed (self, id, entry, -1);
+        removed = g_hash_table_remove (self->priv->table, &id);
+    }
+
+    if (self->priv->lazy && g_hash_table_remove (self->priv->lazy->pending, &id)) {
+        removed = TRUE;
+    }
+
+    return removed;
+}
+
+// Adds an entry to (sign 1) or takes it out of (sign -1) every aggregate
+static void
+aggregates_feed (GMediaDB *self, GMediaDBEntry *entry, gint sign)
+{
+    GList *l;
+
+    for (l = self->priv->aggregates; l; l = l->next) {
+        GMediaDBAggregate *agg = l->data;
+        gchar **group_by = gmediadb_aggregate_get_group_by (agg);
+        const gchar *tag = gmediadb_aggregate_get_tag (agg), *str;
+        const gchar **group = g_newa (const gchar*, group_by ? g_strv_length (group_by) : 0);
+        gboolean has_value = FALSE;
+        gdouble value = 0;
+        gint i;
+
+        for (i = 0; group_by && group_by[i]; i++) {
+            group[i] = entry_tag (self, entry, group_by[i]);
+        }
+
+        if (tag) {
+            GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+            GMediaDBValue *typed = field ? entry_get_typed (entry, field) : NULL;
+            gchar *end;
+
+            if (typed) {
+                value = field->type == GMEDIADB_TAG_DOUBLE ? typed->v.d : typed->v.i;
+                has_value = TRUE;
+            } else if ((str = entry_tag (self, entry, tag))) {
+                value = g_ascii_strtod (str, &end);
+                has_value = end != str;
+            }
+        }
+
+        gmediadb_aggregate_update (agg, group, has_value, value, sign);
+    }
+}
+
+// Keys are interned, so lookups with interned names skip the compare
+static gboolean
+tag_equal (gconstpointer a, gconstpointer b)
+{
+    return a == b || !strcmp (a, b);
+}
+
+static void
+indexes_feed (GMediaDB *self, guint id, GMediaDBEntry *entry, gint sign)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->indexes);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GHashTable *index = (GHashTable*) val;
+        gpointer value = g_hash_table_lookup (entry->tags, key);
+
+        if (!value) {
+            continue;
+        }
+
+        if (sign > 0) {
+            index_add (index, key, value, id);
+        } else {
+            index_remove (index, value, id);
+        }
+    }
+}
+
+static void
+entry_feed (GMediaDB *self, guint id, GMediaDBEntry *entry, gint sign)
+{
+    aggregates_feed (self, entry, sign);
+    indexes_feed (self, id, entry, sign);
+}
+
+static GMediaDBEntry*
+entry_new (void)
+{
+    GMediaDBEntry *entry = g_new0 (GMediaDBEntry, 1);
+
+    entry->ref = 1;
+    entry->tags = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    return entry;
+}
+
+static void
+blob_free (GMediaDBBlob *blob)
+{
+    g_free (blob->data);
+    g_free (blob);
+}
+
+static void
+entry_unref (GMediaDBEntry *entry)
+{
+    if (--entry->ref > 0) {
+        return;
+    }
+
+    g_hash_table_destroy (entry->tags);
+    g_free (entry->values);
+
+    if (entry->blobs) {
+        g_hash_table_destroy (entry->blobs);
+    }
+
+    g_free (entry);
+}
+
+// Entries a flush still holds are copied before they change
+static GMediaDBEntry*
+entry_writable (GMediaDB *self, guint id, GMediaDBEntry *entry)
+{
+    GMediaDBEntry *copy;
+
+    if (entry->ref == 1) {
+        return entry;
+    }
+
+    copy = entry_new ();
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, entry->tags);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_hash_table_insert (copy->tags, key, val);
+    }
+
+    if (entry->values) {
+        copy->values = g_memdup (entry->values, entry->num_values * sizeof (GMediaDBValue));
+        copy->num_values = entry->num_values;
+    }
+
+    if (entry->blobs) {
+        copy->blobs = g_hash_table_new_full (g_str_hash, g_str_equal,
+            NULL, (GDestroyNotify) blob_free);
+
+        g_hash_table_iter_init (&iter, entry->blobs);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            GMediaDBBlob *blob = g_memdup (val, sizeof (GMediaDBBlob));
+
+            blob->data = g_strdup (((GMediaDBBlob*) val)->data);
+            g_hash_table_insert (copy->blobs, key, blob);
+        }
+    }
+
+    gint *nid = g_new0 (gint, 1);
+    *nid = id;
+
+    g_hash_table_insert (self->priv->table, nid, copy);
+
+    return copy;
+}
+
+static GMediaDBBlob*
+entry_add_blob (GMediaDB *self, GMediaDBEntry *entry, const gchar *tag)
+{
+    GMediaDBBlob *blob = g_new0 (GMediaDBBlob, 1);
+    blob->offset = -1;
+    blob->serial = ++self->priv->blob_serial;
+
+    if (!entry->blobs) {
+        entry->blobs = g_hash_table_new_full (g_str_hash, g_str_equal,
+            NULL, (GDestroyNotify) blob_free);
+    }
+
+    tag = intern_tag (self, tag);
+
+    g_hash_table_remove (entry->tags, tag);
+    g_hash_table_insert (entry->blobs, (gpointer) tag, blob);
+
+    return blob;
+}
+
+static gboolean
+value_parse (GMediaDBTagType type, const gchar *str, GMediaDBValue *value)
+{
+    gchar *end;
+
+    switch (type) {
+        case GMEDIADB_TAG_DOUBLE:
+            value->v.d = g_ascii_strtod (str, &end);
+            return end != str && *end == '\0';
+        case GMEDIADB_TAG_TIME: {
+            GTimeVal tv;
+            if (g_time_val_from_iso8601 (str, &tv)) {
+                value->v.i = tv.tv_sec;
+                return TRUE;
+            }
+        }
+        // Fall through, plain seconds since the epoch
+        case GMEDIADB_TAG_INT:
+            value->v.i = g_ascii_strtoll (str, &end, 10);
+            return end != str && *end == '\0';
+        default:
+            return FALSE;
+    }
+}
+
+// buf holds at least G_ASCII_DTOSTR_BUF_SIZE bytes
+static const gchar*
+value_format (GMediaDBTagType type, GMediaDBValue *value, gchar *buf)
+{
+    if (type == GMEDIADB_TAG_DOUBLE) {
+        g_ascii_dtostr (buf, G_ASCII_DTOSTR_BUF_SIZE, value->v.d);
+    } else {
+        g_snprintf (buf, G_ASCII_DTOSTR_BUF_SIZE, "%" G_GINT64_FORMAT, value->v.i);
+    }
+
+    return buf;
+}
+
+static const gchar*
+value_to_string (GMediaDB *self, GMediaDBTagType type, GMediaDBValue *value)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    return intern (self, value_format (type, value, buf));
+}
+
+// Typed values are compared in the form they are stored in
+static const gchar*
+canonical_value (GMediaDB *self, const gchar *tag, const gchar *str)
+{
+    GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+    GMediaDBValue value;
+
+    if (field && value_parse (field->type, str, &value)) {
+        return value_to_string (self, field->type, &value);
+    }
+
+    return str;
+}
+
+// Same as canonical_value without interning, so threads may call it
+static const gchar*
+canonical_format (GMediaDB *self, const gchar *tag, const gchar *str, gchar *buf)
+{
+    GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+    GMediaDBValue value;
+
+    if (field && value_parse (field->type, str, &value)) {
+        return value_format (field->type, &value, buf);
+    }
+
+    return str;
+}
+
+static GMediaDBValue*
+entry_get_typed (GMediaDBEntry *entry, GMediaDBField *field)
+{
+    if (field->slot < entry->num_values && entry->values[field->slot].set) {
+        return &entry->values[field->slot];
+    }
+
+    return NULL;
+}
+
+static GMediaDBValue*
+entry_slot (GMediaDB *self, GMediaDBEntry *entry, GMediaDBField *field)
+{
+    if (field->slot >= entry->num_values) {
+        entry->values = g_renew (GMediaDBValue, entry->values, self->priv->num_slots);
+        memset (entry->values + entry->num_values, 0,
+            (self->priv->num_slots - entry->num_values) * sizeof (GMediaDBValue));
+        entry->num_values = self->priv->num_slots;
+    }
+
+    return &entry->values[field->slot];
+}
+
+static void
+entry_set_value (GMediaDB *self, GMediaDBEntry *entry, const gchar *tag, const gchar *val)
+{
+    GMediaDBField *field = g_hash_table_lookup (self->priv->schema, tag);
+
+    if (field && field->slot < entry->num_values) {
+        entry->values[field->slot].set = FALSE;
+    }
+
+    if (!val) {
+        g_hash_table_remove (entry->tags, tag_key (self, tag));
+        if (entry->blobs) {
+            g_hash_table_remove (entry->blobs, tag);
+        }
+    } else if (strlen (val) > GMEDIADB_BLOB_THRESHOLD) {
+        GMediaDBBlob *blob = entry_add_blob (self, entry, tag);
+        blob->data = g_strdup (val);
+        blob->len = strlen (val);
+    } else {
+        if (entry->blobs) {
+            g_hash_table_remove (entry->blobs, tag);
+        }
+
+        // Values that do not parse are kept as plain strings
+        if (field) {
+            GMediaDBValue *value = entry_slot (self, entry, field);
+
+            if ((value->set = value_parse (field->type, val, value))) {
+                val = value_to_string (self, field->type, value);
+            }
+        }
+
+        g_hash_table_insert (entry->tags,
+            (gpointer) intern_tag (self, tag),
+            intern (self, val));
+    }
+}
+
+static void
+entry_set_typed (GMediaDB *self, GMediaDBEntry *entry, GMediaDBField *field, GMediaDBValue *value)
+{
+    GMediaDBValue *slot = entry_slot (self, entry, field);
+
+    *slot = *value;
+    slot->set = TRUE;
+
+    g_hash_table_insert (entry->tags, field->tag,
+        (gpointer) value_to_string (self, field->type, slot));
+}
+
+// Reads a value from the blob region, NULL when it is missing or damaged.
+// Only touches the file, so flushes use it from their thread
+static gchar*
+blob_read (int fd, GMediaDBBlob *blob, gint version)
+{
+    // Values are followed by their checksum since version 3
+    gsize size = blob->len + (version >= 3 ? sizeof (guint32) : 0);
+    gchar *data;
+    guint32 crc;
+
+    if (blob->offset < 0) {
+        return NULL;
+    }
+
+    data = g_new0 (gchar, size + 1);
+
+    if (pread (fd, data, size, blob->offset) != size) {
+        g_free (data);
+        return NULL;
+    }
+
+    if (size > blob->len) {
+        memcpy (&crc, data + blob->len, sizeof (guint32));
+        if (crc != gmediadb_crc32c (0, data, blob->len)) {
+            g_free (data);
+            return NULL;
+        }
+
+        data[blob->len] = '\0';
+    }
+
+    return data;
+}
+
+static void
+blob_load (GMediaDB *self, guint id, const gchar *tag, GMediaDBBlob *blob)
+{
+    gchar *data = NULL;
+
+    if (self->priv->mo_proxy) {
+        GError *err = NULL;
+        if (!dbus_g_proxy_call (self->priv->mo_proxy, "get_value", &err,
+            G_TYPE_UINT, id, G_TYPE_STRING, tag, G_TYPE_INVALID,
+            G_TYPE_STRING, &data, G_TYPE_INVALID)) {
+            g_printerr ("Unable to fetch value from MediaObject: %d: %s\n", id, err->message);
+            g_error_free (err);
+            err = NULL;
+        }
+    } else if (blob->offset >= 0) {
+        if (!(data = blob_read (self->priv->fd, blob, self->priv->version))) {
+            g_printerr ("Damaged %s value for %d\n", tag, id);
+        }
+    }
+
+    // A flush thread may be looking at this blob
+    g_atomic_pointer_set ((gpointer*) &blob->data, data);
+}
+
+static const gchar*
+entry_get_value (GMediaDB *self, guint id, GMediaDBEntry *entry, const gchar *tag)
+{
+    const gchar *val = g_hash_table_lookup (entry->tags, tag);
+    GMediaDBBlob *blob;
+
+    if (val || !entry->blobs || !(blob = g_hash_table_lookup (entry->blobs, tag))) {
+        return val;
+    }
+
+    if (!blob->data) {
+        blob_load (self, id, tag, blob);
+    }
+
+    return blob->data;
+}
+
+static gchar**
+entry_to_strv (GMediaDB *self, guint id, GMediaDBEntry *entry, GMediaDBProjection *proj)
+{
+    gchar **strv;
+    guint j;
+
+    if (proj) {
+        strv = g_new0 (gchar*, proj->n);
+
+        for (j = 0; j < proj->n; j++) {
+            if (!proj->names[j]) {
+                strv[j] = g_strdup_printf ("%d", id);
+            } else {
+                strv[j] = (gchar*) projection_value (self, proj, j, id, entry);
+            }
+        }
+    } else {
+        gint num_keys = g_hash_table_size (entry->tags);
+
+        strv = g_new0 (gchar*, num_keys * 2 + 3);
+
+        strv[0] = "id";
+        strv[1] = g_strdup_printf ("%d", id);
+        j = 2;
+
+        // Large values are only handed out when asked for by name
+        GHashTableIter iter;
+        gpointer key, val;
+        g_hash_table_iter_init (&iter, entry->tags);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            strv[j++] = (gchar*) key;
+            strv[j++] = (gchar*) val;
+        }
+    }
+
+    return strv;
+}
+
+static GHashTable*
+entry_to_info (GMediaDB *self, GMediaDBEntry *entry)
+{
+    GHashTable *info = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *pending = NULL;
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, entry->tags);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_hash_table_insert (info, key, val);
+    }
+
+    if (entry->blobs) {
+        g_hash_table_iter_init (&iter, entry->blobs);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            GMediaDBBlob *blob = (GMediaDBBlob*) val;
+
+            if (blob->data) {
+                g_hash_table_insert (info, key, blob->data);
+            } else {
+                // Not loaded, so unchanged: the receiver keeps its copy
+                if (pending) {
+                    g_string_append_c (pending, '\n');
+                } else {
+                    pending = g_string_new (NULL);
+                }
+                g_string_append (pending, (gchar*) key);
+            }
+        }
+    }
+
+    if (pending) {
+        g_hash_table_insert (info, GMEDIADB_BLOB_TAGS,
+            intern (self, pending->str));
+        g_string_free (pending, TRUE);
+    }
+
+    return info;
+}
+
+static void
+entry_load_info (GMediaDB *self, GMediaDBEntry *entry, GHashTable *info)
+{
+    GHashTable *old_blobs = entry->blobs;
+    gchar **blob_tags = NULL;
+    gint i;
+
+    entry->blobs = NULL;
+    g_hash_table_remove_all (entry->tags);
+
+    if (entry->values) {
+        memset (entry->values, 0, entry->num_values * sizeof (GMediaDBValue));
+    }
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, info);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        if (!g_strcmp0 (key, GMEDIADB_BLOB_TAGS)) {
+            blob_tags = g_strsplit ((gchar*) val, "\n", 0);
+        } else {
+            entry_set_value (self, entry, (gchar*) key, (gchar*) val);
+        }
+    }
+
+    // The owner keeps its copy of values left out of the change, replicas
+    // drop theirs and fetch the current one from the owner
+    for (i = 0; blob_tags && blob_tags[i]; i++) {
+        GMediaDBBlob *old = old_blobs ? g_hash_table_lookup (old_blobs, blob_tags[i]) : NULL;
+
+        if (!old && !self->priv->mo_proxy) {
+            continue;
+        }
+
+        GMediaDBBlob *blob = entry_add_blob (self, entry, blob_tags[i]);
+
+        if (old) {
+            blob->offset = old->offset;
+            blob->len = old->len;
+            blob->serial = old->serial;
+
+            if (!self->priv->mo_proxy) {
+                blob->data = old->data;
+                old->data = NULL;
+            }
+        }
+    }
+
+    g_strfreev (blob_tags);
+
+    if (old_blobs) {
+        g_hash_table_destroy (old_blobs);
+    }
+}
+
+// File Methods
+static void
+write_header (int fd, gint num, goffset bstart, goffset dstart)
+{
+    gint version = GMEDIADB_VERSION;
+    gint64 off = bstart;
+
+    lseek (fd, 0, SEEK_SET);
+
+    write (fd, GMEDIADB_MAGIC, 4);
+    write (fd, &version, sizeof (gint));
+    write (fd, &num, sizeof (gint));
+    write (fd, &off, sizeof (gint64));
+
+    off = dstart;
+    write (fd, &off, sizeof (gint64));
+}
+
+static gint
+read_header (int fd, gint *num, goffset *bstart, goffset *dstart)
+{
+    gchar magic[4];
+    gint version;
+    gint64 off;
+
+    *dstart = 0;
+
+    if (read (fd, magic, 4) != 4 || memcmp (magic, GMEDIADB_MAGIC, 4)) {
+        lseek (fd, 0, SEEK_SET);
+        return 0;
+    }
+
+    read (fd, &version, sizeof (gint));
+    read (fd, num, sizeof (gint));
+    read (fd, &off, sizeof (gint64));
+
+    *bstart = off;
+
+    if (version >= 4) {
+        read (fd, &off, sizeof (gint64));
+        *dstart = off;
+    }
+
+    if (version > GMEDIADB_VERSION) {
+        g_printerr ("Unsupported store version: %d\n", version);
+        *num = 0;
+        return -1;
+    }
+
+    return version;
+}
+
+static void
+read_schema (int fd, GMediaDB *self)
+{
+    gint num, klen, type;
+
+    if (read (fd, &num, sizeof (gint)) != sizeof (gint)) {
+        return;
+    }
+
+    while (num-- > 0) {
+        read (fd, &klen, sizeof (gint));
+
+        gchar *k = g_new0 (gchar, klen + 1);
+        read (fd, k, klen);
+
+        read (fd, &type, sizeof (gint));
+
+        schema_apply (self, k, type);
+
+        g_free (k);
+    }
+}
+
+static void
+write_blobs (int fd, GMediaDBFlush *job, GMediaDBFlushItem *item)
+{
+    GMediaDBEntry *entry = item->entry;
+
+    if (!entry->blobs) {
+        return;
+    }
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, entry->blobs);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBBlob *blob = (GMediaDBBlob*) val;
+        GMediaDBFlushBlob written = { item->id, key, blob->serial, -1 };
+        gchar *data = g_atomic_pointer_get ((gpointer*) &blob->data), *copy = NULL;
+        gint klen = strlen ((gchar*) key);
+
+        if (g_hash_table_lookup (job->lost, blob)) {
+            continue;
+        }
+
+        // Values not in memory are copied over from the old store. One
+        // that went bad since it was checked keeps its place as zeros
+        if (!data && !(data = copy = blob_read (job->fd, blob, job->version))) {
+            data = copy = g_new0 (gchar, blob->len);
+        }
+
+        write (fd, &item->id, sizeof (gint));
+        write (fd, &klen, sizeof (gint));
+        write (fd, key, klen);
+        write (fd, &blob->len, sizeof (gint));
+
+        guint32 crc = gmediadb_crc32c (0, data, blob->len);
+
+        written.offset = lseek (fd, 0, SEEK_CUR);
+        write (fd, data, blob->len);
+        write (fd, &crc, sizeof (guint32));
+
+        g_array_append_val (job->blobs, written);
+        g_free (copy);
+    }
+}
+
+static GMediaDBEntry*
+read_entry (int fd, gint *id, GMediaDB *self, goffset bstart)
+{
+    gint len, num, klen;
+    guint vlen;
+
+    len = read (fd, id, sizeof (gint));
+    if (len <= 0)
+        return NULL;
+
+    len = read (fd, &num, sizeof (gint));
     if (len <= 0)
         return NULL;
 
-    GHashTable *info = g_hash_table_new (g_str_hash, g_str_equal);
+    GMediaDBEntry *entry = entry_new ();
+
+    while (num-- > 0) {
+        len = read (fd, &klen, sizeof (gint));
+
+        // A truncated or damaged store, keep what was read so far
+        if (len != sizeof (gint) || klen < 0 || klen > GMEDIADB_BLOCK_MAX) {
+            entry_unref (entry);
+            return NULL;
+        }
+
+        gchar *k = g_new0 (gchar, klen + 1);
+        len = read (fd, k, klen);
+
+        len = read (fd, &vlen, sizeof (guint));
+
+        if (len != sizeof (guint) ||
+            (vlen & ~(GMEDIADB_BLOB_FLAG | GMEDIADB_TYPED_FLAG)) > GMEDIADB_BLOCK_MAX) {
+            g_free (k);
+            entry_unref (entry);
+            return NULL;
+        }
+
+        if (vlen & GMEDIADB_BLOB_FLAG) {
+            gint64 off;
+            len = read (fd, &off, sizeof (gint64));
+
+            GMediaDBBlob *blob = entry_add_blob (self, entry, k);
+            blob->len = vlen & ~GMEDIADB_BLOB_FLAG;
+            blob->offset = bstart + off;
+        } else if (vlen & GMEDIADB_TYPED_FLAG) {
+            GMediaDBField *field = g_hash_table_lookup (self->priv->schema, k);
+            GMediaDBValue value;
+
+            len = read (fd, &value.v, sizeof (gint64));
+
+            if (field) {
+                entry_set_typed (self, entry, field, &value);
+            }
+        } else {
+            gchar *v = g_new0 (gchar, vlen + 1);
+            len = read (fd, v, vlen);
+
+            entry_set_value (self, entry, k, v);
+
+            g_free (v);
+        }
+
+        g_free (k);
+    }
+
+    return entry;
+}
+
+static GMediaDBDict*
+dict_lookup (GMediaDBFlush *job, GHashTable *dicts, GPtrArray *order, const gchar *tag)
+{
+    GMediaDBDict *dict = g_hash_table_lookup (dicts, tag);
+
+    if (!dict) {
+        dict = g_new0 (GMediaDBDict, 1);
+        dict->id = order->len;
+
+        // Typed values are written natively
+        if (!g_hash_table_lookup (job->schema, tag)) {
+            dict->values = g_hash_table_new (g_direct_hash, g_direct_equal);
+        }
+
+        g_ptr_array_add (order, (gpointer) tag);
+        g_hash_table_insert (dicts, (gpointer) tag, dict);
+    }
+
+    return dict;
+}
+
+static void
+dict_free (GMediaDBDict *dict)
+{
+    if (dict->values) {
+        g_hash_table_destroy (dict->values);
+    }
+
+    g_free (dict);
+}
+
+static void
+write_snapshot_entry (GMediaDBWriter *w, GMediaDBFlush *job, GHashTable *dicts,
+                      gint id, GMediaDBEntry *entry, goffset *boff)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+    gint size = g_hash_table_size (entry->tags);
+
+    if (entry->blobs) {
+        g_hash_table_iter_init (&iter, entry->blobs);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            if (!g_hash_table_lookup (job->lost, val)) {
+                size++;
+            }
+        }
+    }
+
+    gmediadb_writer_put_uint (w, id);
+    gmediadb_writer_put_uint (w, size);
+
+    g_hash_table_iter_init (&iter, entry->tags);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBDict *dict = g_hash_table_lookup (dicts, key);
+        GMediaDBField *field = g_hash_table_lookup (job->schema, key);
+        GMediaDBValue *typed = field ? entry_get_typed (entry, field) : NULL;
+
+        if (typed) {
+            gmediadb_writer_put_uint (w, dict->id << 2 | VALUE_TYPED);
+            gmediadb_writer_put_data (w, &typed->v, sizeof (gint64));
+        } else if (dict->values) {
+            gmediadb_writer_put_uint (w, dict->id << 2 | VALUE_DICT);
+            gmediadb_writer_put_uint (w, GPOINTER_TO_UINT (g_hash_table_lookup (dict->values, val)) - 1);
+        } else {
+            gmediadb_writer_put_uint (w, dict->id << 2 | VALUE_STRING);
+            gmediadb_writer_put_string (w, (gchar*) val);
+        }
+    }
+
+    if (!entry->blobs) {
+        return;
+    }
+
+    g_hash_table_iter_init (&iter, entry->blobs);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBDict *dict = g_hash_table_lookup (dicts, key);
+        GMediaDBBlob *blob = (GMediaDBBlob*) val;
+
+        if (g_hash_table_lookup (job->lost, blob)) {
+            continue;
+        }
+
+        // Offset of the value inside its blob record, see write_blobs
+        goffset off = *boff + 3 * sizeof (gint) + strlen ((gchar*) key);
+
+        gmediadb_writer_put_uint (w, dict->id << 2 | VALUE_BLOB);
+        gmediadb_writer_put_uint (w, blob->len);
+        gmediadb_writer_put_uint (w, off);
+
+        *boff = off + blob->len + sizeof (guint32);
+    }
+}
+
+static void
+write_snapshot (int fd, GMediaDBFlush *job, goffset *boff, goffset *dstart)
+{
+    GMediaDBWriter *w = gmediadb_writer_new (fd);
+    GHashTable *dicts = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+        NULL, (GDestroyNotify) dict_free);
+    GPtrArray *order = g_ptr_array_new ();
+    guint i;
+
+    // Number the tags and count the distinct values of each one. Keys and
+    // values are interned, so pointers compare as well as the strings do
+    GHashTableIter iter, titer;
+    gpointer key, val, tag, str;
+    for (i = 0; i < job->items->len; i++) {
+        GMediaDBEntry *entry = g_array_index (job->items, GMediaDBFlushItem, i).entry;
+
+        g_hash_table_iter_init (&titer, entry->tags);
+        while (g_hash_table_iter_next (&titer, &tag, &str)) {
+            GMediaDBDict *dict = dict_lookup (job, dicts, order, tag);
+
+            dict->count++;
+
+            if (!dict->values) {
+                continue;
+            }
+
+            g_hash_table_insert (dict->values, str, GUINT_TO_POINTER (1));
+
+            if (g_hash_table_size (dict->values) > GMEDIADB_DICT_LIMIT &&
+                g_hash_table_size (dict->values) * 2 > dict->count) {
+                g_hash_table_destroy (dict->values);
+                dict->values = NULL;
+            }
+        }
+
+        if (entry->blobs) {
+            g_hash_table_iter_init (&titer, entry->blobs);
+            while (g_hash_table_iter_next (&titer, &tag, &str)) {
+                dict_lookup (job, dicts, order, tag);
+            }
+        }
+    }
+
+    gmediadb_writer_begin (w, GMEDIADB_BLOCK_SCHEMA);
+    g_hash_table_iter_init (&iter, job->schema);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBField *field = (GMediaDBField*) val;
+
+        gmediadb_writer_put_string (w, field->tag);
+        gmediadb_writer_put_uint (w, field->type);
+        gmediadb_writer_end_record (w);
+    }
+
+    gmediadb_writer_begin (w, GMEDIADB_BLOCK_TAGS);
+    for (i = 0; i < order->len; i++) {
+        gmediadb_writer_put_uint (w, i);
+        gmediadb_writer_put_string (w, g_ptr_array_index (order, i));
+        gmediadb_writer_end_record (w);
+    }
+
+    // Ids are explicit so a damaged block does not shift the ones after it
+    gmediadb_writer_begin (w, GMEDIADB_BLOCK_VALUES);
+    for (i = 0; i < order->len; i++) {
+        GMediaDBDict *dict = g_hash_table_lookup (dicts, g_ptr_array_index (order, i));
+        GList *values, *vi;
+        guint vid = 0;
+
+        if (!dict->values) {
+            continue;
+        }
+
+        values = g_hash_table_get_keys (dict->values);
+        for (vi = values; vi; vi = vi->next) {
+            g_hash_table_insert (dict->values, vi->data, GUINT_TO_POINTER (vid + 1));
+
+            gmediadb_writer_put_uint (w, dict->id);
+            gmediadb_writer_put_uint (w, vid++);
+            gmediadb_writer_put_string (w, (gchar*) vi->data);
+            gmediadb_writer_end_record (w);
+        }
+        g_list_free (values);
+    }
+
+    // Remember which entries went into which block for the directory
+    GArray *dpos = g_array_new (FALSE, FALSE, sizeof (goffset));
+    GArray *dcount = g_array_new (FALSE, TRUE, sizeof (guint));
+    GArray *dids = g_array_sized_new (FALSE, FALSE, sizeof (gint), job->items->len);
+
+    gmediadb_writer_begin (w, GMEDIADB_BLOCK_ENTRIES);
+    for (i = 0; i < job->items->len; i++) {
+        GMediaDBFlushItem *item = &g_array_index (job->items, GMediaDBFlushItem, i);
+        goffset pos = gmediadb_writer_tell (w);
+
+        if (!dpos->len || g_array_index (dpos, goffset, dpos->len - 1) != pos) {
+            g_array_append_val (dpos, pos);
+            g_array_set_size (dcount, dpos->len);
+        }
+
+        g_array_index (dcount, guint, dcount->len - 1)++;
+        g_array_append_val (dids, item->id);
+
+        write_snapshot_entry (w, job, dicts, item->id, item->entry, boff);
+        gmediadb_writer_end_record (w);
+    }
+
+    gmediadb_writer_begin (w, GMEDIADB_BLOCK_DIRECTORY);
+    *dstart = gmediadb_writer_tell (w);
+
+    guint j, n = 0;
+    for (i = 0; i < dpos->len; i++) {
+        guint count = g_array_index (dcount, guint, i);
+
+        gmediadb_writer_put_uint (w, g_array_index (dpos, goffset, i));
+        gmediadb_writer_put_uint (w, count);
+
+        for (j = 0; j < count; j++) {
+            gmediadb_writer_put_uint (w, g_array_index (dids, gint, n++));
+        }
+
+        gmediadb_writer_end_record (w);
+    }
+
+    gmediadb_writer_free (w);
+
+    g_array_free (dpos, TRUE);
+    g_array_free (dcount, TRUE);
+    g_array_free (dids, TRUE);
+
+    g_ptr_array_free (order, TRUE);
+    g_hash_table_destroy (dicts);
+}
+
+static gboolean
+read_snapshot_value (GMediaDBReader *r, GMediaDB *self, GMediaDBEntry *entry,
+                     GPtrArray *tags, GPtrArray *dicts, goffset bstart)
+{
+    guint64 code, val, off;
+    const gchar *tag = NULL, *str;
+    GPtrArray *dict = NULL;
+
+    if (!gmediadb_reader_get_uint (r, &code)) {
+        return FALSE;
+    }
+
+    // Values whose tag or dictionary entry was in a damaged block are
+    // read past and dropped
+    if ((code >> 2) < tags->len) {
+        tag = g_ptr_array_index (tags, code >> 2);
+        dict = g_ptr_array_index (dicts, code >> 2);
+    }
+
+    switch (code & 3) {
+        case VALUE_STRING:
+            if (!(str = gmediadb_reader_get_string (r))) {
+                return FALSE;
+            }
+
+            if (tag) {
+                entry_set_value (self, entry, tag, str);
+            }
+            break;
+        case VALUE_DICT:
+            if (!gmediadb_reader_get_uint (r, &val)) {
+                return FALSE;
+            }
+
+            // Dictionary values are interned already
+            if (tag && dict && val < dict->len && g_ptr_array_index (dict, val)) {
+                g_hash_table_insert (entry->tags, (gpointer) tag, g_ptr_array_index (dict, val));
+            }
+            break;
+        case VALUE_TYPED: {
+            GMediaDBField *field = tag ? g_hash_table_lookup (self->priv->schema, tag) : NULL;
+            GMediaDBValue value;
+
+            if (!gmediadb_reader_get_data (r, &value.v, sizeof (gint64))) {
+                return FALSE;
+            }
+
+            if (field) {
+                entry_set_typed (self, entry, field, &value);
+            }
+            break;
+        }
+        case VALUE_BLOB: {
+            if (!gmediadb_reader_get_uint (r, &val) || !gmediadb_reader_get_uint (r, &off) ||
+                val > GMEDIADB_BLOCK_MAX) {
+                return FALSE;
+            }
+
+            if (tag) {
+                GMediaDBBlob *blob = entry_add_blob (self, entry, tag);
+                blob->len = val;
+                blob->offset = bstart + off;
+            }
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+read_snapshot_record (GMediaDBReader *r, guint8 type, GMediaDB *self,
+                      GPtrArray *tags, GPtrArray *dicts, goffset bstart)
+{
+    const gchar *str;
+    guint64 num, id;
+
+    switch (type) {
+        case GMEDIADB_BLOCK_SCHEMA:
+            if (!(str = gmediadb_reader_get_string (r)) || !gmediadb_reader_get_uint (r, &num)) {
+                return FALSE;
+            }
+
+            schema_apply (self, str, num);
+            return TRUE;
+        case GMEDIADB_BLOCK_TAGS:
+            if (!gmediadb_reader_get_uint (r, &id) || id > GMEDIADB_BLOCK_MAX ||
+                !(str = gmediadb_reader_get_string (r))) {
+                return FALSE;
+            }
+
+            if (id >= tags->len) {
+                g_ptr_array_set_size (tags, id + 1);
+                g_ptr_array_set_size (dicts, id + 1);
+            }
+
+            g_ptr_array_index (tags, id) = (gpointer) intern_tag (self, str);
+            return TRUE;
+        case GMEDIADB_BLOCK_VALUES: {
+            GPtrArray *dict;
+
+            if (!gmediadb_reader_get_uint (r, &num) || num >= dicts->len ||
+                !gmediadb_reader_get_uint (r, &id) || id > GMEDIADB_BLOCK_MAX ||
+                !(str = gmediadb_reader_get_string (r))) {
+                return FALSE;
+            }
+
+            if (!(dict = g_ptr_array_index (dicts, num))) {
+                dict = g_ptr_array_index (dicts, num) = g_ptr_array_new ();
+            }
+
+            if (id >= dict->len) {
+                g_ptr_array_set_size (dict, id + 1);
+            }
+
+            g_ptr_array_index (dict, id) = intern (self, str);
+            return TRUE;
+        }
+        case GMEDIADB_BLOCK_ENTRIES: {
+            if (!gmediadb_reader_get_uint (r, &id) || !gmediadb_reader_get_uint (r, &num)) {
+                return FALSE;
+            }
+
+            GMediaDBEntry *entry = entry_new ();
+
+            while (num-- > 0) {
+                if (!read_snapshot_value (r, self, entry, tags, dicts, bstart)) {
+                    entry_unref (entry);
+                    return FALSE;
+                }
+            }
+
+            gint *nid = g_new0 (gint, 1);
+            *nid = id;
+
+            // Lazily decoded entries that were removed or replaced meanwhile
+            if (self->priv->lazy && !g_hash_table_lookup (self->priv->lazy->pending, nid)) {
+                entry_unref (entry);
+                g_free (nid);
+                return TRUE;
+            }
+
+            if (self->priv->scan) {
+                g_hash_table_insert (self->priv->scan, nid, entry);
+                return TRUE;
+            }
+
+            g_hash_table_insert (self->priv->table, nid, entry);
+            entry_feed (self, *nid, entry, 1);
+            return TRUE;
+        }
+        default:
+            // Unknown block, skip the rest of it
+            return FALSE;
+    }
+}
+
+static void
+read_directory (GMediaDB *self, GMediaDBSnapshot *snap, goffset dstart, goffset bstart)
+{
+    GMediaDBReader *r = gmediadb_reader_new (self->priv->fd, dstart, bstart);
+    guint64 pos, num, id;
+    guint8 type;
+
+    while (gmediadb_reader_next_block (r, &type)) {
+        if (type != GMEDIADB_BLOCK_DIRECTORY) {
+            continue;
+        }
+
+        while (!gmediadb_reader_done (r) &&
+               gmediadb_reader_get_uint (r, &pos) && gmediadb_reader_get_uint (r, &num)) {
+            GMediaDBBlock *block = g_new0 (GMediaDBBlock, 1);
+
+            block->pos = pos;
+            block->ids = g_array_new (FALSE, FALSE, sizeof (gint));
+            g_ptr_array_add (snap->blocks, block);
+
+            while (num-- > 0 && gmediadb_reader_get_uint (r, &id)) {
+                gint *nid = g_new0 (gint, 1);
+                *nid = id;
+
+                g_array_append_val (block->ids, *nid);
+                g_hash_table_insert (snap->pending, nid, block);
+            }
+        }
+    }
+
+    if (gmediadb_reader_damaged (r)) {
+        g_printerr ("Skipped %d damaged blocks in %s\n",
+            gmediadb_reader_damaged (r), self->priv->fpath);
+    }
+
+    gmediadb_reader_free (r);
+}
+
+static void
+block_free (GMediaDBBlock *block)
+{
+    if (block->ids) {
+        g_array_free (block->ids, TRUE);
+    }
+
+    g_free (block);
+}
+
+static void
+snapshot_free (GMediaDBSnapshot *snap)
+{
+    guint i;
+
+    for (i = 0; i < snap->dicts->len; i++) {
+        if (g_ptr_array_index (snap->dicts, i)) {
+            g_ptr_array_free (g_ptr_array_index (snap->dicts, i), TRUE);
+        }
+    }
+
+    g_ptr_array_free (snap->dicts, TRUE);
+    g_ptr_array_free (snap->tags, TRUE);
+
+    g_ptr_array_foreach (snap->blocks, (GFunc) block_free, NULL);
+    g_ptr_array_free (snap->blocks, TRUE);
+    g_hash_table_destroy (snap->pending);
+
+    gmediadb_reader_free (snap->r);
+    g_free (snap);
+}
+
+// With a directory at dstart only the dictionaries are read now, entries
+// are decoded from their blocks when first asked for
+static void
+read_snapshot (GMediaDB *self, goffset start, goffset bstart, goffset dstart)
+{
+    GMediaDBSnapshot *snap = g_new0 (GMediaDBSnapshot, 1);
+    guint8 type;
+
+    snap->r = gmediadb_reader_new (self->priv->fd, start, dstart ? dstart : bstart);
+    snap->tags = g_ptr_array_new ();
+    snap->dicts = g_ptr_array_new ();
+    snap->bstart = bstart;
+    snap->blocks = g_ptr_array_new ();
+    snap->pending = g_hash_table_new_full (g_int_hash, g_int_equal, g_free, NULL);
+
+    // One block at a time, the dictionaries only hold interned pointers
+    while (gmediadb_reader_next_block (snap->r, &type)) {
+        if (dstart && type == GMEDIADB_BLOCK_ENTRIES) {
+            break;
+        }
+
+        while (!gmediadb_reader_done (snap->r) &&
+               read_snapshot_record (snap->r, type, self, snap->tags, snap->dicts, bstart));
+    }
+
+    if (gmediadb_reader_damaged (snap->r)) {
+        g_printerr ("Skipped %d damaged blocks in %s\n",
+            gmediadb_reader_damaged (snap->r), self->priv->fpath);
+    }
+
+    if (dstart) {
+        read_directory (self, snap, dstart, bstart);
+    }
+
+    if (g_hash_table_size (snap->pending) > 0) {
+        self->priv->lazy = snap;
+    } else {
+        snapshot_free (snap);
+    }
+}
+
+static void
+reindex_blobs (GMediaDB *self)
+{
+    gint num, id, vlen;
+    goffset bstart = 0, dstart;
+
+    // Our file is the one from before the old owner flushed, so decode
+    // what is left of it and move over to the current one
+    lazy_load_all (self);
+
+    close (self->priv->fd);
+    self->priv->fd = open (self->priv->fpath, O_CREAT | O_RDONLY, 0644);
+
+    // Offsets recorded at load time are stale once the old owner flushed
+    GHashTableIter iter, biter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBEntry *entry = (GMediaDBEntry*) val;
 
-    while (num-- > 0) {
-        len = read (fd, &slen, sizeof (gint));
+        if (!entry->blobs) {
+            continue;
+        }
+
+        g_hash_table_iter_init (&biter, entry->blobs);
+        while (g_hash_table_iter_next (&biter, &key, &val)) {
+            ((GMediaDBBlob*) val)->offset = -1;
+        }
+    }
+
+    lseek (self->priv->fd, 0, SEEK_SET);
+    self->priv->version = read_header (self->priv->fd, &num, &bstart, &dstart);
+
+    if (self->priv->version <= 0 || bstart == 0) {
+        return;
+    }
 
-        gchar *k = g_new0 (gchar, slen + 1);
-        len = read (fd, k, slen);
+    goffset pos = bstart;
+    gchar *k;
 
-        len = read (fd, &slen, sizeof (gint));
+    while (read_blob_header (self->priv->fd, &pos, &id, &k, &vlen)) {
+        GMediaDBEntry *entry = g_hash_table_lookup (self->priv->table, &id);
+        GMediaDBBlob *blob = entry && entry->blobs ? g_hash_table_lookup (entry->blobs, k) : NULL;
 
-        gchar *v = g_new0 (gchar, slen + 1);
-        len = read (fd, v, slen);
+        if (blob && !blob->data) {
+            blob->offset = pos;
+            blob->len = vlen;
 
-        g_hash_table_insert (info,
-            g_string_chunk_insert_const (sc, k),
-            g_string_chunk_insert_const (sc, v));
+            // The old owner went away without writing the newer value
+            if (blob->stale > self->priv->flushes) {
+                g_printerr ("Value of %s for %d may be out of date\n", k, id);
+            }
+        }
 
+        pos += vlen + (self->priv->version >= 3 ? sizeof (guint32) : 0);
         g_free (k);
-        g_free (v);
+    }
+}
+
+// Reads id, tag and value length of the blob record at pos and moves pos
+// to the start of its value
+static gboolean
+read_blob_header (int fd, goffset *pos, gint *id, gchar **key, gint *vlen)
+{
+    gint head[2];
+
+    if (pread (fd, head, sizeof (head), *pos) != sizeof (head) ||
+        head[1] < 0 || head[1] > GMEDIADB_BLOCK_MAX) {
+        return FALSE;
     }
 
-    return info;
+    *id = head[0];
+    *key = g_new0 (gchar, head[1] + 1);
+
+    if (pread (fd, *key, head[1], *pos + sizeof (head)) != head[1] ||
+        pread (fd, vlen, sizeof (gint), *pos + sizeof (head) + head[1]) != sizeof (gint) ||
+        *vlen < 0 || *vlen > GMEDIADB_BLOCK_MAX) {
+        g_free (*key);
+        return FALSE;
+    }
+
+    *pos += sizeof (head) + head[1] + sizeof (gint);
+
+    return TRUE;
 }
 
 // DBus Methods
@@ -547,7 +3849,12 @@ gmediadb_dbus_connect (GMediaDB *self)
         err = NULL;
     }
 
+    // Replicas stay queued for the name, the bus hands it to the first of
+    // them as soon as the owner goes
     if (res != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        self->priv->dbus_name = g_strdup (dbus_bus_get_unique_name (
+            dbus_g_connection_get_connection (self->priv->conn)));
+
         dbus_g_proxy_add_signal (self->priv->db_proxy, "NameAcquired",
             G_TYPE_STRING, G_TYPE_INVALID);
         dbus_g_proxy_connect_signal (self->priv->db_proxy, "NameAcquired",
@@ -558,41 +3865,199 @@ gmediadb_dbus_connect (GMediaDB *self)
         dbus_g_proxy_connect_signal (self->priv->db_proxy, "NameOwnerChanged",
             G_CALLBACK (gmediadb_dbus_name_owner_changed), self, NULL);
 
-        self->priv->mo_proxy = dbus_g_proxy_new_for_name (self->priv->conn,
-            self->priv->dbus_mo_name, self->priv->dbus_mo_path, "org.gnome.GMediaDB.MediaObject");
-
         dbus_g_object_register_marshaller (g_cclosure_marshal_VOID__UINT_POINTER,
             G_TYPE_NONE, G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
-        dbus_g_proxy_add_signal (self->priv->mo_proxy, "media_added",
-            G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
-        dbus_g_proxy_add_signal (self->priv->mo_proxy, "media_updated",
-            G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
-        dbus_g_proxy_add_signal (self->priv->mo_proxy, "media_removed",
-            G_TYPE_UINT, G_TYPE_INVALID);
+        dbus_g_object_register_marshaller (g_cclosure_marshal_VOID__UINT_POINTER,
+            G_TYPE_NONE, G_TYPE_UINT, G_TYPE_STRING, G_TYPE_INVALID);
 
-        dbus_g_proxy_connect_signal (self->priv->mo_proxy, "media_added",
-            G_CALLBACK (media_added_cb), self, NULL);
-        dbus_g_proxy_connect_signal (self->priv->mo_proxy, "media_updated",
-            G_CALLBACK (media_updated_cb), self, NULL);
-        dbus_g_proxy_connect_signal (self->priv->mo_proxy, "media_removed",
-            G_CALLBACK (media_removed_cb), self, NULL);
+        gmediadb_dbus_connect_owner (self);
     }
 
     // Create our copy of the dbus object and connect signals
-    self->priv->mo = media_object_new ();
+    self->priv->mo = media_object_new (self, self->priv->conn, self->priv->dbus_mo_path);
     dbus_g_connection_register_g_object (self->priv->conn,
         self->priv->dbus_mo_path, G_OBJECT (self->priv->mo));
 
-    g_signal_connect (self->priv->mo, "media_added",
+    g_signal_connect (self->priv->mo, "entry_added",
         G_CALLBACK (media_added_cb), self);
     g_signal_connect (self->priv->mo, "media_removed",
         G_CALLBACK (media_removed_cb), self);
-    g_signal_connect (self->priv->mo, "media_updated",
+    g_signal_connect (self->priv->mo, "entry_updated",
         G_CALLBACK (media_updated_cb), self);
     g_signal_connect (self->priv->mo, "flush",
         G_CALLBACK (gmediadb_flush_cb), self);
 }
 
+static void
+gmediadb_dbus_connect_owner (GMediaDB *self)
+{
+    self->priv->mo_proxy = dbus_g_proxy_new_for_name (self->priv->conn,
+        self->priv->dbus_mo_name, self->priv->dbus_mo_path, "org.gnome.GMediaDB.MediaObject");
+
+    dbus_g_proxy_add_signal (self->priv->mo_proxy, "media_added",
+        G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
+    dbus_g_proxy_add_signal (self->priv->mo_proxy, "media_updated",
+        G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE, G_TYPE_INVALID);
+    dbus_g_proxy_add_signal (self->priv->mo_proxy, "media_removed",
+        G_TYPE_UINT, G_TYPE_INVALID);
+    dbus_g_proxy_add_signal (self->priv->mo_proxy, "flushed", G_TYPE_INVALID);
+    dbus_g_proxy_add_signal (self->priv->mo_proxy, "tag_type_changed",
+        G_TYPE_UINT, G_TYPE_STRING, G_TYPE_INVALID);
+
+    dbus_g_proxy_connect_signal (self->priv->mo_proxy, "media_added",
+        G_CALLBACK (media_added_cb), self, NULL);
+    dbus_g_proxy_connect_signal (self->priv->mo_proxy, "media_updated",
+        G_CALLBACK (media_updated_cb), self, NULL);
+    dbus_g_proxy_connect_signal (self->priv->mo_proxy, "media_removed",
+        G_CALLBACK (media_removed_cb), self, NULL);
+    dbus_g_proxy_connect_signal (self->priv->mo_proxy, "flushed",
+        G_CALLBACK (gmediadb_dbus_flushed), self, NULL);
+    dbus_g_proxy_connect_signal (self->priv->mo_proxy, "tag_type_changed",
+        G_CALLBACK (tag_type_changed_cb), self, NULL);
+}
+
+static void
+gmediadb_dbus_disconnect_owner (GMediaDB *self)
+{
+    dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_added",
+       G_CALLBACK (media_added_cb), self);
+    dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_updated",
+        G_CALLBACK (media_updated_cb), self);
+    dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_removed",
+        G_CALLBACK (media_removed_cb), self);
+    dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "flushed",
+        G_CALLBACK (gmediadb_dbus_flushed), self);
+    dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "tag_type_changed",
+        G_CALLBACK (tag_type_changed_cb), self);
+
+    g_object_unref (self->priv->mo_proxy);
+    self->priv->mo_proxy = NULL;
+}
+
+// Only the changes the owner never answered need sending, anything it
+// did answer was announced before the answer went out
+//
+// A missing reply is not one of them, the owner may still be working
+// through the call and replaying it later would undo newer changes
+static gboolean
+owner_lost (GError *err)
+{
+    return err->domain == DBUS_GERROR &&
+        (err->code == DBUS_GERROR_SERVICE_UNKNOWN ||
+         err->code == DBUS_GERROR_NAME_HAS_NO_OWNER ||
+         err->code == DBUS_GERROR_DISCONNECTED);
+}
+
+static void
+pending_push (GMediaDB *self, GError *err, const gchar *method, guint id, GHashTable *info)
+{
+    if (!owner_lost (err)) {
+        return;
+    }
+
+    GMediaDBPending *pending = g_new0 (GMediaDBPending, 1);
+
+    pending->method = method;
+    pending->id = id;
+
+    if (info) {
+        pending->info = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        GHashTableIter iter;
+        gpointer key, val;
+        g_hash_table_iter_init (&iter, info);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            g_hash_table_insert (pending->info, g_strdup (key), g_strdup (val));
+        }
+    }
+
+    g_queue_push_tail (self->priv->pending, pending);
+}
+
+static void
+pending_free (GMediaDBPending *pending)
+{
+    if (pending->info) {
+        g_hash_table_destroy (pending->info);
+    }
+
+    g_free (pending);
+}
+
+// Every change is safe to repeat, the new owner may have seen some of them.
+// Also run ahead of each new call, so anything still queued reaches the
+// owner before the newer change does and leaves the queue
+static void
+pending_replay (GMediaDB *self)
+{
+    GMediaDBPending *pending;
+    GError *err = NULL;
+
+    while ((pending = g_queue_pop_head (self->priv->pending))) {
+        if (!self->priv->mo_proxy) {
+            if (pending->info && !g_strcmp0 (pending->method, "add_entry")) {
+                media_object_add_entry (self->priv->mo, pending->id, pending->info, NULL);
+            } else if (pending->info) {
+                media_object_update_entry (self->priv->mo, pending->id, pending->info, NULL);
+            } else {
+                media_object_remove_entry (self->priv->mo, pending->id, NULL);
+            }
+        } else if (pending->info ?
+            !dbus_g_proxy_call (self->priv->mo_proxy, pending->method, &err,
+                G_TYPE_UINT, pending->id,
+                DBUS_TYPE_G_STRING_STRING_HASHTABLE, pending->info,
+                G_TYPE_INVALID, G_TYPE_INVALID) :
+            !dbus_g_proxy_call (self->priv->mo_proxy, pending->method, &err,
+                G_TYPE_UINT, pending->id,
+                G_TYPE_INVALID, G_TYPE_INVALID)) {
+            g_printerr ("Unable to resend %s MediaObject: %d: %s\n",
+                pending->method, pending->id, err->message);
+
+            // Gone as well, the next owner gets the rest
+            if (owner_lost (err)) {
+                g_error_free (err);
+                g_queue_push_head (self->priv->pending, pending);
+                return;
+            }
+
+            g_error_free (err);
+            err = NULL;
+        }
+
+        pending_free (pending);
+    }
+}
+
+static void
+owner_changed (GMediaDB *self, gchar *nowner)
+{
+    gmediadb_dbus_disconnect_owner (self);
+
+    // The next owner does not know what the last one reserved for us
+    self->priv->reserved_next = self->priv->reserved_end = 0;
+
+    // If we're not the owner, reconnect to new object
+    if (g_strcmp0 (nowner, self->priv->dbus_name)) {
+        gmediadb_dbus_connect_owner (self);
+
+        if (nowner && nowner[0]) {
+            pending_replay (self);
+        }
+
+        return;
+    }
+
+    // The table already follows the old owner, so it is used as it is
+    reindex_blobs (self);
+
+    // Changes the old owner had not written yet would be lost otherwise
+    if (self->priv->unflushed) {
+        media_object_mark_modified (self->priv->mo);
+    }
+
+    pending_replay (self);
+}
+
 static void
 gmediadb_dbus_name_owner_changed (DBusGProxy *proxy,
                                   gchar *name,
@@ -600,112 +4065,407 @@ gmediadb_dbus_name_owner_changed (DBusGProxy *proxy,
                                   gchar *nowner,
                                   GMediaDB *self)
 {
-    if (!g_strcmp0 (name, self->priv->dbus_mo_name)) {
-        dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_added",
-           G_CALLBACK (media_added_cb), self);
-        dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_updated",
-            G_CALLBACK (media_updated_cb), self);
-        dbus_g_proxy_disconnect_signal (self->priv->mo_proxy, "media_removed",
-            G_CALLBACK (media_removed_cb), self);
+    if (g_strcmp0 (name, self->priv->dbus_mo_name) || !self->priv->mo_proxy) {
+        return;
+    }
 
-        g_object_unref (self->priv->mo_proxy);
-        self->priv->mo_proxy = NULL;
+    g_static_rec_mutex_lock (&self->priv->lock);
+    owner_changed (self, nowner);
+    g_static_rec_mutex_unlock (&self->priv->lock);
+}
 
-        // If we're not the owner, reconnect to new object
-        if (g_strcmp0 (nowner, self->priv->dbus_name)) {
-            self->priv->mo_proxy = dbus_g_proxy_new_for_name (self->priv->conn,
-                self->priv->dbus_mo_name, self->priv->dbus_mo_path, "org.gnome.GMediaDB.MediaObject");
-        }
-    }
+static void
+gmediadb_dbus_flushed (DBusGProxy *proxy, GMediaDB *self)
+{
+    self->priv->unflushed = FALSE;
+    self->priv->flushes++;
 }
 
 static void
 gmediadb_dbus_name_acquired (DBusGProxy *proxy, gchar *name, GMediaDB *self)
 {
-    if (name[0] == ':') {
+    if (name[0] == ':' && !self->priv->dbus_name) {
         self->priv->dbus_name = g_strdup (name);
         return;
     }
 }
 
-// Media Object callbacks
-void
-media_added_cb (gpointer obj, guint id, GHashTable *info, GMediaDB *self)
+// Announcements name every large value of the entry, changed or not. They
+// are fetched from the owner once read, the flushed signal tells when the
+// copy in the store is current again
+static void
+entry_mark_stale (GMediaDB *self, GMediaDBEntry *entry)
 {
-    GList *ki, *vi;
-
-    if (g_hash_table_lookup (self->priv->table, &id)) {
-        g_signal_emit (self, signal_add, 0, id);
+    if (!self->priv->mo_proxy || !entry->blobs) {
         return;
     }
 
-    vi = g_hash_table_get_values (info);
-    ki = g_hash_table_get_keys (info);
-
-    GHashTable *nentry = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, entry->blobs);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        ((GMediaDBBlob*) val)->stale = self->priv->flushes + 1;
+    }
+}
 
-    for (; ki && vi; ki = ki->next, vi = vi->next) {
-        g_hash_table_insert (nentry,
-            g_string_chunk_insert_const (self->priv->sc, (gchar*) ki->data),
-            g_string_chunk_insert_const (self->priv->sc, (gchar*) vi->data));
+// Media Object callbacks
+static void
+media_added (GMediaDB *self, guint id, GHashTable *info)
+{
+    if (entry_exists (self, id)) {
+        g_signal_emit (self, signal_add, 0, id);
+        return;
     }
 
+    GMediaDBEntry *nentry = entry_new ();
+    entry_load_info (self, nentry, info);
+    entry_mark_stale (self, nentry);
+
     gint *nid = g_new0 (gint, 1);
     *nid = id;
 
     g_hash_table_insert (self->priv->table, nid, nentry);
+    entry_feed (self, *nid, nentry, 1);
 
     g_signal_emit (self, signal_add, 0, id);
 }
 
-void
-media_updated_cb (gpointer obj, guint id, GHashTable *info, GMediaDB *self)
+static void
+media_updated (GMediaDB *self, guint id, GHashTable *info)
 {
-    GList *ki, *vi;
-
-    ki = g_hash_table_get_keys (info);
-    vi = g_hash_table_get_values (info);
-
-    GHashTable *entry = g_hash_table_lookup (self->priv->table, &id);
+    GMediaDBEntry *entry = entry_lookup (self, id);
 
     if (!entry) {
         return;
     }
 
-    g_hash_table_remove_all (entry);
+    entry = entry_writable (self, id, entry);
 
-    for (; ki; ki = ki->next, vi = vi->next) {
-        g_hash_table_insert (entry,
-            g_string_chunk_insert_const (self->priv->sc, (gchar*) ki->data),
-            g_string_chunk_insert_const (self->priv->sc, (gchar*) vi->data));
-    }
+    entry_feed (self, id, entry, -1);
+    entry_load_info (self, entry, info);
+    entry_mark_stale (self, entry);
+    entry_feed (self, id, entry, 1);
 
     g_signal_emit (self, signal_update, 0, id);
 }
 
+// The main loop may run on another thread than callers of the library,
+// which take the lock around their calls
+void
+media_added_cb (gpointer obj, guint id, GHashTable *info, GMediaDB *self)
+{
+    g_static_rec_mutex_lock (&self->priv->lock);
+    self->priv->unflushed = TRUE;
+    media_added (self, id, info);
+    g_static_rec_mutex_unlock (&self->priv->lock);
+}
+
+void
+media_updated_cb (gpointer obj, guint id, GHashTable *info, GMediaDB *self)
+{
+    g_static_rec_mutex_lock (&self->priv->lock);
+    self->priv->unflushed = TRUE;
+    media_updated (self, id, info);
+    g_static_rec_mutex_unlock (&self->priv->lock);
+}
+
 void
 media_removed_cb (gpointer obj, guint id, GMediaDB *self)
 {
-    GHashTable *entry = g_hash_table_lookup (self->priv->table, &id);
+    g_static_rec_mutex_lock (&self->priv->lock);
+    self->priv->unflushed = TRUE;
 
-    if (entry) {
-        g_hash_table_remove (self->priv->table, &id);
-    }
+    entry_remove (self, id);
 
     g_signal_emit (self, signal_remove, 0, id);
+    g_static_rec_mutex_unlock (&self->priv->lock);
+}
+
+void
+gmediadb_lock (GMediaDB *self)
+{
+    g_static_rec_mutex_lock (&self->priv->lock);
 }
 
 void
-gmediadb_flush_cb (gpointer obj, GMediaDB *self)
+gmediadb_unlock (GMediaDB *self)
+{
+    g_static_rec_mutex_unlock (&self->priv->lock);
+}
+
+// Flush Methods
+static GMediaDBFlush*
+flush_job_new (GMediaDB *self)
+{
+    GMediaDBFlush *job = g_new0 (GMediaDBFlush, 1);
+
+    lazy_load_all (self);
+
+    job->fpath = g_strdup (self->priv->fpath);
+    job->fd = dup (self->priv->fd);
+    job->version = self->priv->version;
+
+    job->schema = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    job->items = g_array_sized_new (FALSE, FALSE, sizeof (GMediaDBFlushItem),
+        g_hash_table_size (self->priv->table));
+    job->lost = g_hash_table_new (g_direct_hash, g_direct_equal);
+    job->blobs = g_array_new (FALSE, FALSE, sizeof (GMediaDBFlushBlob));
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, self->priv->schema);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        g_hash_table_insert (job->schema, key, g_memdup (val, sizeof (GMediaDBField)));
+    }
+
+    // Only references are taken here, entries are copied when they change
+    g_hash_table_iter_init (&iter, self->priv->table);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        GMediaDBFlushItem item = { *((gint*) key), (GMediaDBEntry*) val };
+
+        item.entry->ref++;
+        g_array_append_val (job->items, item);
+    }
+
+    return job;
+}
+
+static void
+flush_job_free (GMediaDBFlush *job)
+{
+    if (job->fd != -1) {
+        close (job->fd);
+    }
+
+    g_free (job->fpath);
+    g_hash_table_destroy (job->schema);
+    g_array_free (job->items, TRUE);
+    g_hash_table_destroy (job->lost);
+    g_array_free (job->blobs, TRUE);
+    g_free (job);
+}
+
+// Values that can not be read any more are left out of the new store
+static void
+flush_check_blobs (GMediaDBFlush *job)
+{
+    guint i;
+
+    for (i = 0; i < job->items->len; i++) {
+        GMediaDBFlushItem *item = &g_array_index (job->items, GMediaDBFlushItem, i);
+
+        if (!item->entry->blobs) {
+            continue;
+        }
+
+        GHashTableIter iter;
+        gpointer key, val;
+        g_hash_table_iter_init (&iter, item->entry->blobs);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            GMediaDBBlob *blob = (GMediaDBBlob*) val;
+            gchar *data;
+
+            if (g_atomic_pointer_get ((gpointer*) &blob->data)) {
+                continue;
+            }
+
+            if ((data = blob_read (job->fd, blob, job->version))) {
+                g_free (data);
+                continue;
+            }
+
+            GMediaDBFlushBlob lost = { item->id, key, blob->serial, -1 };
+
+            g_printerr ("Unable to load %s for %d, dropping it\n", (gchar*) key, item->id);
+            g_hash_table_insert (job->lost, blob, blob);
+            g_array_append_val (job->blobs, lost);
+        }
+    }
+}
+
+// Writes the store aside and renames it over the old one. Only looks at
+// the job, so it runs on either thread
+static gboolean
+flush_write (GMediaDBFlush *job)
 {
-    GList *tk = g_hash_table_get_keys (self->priv->table);
-    GList *tv = g_hash_table_get_values (self->priv->table);
+    goffset boff = 0, bstart, dstart;
+    guint i;
+
+    flush_check_blobs (job);
 
-    int fd = open (self->priv->fpath, O_CREAT | O_WRONLY | O_TRUNC);
+    gchar *tpath = g_strdup_printf ("%s.tmp", job->fpath);
+    int fd = open (tpath, O_CREAT | O_WRONLY | O_TRUNC, 0644);
 
-    for (; tk; tk = tk->next, tv = tv->next) {
-        write_entry (fd, *((gint*) tk->data), (GHashTable*) tv->data);
+    if (fd == -1) {
+        g_printerr ("Unable to write %s\n", tpath);
+        g_free (tpath);
+        return FALSE;
+    }
+
+    write_header (fd, job->items->len, 0, 0);
+    write_snapshot (fd, job, &boff, &dstart);
+
+    bstart = lseek (fd, 0, SEEK_CUR);
+
+    for (i = 0; i < job->items->len; i++) {
+        write_blobs (fd, job, &g_array_index (job->items, GMediaDBFlushItem, i));
     }
 
+    write_header (fd, job->items->len, boff ? bstart : 0, dstart);
+
+    // Never leave a renamed but empty store behind after a crash
+    fsync (fd);
     close (fd);
+
+    if (rename (tpath, job->fpath)) {
+        g_printerr ("Unable to replace %s\n", job->fpath);
+        g_free (tpath);
+        return FALSE;
+    }
+
+    g_free (tpath);
+
+    return TRUE;
+}
+
+// Back on the main thread, point values at the new file and let go of
+// the entries
+static void
+flush_finish (GMediaDB *self, GMediaDBFlush *job)
+{
+    guint i;
+
+    if (job->ok) {
+        for (i = 0; i < job->blobs->len; i++) {
+            GMediaDBFlushBlob *written = &g_array_index (job->blobs, GMediaDBFlushBlob, i);
+            GMediaDBEntry *entry = g_hash_table_lookup (self->priv->table, &written->id);
+            GMediaDBBlob *blob = entry && entry->blobs ?
+                g_hash_table_lookup (entry->blobs, written->tag) : NULL;
+
+            // Values set since are still only in memory
+            if (!blob || blob->serial != written->serial) {
+                continue;
+            }
+
+            if (written->offset < 0) {
+                g_hash_table_remove (entry->blobs, written->tag);
+                continue;
+            }
+
+            // It is on disk now, so only keep it around once asked for again
+            blob->offset = written->offset;
+            g_free (blob->data);
+            blob->data = NULL;
+        }
+
+        close (self->priv->fd);
+        self->priv->fd = open (self->priv->fpath, O_RDONLY);
+
+        self->priv->version = GMEDIADB_VERSION;
+
+        // Nothing changed while writing, so the store has every change
+        if (!self->priv->mo_proxy && !media_object_is_modified (self->priv->mo)) {
+            self->priv->unflushed = FALSE;
+            media_object_flushed (self->priv->mo);
+        }
+    }
+
+    for (i = 0; i < job->items->len; i++) {
+        entry_unref (g_array_index (job->items, GMediaDBFlushItem, i).entry);
+    }
+
+    g_array_set_size (job->items, 0);
+}
+
+static gboolean
+flush_done (GMediaDBFlush *job)
+{
+    GMediaDB *self = job->self;
+
+    g_static_rec_mutex_lock (&self->priv->lock);
+
+    // Whoever held the lock may have finished it and started another
+    if (self->priv->flush_job == job) {
+        g_thread_join (job->thread);
+        flush_finish (self, job);
+        self->priv->flush_job = NULL;
+
+        if (self->priv->flush_again) {
+            self->priv->flush_again = FALSE;
+            gmediadb_flush_cb (NULL, TRUE, self);
+        }
+    }
+
+    g_static_rec_mutex_unlock (&self->priv->lock);
+
+    flush_job_free (job);
+    g_object_unref (self);
+
+    return FALSE;
+}
+
+static gpointer
+flush_thread (GMediaDBFlush *job)
+{
+    job->ok = flush_write (job);
+
+    g_idle_add ((GSourceFunc) flush_done, job);
+
+    return NULL;
+}
+
+void
+gmediadb_flush_wait (GMediaDB *self)
+{
+    GMediaDBFlush *job = self->priv->flush_job;
+
+    if (!job) {
+        return;
+    }
+
+    g_thread_join (job->thread);
+    flush_finish (self, job);
+
+    // flush_done still frees it
+    self->priv->flush_job = NULL;
+}
+
+void
+gmediadb_flush_cb (gpointer obj, gboolean background, GMediaDB *self)
+{
+    GMediaDBFlush *job;
+    GError *err = NULL;
+
+    if (self->priv->flush_job) {
+        // Written again once the one in progress is done
+        if (background) {
+            self->priv->flush_again = TRUE;
+            return;
+        }
+
+        gmediadb_flush_wait (self);
+    }
+
+    self->priv->flush_again = FALSE;
+
+    job = flush_job_new (self);
+
+    if (background) {
+        job->self = g_object_ref (self);
+        job->thread = g_thread_create ((GThreadFunc) flush_thread, job, TRUE, &err);
+
+        if (job->thread) {
+            self->priv->flush_job = job;
+            return;
+        }
+
+        g_printerr ("Unable to start flush thread: %s\n", err->message);
+        g_error_free (err);
+        g_object_unref (job->self);
+        job->self = NULL;
+    }
+
+    job->ok = flush_write (job);
+    flush_finish (self, job);
+    flush_job_free (job);
 }
@@ -35,6 +35,30 @@ G_BEGIN_DECLS
 typedef struct _GMediaDB GMediaDB;
 typedef struct _GMediaDBClass GMediaDBClass;
 typedef struct _GMediaDBPrivate GMediaDBPrivate;
+typedef struct _GMediaDBProjection GMediaDBProjection;
+
+typedef enum {
+    GMEDIADB_TAG_STRING,
+    GMEDIADB_TAG_INT,
+    GMEDIADB_TAG_DOUBLE,
+    GMEDIADB_TAG_TIME,
+} GMediaDBTagType;
+
+typedef enum {
+    GMEDIADB_OPEN_LAZY = 1 << 0,
+    GMEDIADB_OPEN_SHARED_STRINGS = 1 << 1,
+} GMediaDBOpenFlags;
+
+typedef enum {
+    GMEDIADB_SCAN_EQUAL,
+    GMEDIADB_SCAN_CONTAINS,
+    GMEDIADB_SCAN_CONTAINS_NOCASE,
+    GMEDIADB_SCAN_LESS,
+    GMEDIADB_SCAN_GREATER,
+} GMediaDBScanOp;
+
+/* values is a row as gmediadb_get_values gives it, valid for the call */
+typedef void (*GMediaDBForeachFunc) (guint id, const gchar **values, gpointer data);
 
 struct _GMediaDB {
     GObject parent;
@@ -50,14 +74,121 @@ struct _GMediaDBClass {
 GMediaDB *gmediadb_new (const gchar *mediatype);
 GType gmediadb_get_type (void);
 
+/* Changes from other processes are applied from the main loop with this
+ * lock held. Code calling in from other threads holds it around its calls
+ * and while it reads what they returned */
+void gmediadb_lock (GMediaDB *self);
+void gmediadb_unlock (GMediaDB *self);
+
+/* With GMEDIADB_OPEN_LAZY only the directory of the store is read up front
+ * and entries are decoded the first time they are asked for. Listing every
+ * entry still decodes them all. With GMEDIADB_OPEN_SHARED_STRINGS tag names
+ * and values are kept once per process for every database opened that
+ * way. Closing a database frees the strings no other one holds. Strings
+ * are not counted per use, so ones a database stopped using stay until it
+ * is closed. Up to 32 databases share strings at a time. Opening a media
+ * type already open in this process returns that database again, opened
+ * with the flags it was first opened with */
+GMediaDB *gmediadb_new_full (const gchar *mediatype, GMediaDBOpenFlags flags);
+
+/* Checks every block of a store against its checksum without loading it.
+ * Returns FALSE when the store can not be read or predates checksums */
+gboolean gmediadb_verify (const gchar *mediatype, guint *blocks, guint *damaged);
+
+/* Changes are written out in the background once none have come in for
+ * this many seconds, 0 only writes the store when it is closed */
+void gmediadb_set_flush_delay (GMediaDB *self, guint seconds);
+
+/* Large values (lyrics, artwork) are loaded lazily and only returned when
+ * they are named in tags */
 gchar **gmediadb_get_entry (GMediaDB *self, guint id, gchar *tags[]);
 GPtrArray *gmediadb_get_entries (GMediaDB *self, GArray *ids, gchar *tags[]);
 GPtrArray *gmediadb_get_all_entries (GMediaDB *self, gchar *tags[]);
 
+/* Appends the values of tags for each entry in ids, or for every entry
+ * when ids is NULL, to values and the ids of the entries found to found.
+ * Without tags a row is its tag, value pairs followed by NULL. The "id"
+ * tag gives NULL, all strings belong to the database */
+void gmediadb_get_values (GMediaDB *self, GArray *ids, gchar *tags[],
+    GArray *found, GPtrArray *values);
+
+/* A tag list resolved once for repeated reads, the _projected getters
+ * take it in place of tags and behave the same otherwise. NULL tags give
+ * a NULL projection, which stands for every small value like tags does.
+ * Belongs to the database that made it */
+GMediaDBProjection *gmediadb_projection_new (GMediaDB *self, gchar *tags[]);
+void gmediadb_projection_free (GMediaDBProjection *proj);
+
+gchar **gmediadb_get_entry_projected (GMediaDB *self, guint id, GMediaDBProjection *proj);
+GPtrArray *gmediadb_get_entries_projected (GMediaDB *self, GArray *ids, GMediaDBProjection *proj);
+GPtrArray *gmediadb_get_all_entries_projected (GMediaDB *self, GMediaDBProjection *proj);
+void gmediadb_get_values_projected (GMediaDB *self, GArray *ids, GMediaDBProjection *proj,
+    GArray *found, GPtrArray *values);
+
+/* Calls func for every entry without changing the database from it. A
+ * lazily opened store is decoded a block at a time and the decoded entries
+ * are dropped afterwards, so memory stays bounded */
+void gmediadb_foreach (GMediaDB *self, GMediaDBProjection *proj,
+    GMediaDBForeachFunc func, gpointer data);
+
+/* Names of the tags holding a large value in any entry, decoded the same
+ * way as gmediadb_foreach. Free with g_strfreev */
+gchar **gmediadb_get_large_tags (GMediaDB *self);
+
+/* Ids of the entries whose tags have all the values given in kvs */
+GArray *gmediadb_query (GMediaDB *self, gchar *kvs[]);
+
+/* Ids of the entries whose tag compares to value as op says, for filters
+ * no index serves. CONTAINS_NOCASE folds ASCII letters only. LESS and
+ * GREATER compare numbers, values of string tags that are not numbers
+ * never match. Large values are read from the store, replicas fetch the
+ * ones they do not hold yet from the owner. The table is split across
+ * threads and each distinct value is usually only tested once */
+GArray *gmediadb_scan (GMediaDB *self, const gchar *tag, GMediaDBScanOp op, const gchar *value);
+
+/* Typed tags are kept as native numbers, times are seconds since the epoch
+ * and also accept ISO 8601 when set. The getters only succeed for tags
+ * declared with a numeric type. The owner keeps the schema for every
+ * process, a replica's change goes through it */
+void gmediadb_set_tag_type (GMediaDB *self, const gchar *tag, GMediaDBTagType type);
+GMediaDBTagType gmediadb_get_tag_type (GMediaDB *self, const gchar *tag);
+
+gboolean gmediadb_get_int (GMediaDB *self, guint id, const gchar *tag, gint64 *value);
+gboolean gmediadb_get_double (GMediaDB *self, guint id, const gchar *tag, gdouble *value);
+
 gboolean gmediadb_add_entry (GMediaDB *self, gchar *kvs[]);
+
+/* Adds every kvs array in entries under one lock and, for replicas, one
+ * call to the owner. Returns the id of the first, the rest follow it.
+ * Entries repeating a value of an index are left out, their ids unused */
+guint gmediadb_add_entries (GMediaDB *self, GPtrArray *entries);
 gboolean gmediadb_update_entry (GMediaDB *self, guint id, gchar *kvs[]);
+
+/* Keeps a table from each value of tag to the entry having it, built the
+ * first time the tag is looked up and maintained as entries change. Adds
+ * and updates that would give a second entry one of its values fail.
+ * Returns 0 when no entry has the value */
+void gmediadb_add_index (GMediaDB *self, const gchar *tag);
+guint gmediadb_lookup (GMediaDB *self, const gchar *tag, const gchar *value);
+
+/* Updates the entry whose key_tag has the value given in kvs, or adds one.
+ * Replicas leave the decision to the owner in one call and see the change
+ * once its signal comes in. Returns the id, 0 on failure */
+guint gmediadb_upsert_entry (GMediaDB *self, const gchar *key_tag, gchar *kvs[]);
 gboolean gmediadb_remove_entry (GMediaDB *self, guint id);
 
+/* Compares scanned records, kvs arrays each holding a key_tag value,
+ * with the database over several threads. added gets the positions in
+ * records of keys not found, changed the ids of entries with a value that
+ * differs from their record and missing the ids of entries having key_tag
+ * that no record names. Of records sharing a key only the last is used,
+ * duplicates gets the positions of the others when not NULL. With apply
+ * the differences are then written under one lock and, for replicas, in
+ * one call to the owner */
+void gmediadb_reconcile (GMediaDB *self, const gchar *key_tag, GPtrArray *records,
+    gboolean apply, GArray *added, GArray *changed, GArray *missing,
+    GArray *duplicates);
+
 G_END_DECLS
 
 #endif /* __GMEDIADB_H__ */
@@ -19,6 +19,10 @@
  *      MA 02110-1301, USA.
  */
 
+#include <string.h>
+#include <time.h>
+
+#include "gmediadb-private.h"
 #include "media-object.h"
 #include "media-object-glue.h"
 
@@ -26,15 +30,134 @@ G_DEFINE_TYPE(MediaObject, media_object, G_TYPE_OBJECT)
 
 #define MEDIA_OBJECT_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), MEDIA_OBJECT_TYPE, MediaObjectPrivate))
 
+// A steady stream of changes only holds the flush back this many delays
+#define FLUSH_MAX_DELAYS 6
+
+typedef struct {
+    guint handle;
+    gchar *sender;
+    gchar *path;
+
+    gchar **tags;
+    guint n;
+    gchar **filter;
+
+    // Entries the subscriber knows about, with the values last sent to it
+    GHashTable *members;
+} MediaObjectSubscription;
+
+typedef enum {
+    MEDIA_OBJECT_OP_ADD,
+    MEDIA_OBJECT_OP_UPDATE,
+    MEDIA_OBJECT_OP_REMOVE,
+} MediaObjectOpKind;
+
+typedef enum {
+    MEDIA_OBJECT_LANE_INTERACTIVE,
+    MEDIA_OBJECT_LANE_BULK,
+    MEDIA_OBJECT_LANES,
+} MediaObjectLaneKind;
+
+typedef struct {
+    MediaObjectOpKind kind;
+    guint ident;
+    GHashTable *info;
+} MediaObjectOp;
+
+// A change call waiting for its turn, with the operations it carries
+typedef struct {
+    DBusGMethodInvocation *context;
+    MediaObjectLaneKind lane;
+    GTimeVal queued;
+
+    GArray *ops;
+    guint done;
+} MediaObjectWork;
+
+// Operations still queued, and what the calls finished so far took from
+// arriving to their reply, in microseconds
+typedef struct {
+    GQueue *queue;
+    guint depth;
+
+    guint calls;
+    guint ops;
+    guint64 latency_total;
+    guint64 latency_max;
+} MediaObjectLane;
+
 struct _MediaObjectPrivate {
     gboolean mod;
+    time_t mod_since;
+    time_t mod_last;
+
+    guint flush_delay;
+    guint flush_source;
+
+    DBusGConnection *conn;
+    gchar *path;
+
+    DBusGProxy *bus_proxy;
+    GList *subs;
+    guint sub_next;
+
+    MediaObjectLane lanes[MEDIA_OBJECT_LANES];
+    GHashTable *bulk_ids;
+    guint dispatch_source;
+
+    // flush_store calls answered once the lanes are empty
+    GSList *flush_waiting;
+
+    GMediaDB *db;
 };
 
 static guint signal_media_added, signal_media_updated, signal_media_removed, signal_flush;
+static guint signal_entry_added, signal_entry_updated, signal_flushed, signal_tag_type_changed;
+
+static void media_object_emit_stripped (MediaObject *self, guint signal, guint ident, GHashTable *info);
+static void media_object_modified (MediaObject *self);
+static void media_object_notify (MediaObject *self, guint ident, gboolean removed);
+static void subscription_free (MediaObjectSubscription *sub);
+static void work_free (MediaObjectWork *work);
+static void flush_store_answer (MediaObject *self);
 
 static void
 media_object_finalize (GObject *object)
 {
+    MediaObject *self = MEDIA_OBJECT (object);
+
+    if (self->priv->flush_source) {
+        g_source_remove (self->priv->flush_source);
+        self->priv->flush_source = 0;
+    }
+
+    if (self->priv->dispatch_source) {
+        g_source_remove (self->priv->dispatch_source);
+        self->priv->dispatch_source = 0;
+    }
+
+    // Callers still waiting get an error from the bus once we are gone
+    gint i;
+    for (i = 0; i < MEDIA_OBJECT_LANES; i++) {
+        g_queue_foreach (self->priv->lanes[i].queue, (GFunc) work_free, NULL);
+        g_queue_free (self->priv->lanes[i].queue);
+    }
+
+    g_hash_table_destroy (self->priv->bulk_ids);
+    g_slist_free (self->priv->flush_waiting);
+
+    g_list_foreach (self->priv->subs, (GFunc) subscription_free, NULL);
+    g_list_free (self->priv->subs);
+    self->priv->subs = NULL;
+
+    if (self->priv->bus_proxy) {
+        g_object_unref (self->priv->bus_proxy);
+        self->priv->bus_proxy = NULL;
+    }
+
+    g_free (self->priv->path);
+    self->priv->path = NULL;
+
     G_OBJECT_CLASS (media_object_parent_class)->finalize (object);
 }
 
@@ -63,10 +186,30 @@ media_object_class_init (MediaObjectClass *klass)
         NULL, NULL, g_cclosure_marshal_VOID__UINT,
         G_TYPE_NONE, 1, G_TYPE_UINT);
 
+    // Local counterparts of media_added and media_updated that still carry
+    // the large values stripped from the exported signals
+    signal_entry_added = g_signal_new ("entry_added", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT_POINTER,
+        G_TYPE_NONE, 2, G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE);
+
+    signal_entry_updated = g_signal_new ("entry_updated", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT_POINTER,
+        G_TYPE_NONE, 2, G_TYPE_UINT, DBUS_TYPE_G_STRING_STRING_HASHTABLE);
+
+    // Carries whether the store may be written in the background
     signal_flush = g_signal_new ("flush", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__BOOLEAN,
+        G_TYPE_NONE, 1, G_TYPE_BOOLEAN);
+
+    // Tells replicas every change they have seen is in the store
+    signal_flushed = g_signal_new ("flushed", G_TYPE_FROM_CLASS (klass),
         G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__VOID,
         G_TYPE_NONE, 0);
 
+    signal_tag_type_changed = g_signal_new ("tag_type_changed", G_TYPE_FROM_CLASS (klass),
+        G_SIGNAL_RUN_LAST, 0, NULL, NULL, g_cclosure_marshal_VOID__UINT_POINTER,
+        G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_STRING);
+
     dbus_g_object_type_install_info (MEDIA_OBJECT_TYPE,
                                      &dbus_glib_media_object_object_info);
 }
@@ -77,48 +220,893 @@ media_object_init (MediaObject *self)
     self->priv = MEDIA_OBJECT_GET_PRIVATE (self);
 
     self->priv->mod = FALSE;
+    self->priv->flush_delay = GMEDIADB_FLUSH_DELAY;
+    self->priv->flush_source = 0;
+    self->priv->conn = NULL;
+    self->priv->path = NULL;
+    self->priv->bus_proxy = NULL;
+    self->priv->subs = NULL;
+    self->priv->sub_next = 1;
+
+    gint i;
+    for (i = 0; i < MEDIA_OBJECT_LANES; i++) {
+        self->priv->lanes[i].queue = g_queue_new ();
+    }
+
+    self->priv->bulk_ids = g_hash_table_new (g_direct_hash, g_direct_equal);
+    self->priv->dispatch_source = 0;
+    self->priv->flush_waiting = NULL;
+    self->priv->db = NULL;
 }
 
 MediaObject *
-media_object_new ()
+media_object_new (GMediaDB *db, DBusGConnection *conn, const gchar *path)
+{
+    MediaObject *self = g_object_new (MEDIA_OBJECT_TYPE, NULL);
+
+    self->priv->db = db;
+    self->priv->conn = conn;
+    self->priv->path = g_strdup (path);
+
+    return self;
+}
+
+static gboolean
+media_object_flush_timeout (MediaObject *self)
+{
+    time_t now = time (NULL);
+
+    self->priv->flush_source = 0;
+
+    if (!self->priv->mod || !self->priv->flush_delay) {
+        return FALSE;
+    }
+
+    // Let a burst of changes settle first
+    if (now - self->priv->mod_last < self->priv->flush_delay &&
+        now - self->priv->mod_since < self->priv->flush_delay * FLUSH_MAX_DELAYS) {
+        self->priv->flush_source = g_timeout_add_seconds (
+            self->priv->flush_delay - (now - self->priv->mod_last),
+            (GSourceFunc) media_object_flush_timeout, self);
+        return FALSE;
+    }
+
+    self->priv->mod = FALSE;
+
+    gmediadb_lock (self->priv->db);
+    g_signal_emit (self, signal_flush, 0, TRUE);
+    gmediadb_unlock (self->priv->db);
+
+    return FALSE;
+}
+
+static void
+media_object_modified (MediaObject *self)
+{
+    time_t now = time (NULL);
+
+    if (!self->priv->mod) {
+        self->priv->mod = TRUE;
+        self->priv->mod_since = now;
+    }
+
+    self->priv->mod_last = now;
+
+    if (self->priv->flush_delay && !self->priv->flush_source) {
+        self->priv->flush_source = g_timeout_add_seconds (self->priv->flush_delay,
+            (GSourceFunc) media_object_flush_timeout, self);
+    }
+}
+
+gboolean
+media_object_is_modified (MediaObject *self)
+{
+    return self->priv->mod;
+}
+
+// For a replica taking over changes the old owner had not written
+void
+media_object_mark_modified (MediaObject *self)
+{
+    media_object_modified (self);
+}
+
+void
+media_object_flushed (MediaObject *self)
+{
+    g_signal_emit (self, signal_flushed, 0);
+}
+
+void
+media_object_set_flush_delay (MediaObject *self, guint seconds)
+{
+    self->priv->flush_delay = seconds;
+
+    if (self->priv->flush_source) {
+        g_source_remove (self->priv->flush_source);
+        self->priv->flush_source = 0;
+    }
+
+    if (self->priv->mod && seconds) {
+        self->priv->flush_source = g_timeout_add_seconds (seconds,
+            (GSourceFunc) media_object_flush_timeout, self);
+    }
+}
+
+GQuark
+media_object_error_quark (void)
+{
+    return g_quark_from_static_string ("media-object-error-quark");
+}
+
+static void
+announce_add (MediaObject *self, guint ident, GHashTable *info)
+{
+    media_object_modified (self);
+    g_signal_emit (G_OBJECT (self), signal_entry_added, 0, ident, info);
+    media_object_emit_stripped (self, signal_media_added, ident, info);
+    media_object_notify (self, ident, FALSE);
+}
+
+static void
+announce_update (MediaObject *self, guint ident, GHashTable *info)
+{
+    media_object_modified (self);
+    g_signal_emit (G_OBJECT (self), signal_entry_updated, 0, ident, info);
+    media_object_emit_stripped (self, signal_media_updated, ident, info);
+    media_object_notify (self, ident, FALSE);
+}
+
+static void
+announce_remove (MediaObject *self, guint ident)
+{
+    media_object_modified (self);
+    g_signal_emit (G_OBJECT (self), signal_media_removed, 0, ident);
+    media_object_notify (self, ident, TRUE);
+}
+
+// Calls from the bus own copies of their values, as those are freed once
+// the handler returns
+static MediaObjectWork*
+work_new (DBusGMethodInvocation *context)
+{
+    MediaObjectWork *work = g_new0 (MediaObjectWork, 1);
+
+    work->context = context;
+    work->ops = g_array_new (FALSE, FALSE, sizeof (MediaObjectOp));
+    g_get_current_time (&work->queued);
+
+    return work;
+}
+
+static void
+work_add (MediaObjectWork *work, MediaObjectOpKind kind, guint ident, GHashTable *info)
+{
+    MediaObjectOp op = { kind, ident, info };
+
+    if (info && work->context) {
+        op.info = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        GHashTableIter iter;
+        gpointer key, val;
+        g_hash_table_iter_init (&iter, info);
+        while (g_hash_table_iter_next (&iter, &key, &val)) {
+            g_hash_table_insert (op.info, g_strdup (key), g_strdup (val));
+        }
+    }
+
+    g_array_append_val (work->ops, op);
+}
+
+static void
+work_free (MediaObjectWork *work)
+{
+    guint i;
+
+    for (i = 0; work->context && i < work->ops->len; i++) {
+        MediaObjectOp *op = &g_array_index (work->ops, MediaObjectOp, i);
+
+        if (op->info) {
+            g_hash_table_destroy (op->info);
+        }
+    }
+
+    g_array_free (work->ops, TRUE);
+    g_free (work);
+}
+
+// Runs the operations left in work, stopping at deadline when one is
+// given. Returns whether all of them are done
+static gboolean
+work_run (MediaObject *self, MediaObjectWork *work, GTimeVal *deadline)
+{
+    GTimeVal now;
+
+    while (work->done < work->ops->len) {
+        MediaObjectOp *op = &g_array_index (work->ops, MediaObjectOp, work->done++);
+
+        switch (op->kind) {
+            case MEDIA_OBJECT_OP_ADD:
+                announce_add (self, op->ident, op->info);
+                break;
+            case MEDIA_OBJECT_OP_UPDATE:
+                announce_update (self, op->ident, op->info);
+                break;
+            case MEDIA_OBJECT_OP_REMOVE:
+                announce_remove (self, op->ident);
+                break;
+        }
+
+        if (work->lane == MEDIA_OBJECT_LANE_BULK) {
+            gpointer count = g_hash_table_lookup (self->priv->bulk_ids, GUINT_TO_POINTER (op->ident));
+
+            if (GPOINTER_TO_UINT (count) > 1) {
+                g_hash_table_insert (self->priv->bulk_ids, GUINT_TO_POINTER (op->ident),
+                    GUINT_TO_POINTER (GPOINTER_TO_UINT (count) - 1));
+            } else {
+                g_hash_table_remove (self->priv->bulk_ids, GUINT_TO_POINTER (op->ident));
+            }
+        }
+
+        self->priv->lanes[work->lane].depth--;
+
+        // Checking the clock every operation would cost more than most of them
+        if (deadline && work->done % 64 == 0) {
+            g_get_current_time (&now);
+
+            if (now.tv_sec > deadline->tv_sec ||
+                (now.tv_sec == deadline->tv_sec && now.tv_usec >= deadline->tv_usec)) {
+                break;
+            }
+        }
+    }
+
+    return work->done == work->ops->len;
+}
+
+static void
+work_finish (MediaObject *self, MediaObjectWork *work)
+{
+    MediaObjectLane *lane = &self->priv->lanes[work->lane];
+    GTimeVal now;
+
+    g_get_current_time (&now);
+
+    guint64 latency = (now.tv_sec - work->queued.tv_sec) * G_USEC_PER_SEC +
+        now.tv_usec - work->queued.tv_usec;
+
+    lane->calls++;
+    lane->ops += work->ops->len;
+    lane->latency_total += latency;
+    lane->latency_max = MAX (lane->latency_max, latency);
+
+    dbus_g_method_return (work->context);
+    work_free (work);
+}
+
+// Interactive calls all go first, then one slice of the oldest bulk call
+static gboolean
+dispatch_pass (MediaObject *self)
+{
+    GQueue *interactive = self->priv->lanes[MEDIA_OBJECT_LANE_INTERACTIVE].queue;
+    GQueue *bulk = self->priv->lanes[MEDIA_OBJECT_LANE_BULK].queue;
+    MediaObjectWork *work;
+    GTimeVal deadline;
+
+    while ((work = g_queue_pop_head (interactive))) {
+        work_run (self, work, NULL);
+        work_finish (self, work);
+    }
+
+    if ((work = g_queue_peek_head (bulk))) {
+        g_get_current_time (&deadline);
+        g_time_val_add (&deadline, GMEDIADB_BULK_SLICE * 1000);
+
+        if (work_run (self, work, &deadline)) {
+            g_queue_pop_head (bulk);
+            work_finish (self, work);
+        }
+    }
+
+    if (g_queue_is_empty (interactive) && g_queue_is_empty (bulk)) {
+        self->priv->dispatch_source = 0;
+        flush_store_answer (self);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+media_object_dispatch (MediaObject *self)
+{
+    gmediadb_lock (self->priv->db);
+    gboolean more = dispatch_pass (self);
+    gmediadb_unlock (self->priv->db);
+
+    return more;
+}
+
+// Finishes everything queued, for calls that have to see all earlier changes
+void
+media_object_drain (MediaObject *self)
+{
+    MediaObjectWork *work;
+    gint i;
+
+    for (i = 0; i < MEDIA_OBJECT_LANES; i++) {
+        while ((work = g_queue_pop_head (self->priv->lanes[i].queue))) {
+            work_run (self, work, NULL);
+            work_finish (self, work);
+        }
+    }
+
+    if (self->priv->dispatch_source) {
+        g_source_remove (self->priv->dispatch_source);
+        self->priv->dispatch_source = 0;
+    }
+
+    flush_store_answer (self);
+}
+
+static gboolean
+work_touches_bulk (MediaObject *self, MediaObjectWork *work)
+{
+    guint i;
+
+    for (i = 0; i < work->ops->len; i++) {
+        if (g_hash_table_lookup (self->priv->bulk_ids,
+            GUINT_TO_POINTER (g_array_index (work->ops, MediaObjectOp, i).ident))) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+// Changes to an entry a queued bulk call still holds wait behind it, so
+// every entry sees its changes in the order they were sent
+static void
+media_object_queue (MediaObject *self, MediaObjectWork *work)
+{
+    guint i;
+
+    // Our own database already holds the change, it only has to go out
+    if (!work->context) {
+        if (work_touches_bulk (self, work)) {
+            media_object_drain (self);
+        }
+
+        work->lane = MEDIA_OBJECT_LANE_INTERACTIVE;
+        self->priv->lanes[work->lane].depth += work->ops->len;
+        work_run (self, work, NULL);
+        work_free (work);
+        return;
+    }
+
+    if (work->ops->len > GMEDIADB_INTERACTIVE_OPS || work_touches_bulk (self, work)) {
+        work->lane = MEDIA_OBJECT_LANE_BULK;
+
+        for (i = 0; i < work->ops->len; i++) {
+            gpointer ident = GUINT_TO_POINTER (g_array_index (work->ops, MediaObjectOp, i).ident);
+
+            g_hash_table_insert (self->priv->bulk_ids, ident, GUINT_TO_POINTER (
+                GPOINTER_TO_UINT (g_hash_table_lookup (self->priv->bulk_ids, ident)) + 1));
+        }
+    } else {
+        work->lane = MEDIA_OBJECT_LANE_INTERACTIVE;
+    }
+
+    // Added ids are taken from now on, not once the add runs
+    gmediadb_lock (self->priv->db);
+    for (i = 0; i < work->ops->len; i++) {
+        MediaObjectOp *op = &g_array_index (work->ops, MediaObjectOp, i);
+
+        if (op->kind == MEDIA_OBJECT_OP_ADD) {
+            gmediadb_claim_id (self->priv->db, op->ident);
+        }
+    }
+    gmediadb_unlock (self->priv->db);
+
+    self->priv->lanes[work->lane].depth += work->ops->len;
+    g_queue_push_tail (self->priv->lanes[work->lane].queue, work);
+
+    if (!self->priv->dispatch_source) {
+        self->priv->dispatch_source = g_idle_add_full (G_PRIORITY_DEFAULT,
+            (GSourceFunc) media_object_dispatch, self, NULL);
+    }
+}
+
+void
+media_object_add_entry (MediaObject *self, guint ident, GHashTable *info,
+                        DBusGMethodInvocation *context)
 {
-    return g_object_new (MEDIA_OBJECT_TYPE, NULL);
+    MediaObjectWork *work = work_new (context);
+
+    work_add (work, MEDIA_OBJECT_OP_ADD, ident, info);
+    media_object_queue (self, work);
+}
+
+void
+media_object_add_entries (MediaObject *self, GArray *ids, GPtrArray *infos,
+                          DBusGMethodInvocation *context)
+{
+    MediaObjectWork *work = work_new (context);
+    guint i;
+
+    for (i = 0; i < ids->len && i < infos->len; i++) {
+        work_add (work, MEDIA_OBJECT_OP_ADD, g_array_index (ids, guint, i),
+            g_ptr_array_index (infos, i));
+    }
+
+    media_object_queue (self, work);
+}
+
+void
+media_object_update_entry (MediaObject *self, guint ident, GHashTable *info,
+                           DBusGMethodInvocation *context)
+{
+    MediaObjectWork *work = work_new (context);
+
+    work_add (work, MEDIA_OBJECT_OP_UPDATE, ident, info);
+    media_object_queue (self, work);
 }
 
 gboolean
-media_object_add_entry (MediaObject *self, guint ident, GHashTable *info, GError **error)
+media_object_upsert_entry (MediaObject *self, const gchar *key_tag, GHashTable *info,
+                           guint *ident, GError **error)
 {
-    self->priv->mod = TRUE;
-    g_signal_emit (G_OBJECT (self), signal_media_added, 0, ident, info);
+    gmediadb_lock (self->priv->db);
+
+    // The key may belong to an entry still queued
+    media_object_drain (self);
+
+    // Goes through the database, which announces the change itself
+    *ident = gmediadb_upsert_info (self->priv->db, key_tag, info);
+
+    gmediadb_unlock (self->priv->db);
+
+    if (!*ident) {
+        g_set_error (error, MEDIA_OBJECT_ERROR, 0, "Unable to upsert by %s", key_tag);
+        return FALSE;
+    }
 
     return TRUE;
 }
 
+void
+media_object_remove_entry (MediaObject *self, guint ident, DBusGMethodInvocation *context)
+{
+    MediaObjectWork *work = work_new (context);
+
+    work_add (work, MEDIA_OBJECT_OP_REMOVE, ident, NULL);
+    media_object_queue (self, work);
+}
+
 gboolean
-media_object_update_entry (MediaObject *self, guint ident, GHashTable *info, GError **error)
+media_object_reserve_ids (MediaObject *self, guint count, guint *first, GError **error)
 {
-    self->priv->mod = TRUE;
-    g_signal_emit (G_OBJECT (self), signal_media_updated, 0, ident, info);
+    gmediadb_lock (self->priv->db);
+    *first = gmediadb_reserve_ids (self->priv->db, count);
+    gmediadb_unlock (self->priv->db);
 
     return TRUE;
 }
 
+void
+media_object_apply_changes (MediaObject *self, GArray *add_ids, GPtrArray *adds,
+                            GArray *update_ids, GPtrArray *updates, GArray *remove_ids,
+                            DBusGMethodInvocation *context)
+{
+    MediaObjectWork *work = work_new (context);
+    guint i;
+
+    for (i = 0; i < add_ids->len && i < adds->len; i++) {
+        work_add (work, MEDIA_OBJECT_OP_ADD, g_array_index (add_ids, guint, i),
+            g_ptr_array_index (adds, i));
+    }
+
+    for (i = 0; i < update_ids->len && i < updates->len; i++) {
+        work_add (work, MEDIA_OBJECT_OP_UPDATE, g_array_index (update_ids, guint, i),
+            g_ptr_array_index (updates, i));
+    }
+
+    for (i = 0; i < remove_ids->len; i++) {
+        work_add (work, MEDIA_OBJECT_OP_REMOVE, g_array_index (remove_ids, guint, i), NULL);
+    }
+
+    media_object_queue (self, work);
+}
+
 gboolean
-media_object_remove_entry (MediaObject *self, guint ident, GError **error)
+media_object_set_tag_type (MediaObject *self, const gchar *tag, guint type, GError **error)
 {
-    self->priv->mod = TRUE;
-    g_signal_emit (G_OBJECT (self), signal_media_removed, 0, ident);
+    if (type > GMEDIADB_TAG_TIME) {
+        g_set_error (error, MEDIA_OBJECT_ERROR, 0, "No tag type %d", type);
+        return FALSE;
+    }
+
+    // Goes through the database, which announces the change itself
+    gmediadb_lock (self->priv->db);
+    gmediadb_set_tag_type (self->priv->db, tag, type);
+    gmediadb_unlock (self->priv->db);
 
     return TRUE;
 }
 
+// The store holds the schema, so it has to be written again
+void
+media_object_tag_type_changed (MediaObject *self, const gchar *tag, GMediaDBTagType type)
+{
+    media_object_modified (self);
+    g_signal_emit (self, signal_tag_type_changed, 0, type, tag);
+}
+
 gboolean
-media_object_flush_store (MediaObject *self, GError **error)
+media_object_get_lane_stats (MediaObject *self, GHashTable **stats, GError **error)
 {
+    static const gchar *names[] = { "interactive", "bulk" };
+    gint i;
+
+    *stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+    for (i = 0; i < MEDIA_OBJECT_LANES; i++) {
+        MediaObjectLane *lane = &self->priv->lanes[i];
+
+        g_hash_table_insert (*stats, g_strdup_printf ("%s_depth", names[i]),
+            GUINT_TO_POINTER (lane->depth));
+        g_hash_table_insert (*stats, g_strdup_printf ("%s_calls", names[i]),
+            GUINT_TO_POINTER (lane->calls));
+        g_hash_table_insert (*stats, g_strdup_printf ("%s_ops", names[i]),
+            GUINT_TO_POINTER (lane->ops));
+        g_hash_table_insert (*stats, g_strdup_printf ("%s_latency_avg_us", names[i]),
+            GUINT_TO_POINTER (lane->calls ? (guint) (lane->latency_total / lane->calls) : 0));
+        g_hash_table_insert (*stats, g_strdup_printf ("%s_latency_max_us", names[i]),
+            GUINT_TO_POINTER ((guint) MIN (lane->latency_max, G_MAXUINT)));
+    }
+
+    return TRUE;
+}
+
+gboolean
+media_object_get_value (MediaObject *self, guint ident, const gchar *tag, gchar **value, GError **error)
+{
+    gmediadb_lock (self->priv->db);
+
+    if (g_hash_table_lookup (self->priv->bulk_ids, GUINT_TO_POINTER (ident))) {
+        media_object_drain (self);
+    }
+
+    *value = g_strdup (gmediadb_lookup_value (self->priv->db, ident, tag));
+
+    gmediadb_unlock (self->priv->db);
+
+    if (!*value) {
+        g_set_error (error, MEDIA_OBJECT_ERROR, 0, "No %s for entry %d", tag, ident);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Callers read the file next, so queued changes and a background flush
+// have to be done
+static void
+flush_store_answer (MediaObject *self)
+{
+    GSList *l;
+
+    if (!self->priv->flush_waiting) {
+        return;
+    }
+
+    gmediadb_flush_wait (self->priv->db);
+
     // If state of file is different than database, flush store to file
     if (self->priv->mod) {
-        g_signal_emit (self, signal_flush, 0);
+        self->priv->mod = FALSE;
+        g_signal_emit (self, signal_flush, 0, FALSE);
     }
 
-    return TRUE;
+    for (l = self->priv->flush_waiting; l; l = l->next) {
+        dbus_g_method_return ((DBusGMethodInvocation*) l->data);
+    }
+
+    g_slist_free (self->priv->flush_waiting);
+    self->priv->flush_waiting = NULL;
+}
+
+// Answered once the lanes are worked through in their usual slices
+void
+media_object_flush_store (MediaObject *self, DBusGMethodInvocation *context)
+{
+    gmediadb_lock (self->priv->db);
+
+    self->priv->flush_waiting = g_slist_prepend (self->priv->flush_waiting, context);
+
+    if (!self->priv->dispatch_source) {
+        flush_store_answer (self);
+    }
+
+    gmediadb_unlock (self->priv->db);
+}
+
+static void
+projection_free (gchar **values, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        g_free (values[i]);
+    }
+
+    g_free (values);
+}
+
+static void
+subscription_free (MediaObjectSubscription *sub)
+{
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, sub->members);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        projection_free ((gchar**) val, sub->n);
+    }
+
+    g_hash_table_destroy (sub->members);
+    g_strfreev (sub->tags);
+    g_strfreev (sub->filter);
+    g_free (sub->sender);
+    g_free (sub->path);
+    g_free (sub);
+}
+
+static void
+media_object_name_owner_changed (DBusGProxy *proxy,
+                                 gchar *name,
+                                 gchar *oowner,
+                                 gchar *nowner,
+                                 MediaObject *self)
+{
+    GList *l, *next;
+
+    if (nowner && nowner[0]) {
+        return;
+    }
+
+    // The subscriber left the bus without saying so
+    for (l = self->priv->subs; l; l = next) {
+        MediaObjectSubscription *sub = l->data;
+        next = l->next;
+
+        if (!g_strcmp0 (sub->sender, name)) {
+            self->priv->subs = g_list_delete_link (self->priv->subs, l);
+            subscription_free (sub);
+        }
+    }
+}
+
+static void
+subscription_emit (MediaObject *self, MediaObjectSubscription *sub,
+                   const gchar *signal, guint ident, GHashTable *info)
+{
+    DBusMessage *msg = dbus_message_new_signal (sub->path,
+        "org.gnome.GMediaDB.MediaObject", signal);
+    DBusMessageIter iter, dict, pair;
+
+    dbus_message_set_destination (msg, sub->sender);
+
+    dbus_message_iter_init_append (msg, &iter);
+    dbus_message_iter_append_basic (&iter, DBUS_TYPE_UINT32, &ident);
+
+    if (info) {
+        dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{ss}", &dict);
+
+        GHashTableIter hiter;
+        gpointer key, val;
+        g_hash_table_iter_init (&hiter, info);
+        while (g_hash_table_iter_next (&hiter, &key, &val)) {
+            dbus_message_iter_open_container (&dict, DBUS_TYPE_DICT_ENTRY, NULL, &pair);
+            dbus_message_iter_append_basic (&pair, DBUS_TYPE_STRING, &key);
+            dbus_message_iter_append_basic (&pair, DBUS_TYPE_STRING, &val);
+            dbus_message_iter_close_container (&dict, &pair);
+        }
+
+        dbus_message_iter_close_container (&iter, &dict);
+    }
+
+    dbus_connection_send (dbus_g_connection_get_connection (self->priv->conn), msg, NULL);
+    dbus_message_unref (msg);
+}
+
+// Sends the entry to the subscriber if it matches, or tells it the entry
+// is gone when it stopped matching. Updates that leave every tag the
+// subscriber asked for alone are not sent at all
+static void
+subscription_notify (MediaObject *self, MediaObjectSubscription *sub,
+                     guint ident, gboolean removed)
+{
+    gpointer key = GUINT_TO_POINTER (ident);
+    gpointer old = NULL;
+    gboolean was = g_hash_table_lookup_extended (sub->members, key, NULL, &old);
+    gboolean now = !removed && gmediadb_match (self->priv->db, ident, sub->filter);
+    gchar **values = NULL;
+    guint i;
+
+    if (!was && !now) {
+        return;
+    }
+
+    if (!now) {
+        projection_free ((gchar**) old, sub->n);
+        g_hash_table_remove (sub->members, key);
+        subscription_emit (self, sub, "media_removed", ident, NULL);
+        return;
+    }
+
+    GHashTable *info = g_hash_table_new (g_str_hash, g_str_equal);
+
+    if (sub->tags) {
+        gboolean changed = !was;
+
+        values = g_new0 (gchar*, sub->n);
+        for (i = 0; i < sub->n; i++) {
+            const gchar *val = gmediadb_lookup_value (self->priv->db, ident, sub->tags[i]);
+
+            values[i] = g_strdup (val);
+            if (val) {
+                g_hash_table_insert (info, sub->tags[i], values[i]);
+            }
+
+            if (was && g_strcmp0 (values[i], ((gchar**) old)[i])) {
+                changed = TRUE;
+            }
+        }
+
+        if (!changed) {
+            projection_free (values, sub->n);
+            g_hash_table_destroy (info);
+            return;
+        }
+    } else {
+        GArray *ids = g_array_new (FALSE, FALSE, sizeof (gint));
+        GArray *found = g_array_new (FALSE, FALSE, sizeof (gint));
+        GPtrArray *row = g_ptr_array_new ();
+
+        g_array_append_val (ids, ident);
+        gmediadb_get_values (self->priv->db, ids, NULL, found, row);
+
+        for (i = 0; i + 1 < row->len && g_ptr_array_index (row, i); i += 2) {
+            g_hash_table_insert (info, g_ptr_array_index (row, i), g_ptr_array_index (row, i + 1));
+        }
+
+        g_array_free (ids, TRUE);
+        g_array_free (found, TRUE);
+        g_ptr_array_free (row, TRUE);
+    }
+
+    if (was) {
+        projection_free ((gchar**) old, sub->n);
+    }
+
+    g_hash_table_insert (sub->members, key, values);
+    subscription_emit (self, sub, was ? "media_updated" : "media_added", ident, info);
+
+    g_hash_table_destroy (info);
+}
+
+static void
+media_object_notify (MediaObject *self, guint ident, gboolean removed)
+{
+    GList *l;
+
+    for (l = self->priv->subs; l; l = l->next) {
+        subscription_notify (self, (MediaObjectSubscription*) l->data, ident, removed);
+    }
+}
+
+void
+media_object_subscribe (MediaObject *self, gchar **tags, gchar **filter, DBusGMethodInvocation *context)
+{
+    MediaObjectSubscription *sub = g_new0 (MediaObjectSubscription, 1);
+    guint i;
+
+    if (!self->priv->bus_proxy) {
+        self->priv->bus_proxy = dbus_g_proxy_new_for_name (self->priv->conn,
+            DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS);
+
+        dbus_g_proxy_add_signal (self->priv->bus_proxy, "NameOwnerChanged",
+            G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INVALID);
+        dbus_g_proxy_connect_signal (self->priv->bus_proxy, "NameOwnerChanged",
+            G_CALLBACK (media_object_name_owner_changed), self, NULL);
+    }
+
+    sub->handle = self->priv->sub_next++;
+    sub->sender = dbus_g_method_get_sender (context);
+    sub->path = g_strdup_printf ("%s/subscriptions/%u", self->priv->path, sub->handle);
+    sub->tags = tags && tags[0] ? g_strdupv (tags) : NULL;
+    sub->n = sub->tags ? g_strv_length (sub->tags) : 0;
+    sub->filter = g_strdupv (filter);
+    sub->members = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+    self->priv->subs = g_list_prepend (self->priv->subs, sub);
+
+    dbus_g_method_return (context, sub->handle);
+
+    // Start the subscriber off with everything that matches already
+    gmediadb_lock (self->priv->db);
+
+    GArray *ids = gmediadb_query (self->priv->db, filter);
+    for (i = 0; i < ids->len; i++) {
+        subscription_notify (self, sub, g_array_index (ids, gint, i), FALSE);
+    }
+    g_array_free (ids, TRUE);
+
+    gmediadb_unlock (self->priv->db);
+}
+
+void
+media_object_unsubscribe (MediaObject *self, guint handle, DBusGMethodInvocation *context)
+{
+    gchar *sender = dbus_g_method_get_sender (context);
+    GList *l;
+
+    for (l = self->priv->subs; l; l = l->next) {
+        MediaObjectSubscription *sub = l->data;
+
+        if (sub->handle == handle && !g_strcmp0 (sub->sender, sender)) {
+            self->priv->subs = g_list_delete_link (self->priv->subs, l);
+            subscription_free (sub);
+
+            g_free (sender);
+            dbus_g_method_return (context);
+            return;
+        }
+    }
+
+    g_free (sender);
+
+    GError *err = g_error_new (MEDIA_OBJECT_ERROR, 0, "No subscription %d", handle);
+    dbus_g_method_return_error (context, err);
+    g_error_free (err);
+}
+
+// Large values stay out of the exported signals, replicas list them by name
+// and fetch the ones they need through get_value
+static void
+media_object_emit_stripped (MediaObject *self, guint signal, guint ident, GHashTable *info)
+{
+    GHashTable *stripped = g_hash_table_new (g_str_hash, g_str_equal);
+    GString *blobs = NULL;
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, info);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        gboolean listed = !g_strcmp0 (key, GMEDIADB_BLOB_TAGS);
+
+        if (listed || strlen ((gchar*) val) > GMEDIADB_BLOB_THRESHOLD) {
+            if (blobs) {
+                g_string_append_c (blobs, '\n');
+            } else {
+                blobs = g_string_new (NULL);
+            }
+
+            g_string_append (blobs, listed ? (gchar*) val : (gchar*) key);
+        } else {
+            g_hash_table_insert (stripped, key, val);
+        }
+    }
+
+    if (blobs) {
+        g_hash_table_insert (stripped, GMEDIADB_BLOB_TAGS, blobs->str);
+    }
+
+    g_signal_emit (G_OBJECT (self), signal, 0, ident, stripped);
+
+    g_hash_table_destroy (stripped);
+
+    if (blobs) {
+        g_string_free (blobs, TRUE);
+    }
 }
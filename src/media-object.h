@@ -56,14 +56,40 @@ struct _MediaObjectClass {
     void (*media_removed) (MediaObject *mo, guint ident);
 };
 
-MediaObject *media_object_new ();
+#define MEDIA_OBJECT_ERROR (media_object_error_quark ())
+
+MediaObject *media_object_new (GMediaDB *db, DBusGConnection *conn, const gchar *path);
 GType media_object_get_type (void);
+GQuark media_object_error_quark (void);
+
+void media_object_add_entry (MediaObject *self, guint ident, GHashTable *info,
+    DBusGMethodInvocation *context);
+void media_object_add_entries (MediaObject *self, GArray *ids, GPtrArray *infos,
+    DBusGMethodInvocation *context);
+void media_object_update_entry (MediaObject *self, guint ident, GHashTable *info,
+    DBusGMethodInvocation *context);
+gboolean media_object_upsert_entry (MediaObject *self, const gchar *key_tag, GHashTable *info,
+    guint *ident, GError **error);
+void media_object_apply_changes (MediaObject *self, GArray *add_ids, GPtrArray *adds,
+    GArray *update_ids, GPtrArray *updates, GArray *remove_ids, DBusGMethodInvocation *context);
+void media_object_remove_entry (MediaObject *self, guint ident, DBusGMethodInvocation *context);
+gboolean media_object_reserve_ids (MediaObject *self, guint count, guint *first, GError **error);
+
+gboolean media_object_get_value (MediaObject *self, guint ident, const gchar *tag, gchar **value, GError **error);
+
+void media_object_flush_store (MediaObject *self, DBusGMethodInvocation *context);
+gboolean media_object_set_tag_type (MediaObject *self, const gchar *tag, guint type, GError **error);
+void media_object_tag_type_changed (MediaObject *self, const gchar *tag, GMediaDBTagType type);
+gboolean media_object_get_lane_stats (MediaObject *self, GHashTable **stats, GError **error);
 
-gboolean media_object_add_entry (MediaObject *self, guint ident, GHashTable *info, GError **error);
-gboolean media_object_update_entry (MediaObject *self, guint ident, GHashTable *info, GError **error);
-gboolean media_object_remove_entry (MediaObject *self, guint ident, GError **error);
+void media_object_subscribe (MediaObject *self, gchar **tags, gchar **filter, DBusGMethodInvocation *context);
+void media_object_unsubscribe (MediaObject *self, guint handle, DBusGMethodInvocation *context);
 
-gboolean media_object_flush_store (MediaObject *self, GError **error);
+void media_object_drain (MediaObject *self);
+void media_object_set_flush_delay (MediaObject *self, guint seconds);
+gboolean media_object_is_modified (MediaObject *self);
+void media_object_mark_modified (MediaObject *self);
+void media_object_flushed (MediaObject *self);
 
 G_END_DECLS
 
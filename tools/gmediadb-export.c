@@ -0,0 +1,315 @@
+/*
+ *      gmediadb-export.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+#include <dbus/dbus-glib.h>
+#include <gmediadb.h>
+
+typedef struct {
+    FILE *out;
+    gboolean json;
+    gchar **tags;
+    guint count;
+
+    GMediaDB *db;
+    GMainLoop *loop;
+} ExportState;
+
+static gchar *format = "tsv";
+static gchar *tag_list = NULL;
+static gboolean small_only = FALSE;
+
+static GOptionEntry options[] = {
+    { "format", 'f', 0, G_OPTION_ARG_STRING, &format, "Output format, tsv or json", "FORMAT" },
+    { "tags", 't', 0, G_OPTION_ARG_STRING, &tag_list, "Comma separated tags to export", "TAGS" },
+    { "small-only", 's', 0, G_OPTION_ARG_NONE, &small_only, "Leave out large values", NULL },
+    { NULL }
+};
+
+static void
+tsv_write (FILE *out, const gchar *str)
+{
+    for (; str && *str; str++) {
+        switch (*str) {
+            case '\t': fputs ("\\t", out); break;
+            case '\n': fputs ("\\n", out); break;
+            case '\r': fputs ("\\r", out); break;
+            case '\\': fputs ("\\\\", out); break;
+            default: fputc (*str, out); break;
+        }
+    }
+}
+
+static void
+json_write (FILE *out, const gchar *str)
+{
+    fputc ('"', out);
+
+    for (; *str; str++) {
+        switch (*str) {
+            case '"': fputs ("\\\"", out); break;
+            case '\\': fputs ("\\\\", out); break;
+            case '\n': fputs ("\\n", out); break;
+            case '\r': fputs ("\\r", out); break;
+            case '\t': fputs ("\\t", out); break;
+            default:
+                if ((guchar) *str < 0x20) {
+                    fprintf (out, "\\u%04x", *str);
+                } else {
+                    fputc (*str, out);
+                }
+                break;
+        }
+    }
+
+    fputc ('"', out);
+}
+
+static void
+collect_tags (guint id, const gchar **values, GHashTable *names)
+{
+    for (; *values; values += 2) {
+        g_hash_table_insert (names, g_strdup (*values), NULL);
+    }
+}
+
+static gint
+tag_compare (const gchar **a, const gchar **b, gpointer data)
+{
+    return strcmp (*a, *b);
+}
+
+// Every tag in use, sorted, after "id"
+static gchar**
+all_tags (GMediaDB *db)
+{
+    GHashTable *names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    gint n = 1;
+
+    gmediadb_foreach (db, NULL, (GMediaDBForeachFunc) collect_tags, names);
+
+    if (!small_only) {
+        gchar **large = gmediadb_get_large_tags (db);
+
+        for (n = 0; large[n]; n++) {
+            g_hash_table_insert (names, large[n], NULL);
+        }
+
+        // The names now belong to the table
+        g_free (large);
+        n = 1;
+    }
+
+    gchar **tags = g_new0 (gchar*, g_hash_table_size (names) + 2);
+    tags[0] = g_strdup ("id");
+
+    GHashTableIter iter;
+    gpointer key, val;
+    g_hash_table_iter_init (&iter, names);
+    while (g_hash_table_iter_next (&iter, &key, &val)) {
+        if (strcmp (key, "id")) {
+            tags[n++] = g_strdup (key);
+        }
+    }
+
+    g_qsort_with_data (tags + 1, n - 1, sizeof (gchar*), (GCompareDataFunc) tag_compare, NULL);
+
+    g_hash_table_destroy (names);
+
+    return tags;
+}
+
+static void
+write_row (guint id, const gchar **values, ExportState *state)
+{
+    FILE *out = state->out;
+    gchar num[16];
+    gint i;
+
+    g_snprintf (num, sizeof (num), "%u", id);
+
+    if (!state->json) {
+        for (i = 0; state->tags[i]; i++) {
+            if (i) {
+                fputc ('\t', out);
+            }
+
+            tsv_write (out, strcmp (state->tags[i], "id") ? values[i] : num);
+        }
+    } else if (state->tags) {
+        gboolean first = TRUE;
+
+        fputc ('{', out);
+        for (i = 0; state->tags[i]; i++) {
+            const gchar *val = strcmp (state->tags[i], "id") ? values[i] : num;
+
+            // Tags the entry lacks are left out, so they can not place the commas
+            if (val) {
+                fputs (first ? "" : ", ", out);
+                first = FALSE;
+                json_write (out, state->tags[i]);
+                fputs (": ", out);
+                json_write (out, val);
+            }
+        }
+        fputc ('}', out);
+    } else {
+        fputs ("{\"id\": ", out);
+        json_write (out, num);
+        for (i = 0; values[i]; i += 2) {
+            fputs (", ", out);
+            json_write (out, values[i]);
+            fputs (": ", out);
+            json_write (out, values[i + 1]);
+        }
+        fputc ('}', out);
+    }
+
+    fputc ('\n', out);
+    state->count++;
+}
+
+static gboolean
+export_done (ExportState *st)
+{
+    g_main_loop_quit (st->loop);
+
+    return FALSE;
+}
+
+static gpointer
+export_thread (ExportState *st)
+{
+    GMediaDBProjection *proj = NULL;
+    gint i;
+
+    gmediadb_lock (st->db);
+
+    // JSON rows of small values alone list what each entry has
+    if (tag_list) {
+        st->tags = g_strsplit (tag_list, ",", 0);
+    } else if (!st->json || !small_only) {
+        st->tags = all_tags (st->db);
+    }
+
+    if (st->tags) {
+        proj = gmediadb_projection_new (st->db, st->tags);
+    }
+
+    if (!st->json) {
+        for (i = 0; st->tags[i]; i++) {
+            if (i) {
+                fputc ('\t', st->out);
+            }
+            tsv_write (st->out, st->tags[i]);
+        }
+        fputc ('\n', st->out);
+    }
+
+    gmediadb_foreach (st->db, proj, (GMediaDBForeachFunc) write_row, st);
+
+    if (proj) {
+        gmediadb_projection_free (proj);
+    }
+
+    gmediadb_unlock (st->db);
+
+    g_idle_add ((GSourceFunc) export_done, st);
+
+    return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *err = NULL;
+    ExportState state = { stdout, FALSE, NULL, 0, NULL, NULL };
+
+    g_type_init ();
+    g_thread_init (NULL);
+
+    // The worker thread and the main loop share the session connection
+    dbus_g_thread_init ();
+
+    context = g_option_context_new ("MEDIATYPE [FILE] - write out a media database");
+    g_option_context_add_main_entries (context, options, NULL);
+    g_option_context_set_description (context,
+        "Writes standard output without FILE. Output without --tags has every\n"
+        "tag in use, found with an extra pass over the database, large values\n"
+        "included unless --small-only is given. TSV has a column for each.");
+
+    if (!g_option_context_parse (context, &argc, &argv, &err)) {
+        g_printerr ("%s\n", err->message);
+        return 1;
+    }
+
+    g_option_context_free (context);
+
+    if (argc < 2 || argc > 3) {
+        g_printerr ("Usage: %s [OPTION...] MEDIATYPE [FILE]\n", g_get_prgname ());
+        return 1;
+    }
+
+    state.json = !g_strcmp0 (format, "json");
+    if (!state.json && g_strcmp0 (format, "tsv")) {
+        g_printerr ("Unknown format %s\n", format);
+        return 1;
+    }
+
+    if (argc == 3 && g_strcmp0 (argv[2], "-") && !(state.out = fopen (argv[2], "w"))) {
+        g_printerr ("Unable to open %s\n", argv[2]);
+        return 1;
+    }
+
+    // Entries are decoded a block at a time and dropped once written
+    GMediaDB *db = gmediadb_new_full (argv[1], GMEDIADB_OPEN_LAZY);
+
+    // Other processes may open the database while the export runs, and
+    // when we own it their calls are answered from the main loop
+    state.db = db;
+    state.loop = g_main_loop_new (NULL, FALSE);
+
+    GThread *worker = g_thread_create ((GThreadFunc) export_thread, &state, TRUE, &err);
+
+    if (!worker) {
+        g_printerr ("Unable to start export: %s\n", err->message);
+        return 1;
+    }
+
+    g_main_loop_run (state.loop);
+    g_thread_join (worker);
+    g_main_loop_unref (state.loop);
+
+    g_strfreev (state.tags);
+    g_object_unref (db);
+
+    if (state.out != stdout) {
+        fclose (state.out);
+    }
+
+    g_printerr ("Exported %d entries\n", state.count);
+
+    return 0;
+}
@@ -0,0 +1,646 @@
+/*
+ *      gmediadb-import.c
+ *
+ *      Copyright 2009 Brett Mravec <brett.mravec@gmail.com>
+ *
+ *      This program is free software; you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation; either version 2 of the License, or
+ *      (at your option) any later version.
+ *
+ *      This program is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with this program; if not, write to the Free Software
+ *      Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ *      MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <dbus/dbus-glib.h>
+#include <gmediadb.h>
+
+typedef struct {
+    GPtrArray *lines;
+    GPtrArray *entries;
+    const gchar **why;
+    gchar **header;
+    gboolean json;
+
+    guint start;
+    guint end;
+} ParseJob;
+
+typedef struct {
+    GMediaDB *db;
+    GMainLoop *loop;
+    FILE *in;
+    gchar **header;
+    gboolean json;
+
+    guint lineno;
+    guint added;
+    guint skipped;
+} ImportState;
+
+static gchar *format = "tsv";
+static gint threads = 0;
+static gint batch = 4096;
+
+static GOptionEntry options[] = {
+    { "format", 'f', 0, G_OPTION_ARG_STRING, &format, "Input format, tsv or json", "FORMAT" },
+    { "threads", 'j', 0, G_OPTION_ARG_INT, &threads, "Number of parser threads", "N" },
+    { "batch", 'b', 0, G_OPTION_ARG_INT, &batch, "Entries added to the database at a time", "N" },
+    { NULL }
+};
+
+#define BAD_UTF8 "not valid UTF-8"
+#define BAD_LITERAL "has a value that is not JSON"
+
+// TSV fields escape tab, newline, carriage return and backslash. NULL
+// when the field is not valid UTF-8
+static gchar*
+tsv_unescape (const gchar *str, gsize len)
+{
+    gchar *res = g_new (gchar, len + 1);
+    gchar *out = res;
+    gsize i;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] != '\\' || i + 1 == len) {
+            *out++ = str[i];
+            continue;
+        }
+
+        switch (str[++i]) {
+            case 't': *out++ = '\t'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            default: *out++ = str[i]; break;
+        }
+    }
+
+    *out = '\0';
+
+    if (!g_utf8_validate (res, out - res, NULL)) {
+        g_free (res);
+        return NULL;
+    }
+
+    return res;
+}
+
+static gchar**
+tsv_split (const gchar *line)
+{
+    GPtrArray *fields = g_ptr_array_new ();
+    const gchar *start = line, *end;
+    gchar *field;
+
+    do {
+        end = strchr (start, '\t');
+        if (!end) {
+            end = start + strlen (start);
+        }
+
+        if (!(field = tsv_unescape (start, end - start))) {
+            g_ptr_array_foreach (fields, (GFunc) g_free, NULL);
+            g_ptr_array_free (fields, TRUE);
+            return NULL;
+        }
+
+        g_ptr_array_add (fields, field);
+        start = end + 1;
+    } while (*end);
+
+    g_ptr_array_add (fields, NULL);
+
+    return (gchar**) g_ptr_array_free (fields, FALSE);
+}
+
+// Empty fields leave the tag out
+static gchar**
+parse_tsv (const gchar *line, gchar **header, const gchar **why)
+{
+    gchar **fields = tsv_split (line);
+    GPtrArray *kvs;
+    gint i;
+
+    if (!fields) {
+        *why = BAD_UTF8;
+        return NULL;
+    }
+
+    kvs = g_ptr_array_new ();
+
+    for (i = 0; fields[i] && header[i]; i++) {
+        if (fields[i][0]) {
+            g_ptr_array_add (kvs, g_strdup (header[i]));
+            g_ptr_array_add (kvs, fields[i]);
+        } else {
+            g_free (fields[i]);
+        }
+    }
+
+    for (; fields[i]; i++) {
+        g_free (fields[i]);
+    }
+
+    g_free (fields);
+    g_ptr_array_add (kvs, NULL);
+
+    return (gchar**) g_ptr_array_free (kvs, FALSE);
+}
+
+static const gchar*
+json_skip (const gchar *p)
+{
+    while (g_ascii_isspace (*p)) {
+        p++;
+    }
+
+    return p;
+}
+
+// Numbers as the JSON grammar has them, true and false. null is left to
+// the caller
+static gboolean
+json_literal (const gchar *p, const gchar *end)
+{
+    gsize len = end - p;
+
+    if ((len == 4 && !strncmp (p, "true", 4)) || (len == 5 && !strncmp (p, "false", 5))) {
+        return TRUE;
+    }
+
+    if (p < end && *p == '-') {
+        p++;
+    }
+
+    if (p < end && *p == '0') {
+        p++;
+    } else if (p < end && *p >= '1' && *p <= '9') {
+        while (p < end && g_ascii_isdigit (*p)) {
+            p++;
+        }
+    } else {
+        return FALSE;
+    }
+
+    if (p < end && *p == '.') {
+        if (++p == end || !g_ascii_isdigit (*p)) {
+            return FALSE;
+        }
+
+        while (p < end && g_ascii_isdigit (*p)) {
+            p++;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        if (++p < end && (*p == '+' || *p == '-')) {
+            p++;
+        }
+
+        if (p == end || !g_ascii_isdigit (*p)) {
+            return FALSE;
+        }
+
+        while (p < end && g_ascii_isdigit (*p)) {
+            p++;
+        }
+    }
+
+    return p == end;
+}
+
+static gint
+json_hex (const gchar *p)
+{
+    gint i, res = 0;
+
+    for (i = 0; i < 4; i++) {
+        if (!g_ascii_isxdigit (p[i])) {
+            return -1;
+        }
+
+        res = res * 16 + g_ascii_xdigit_value (p[i]);
+    }
+
+    return res;
+}
+
+// Escapes can spell a NUL or half a surrogate pair, so the result is
+// checked as a whole
+static gchar*
+json_string (const gchar **pp, const gchar **why)
+{
+    const gchar *p = *pp;
+    GString *str;
+
+    if (*p++ != '"') {
+        return NULL;
+    }
+
+    str = g_string_new (NULL);
+
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            g_string_append_c (str, *p++);
+            continue;
+        }
+
+        switch (*++p) {
+            case 'b': g_string_append_c (str, '\b'); break;
+            case 'f': g_string_append_c (str, '\f'); break;
+            case 'n': g_string_append_c (str, '\n'); break;
+            case 'r': g_string_append_c (str, '\r'); break;
+            case 't': g_string_append_c (str, '\t'); break;
+            case 'u': {
+                gint c = json_hex (p + 1);
+
+                if (c < 0) {
+                    g_string_free (str, TRUE);
+                    return NULL;
+                }
+                p += 4;
+
+                // Characters outside the BMP come as surrogate pairs
+                if (c >= 0xD800 && c < 0xDC00 && p[1] == '\\' && p[2] == 'u') {
+                    gint low = json_hex (p + 3);
+
+                    if (low >= 0xDC00 && low < 0xE000) {
+                        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                        p += 6;
+                    }
+                }
+
+                g_string_append_unichar (str, c);
+                break;
+            }
+            case '\0':
+                g_string_free (str, TRUE);
+                return NULL;
+            default:
+                g_string_append_c (str, *p);
+                break;
+        }
+
+        p++;
+    }
+
+    if (*p != '"') {
+        g_string_free (str, TRUE);
+        return NULL;
+    }
+
+    if (!g_utf8_validate (str->str, str->len, NULL)) {
+        *why = BAD_UTF8;
+        g_string_free (str, TRUE);
+        return NULL;
+    }
+
+    *pp = p + 1;
+
+    return g_string_free (str, FALSE);
+}
+
+// Objects of string, number and boolean values, null leaves the tag out
+static gchar**
+parse_json (const gchar *line, const gchar **why)
+{
+    GPtrArray *kvs = g_ptr_array_new ();
+    const gchar *p = json_skip (line);
+    gchar *key, *val;
+
+    if (*p++ != '{') {
+        goto fail;
+    }
+
+    p = json_skip (p);
+
+    while (*p != '}') {
+        if (!(key = json_string (&p, why))) {
+            goto fail;
+        }
+
+        g_ptr_array_add (kvs, key);
+
+        p = json_skip (p);
+        if (*p++ != ':') {
+            goto fail;
+        }
+        p = json_skip (p);
+
+        if (*p == '"') {
+            if (!(val = json_string (&p, why))) {
+                goto fail;
+            }
+        } else {
+            const gchar *end = p;
+
+            while (*end && *end != ',' && *end != '}' && !g_ascii_isspace (*end)) {
+                end++;
+            }
+
+            if (end - p == 4 && !strncmp (p, "null", 4)) {
+                val = NULL;
+            } else if (json_literal (p, end)) {
+                val = g_strndup (p, end - p);
+            } else {
+                *why = BAD_LITERAL;
+                goto fail;
+            }
+
+            p = end;
+        }
+
+        if (val) {
+            g_ptr_array_add (kvs, val);
+        } else {
+            g_free (g_ptr_array_remove_index (kvs, kvs->len - 1));
+        }
+
+        p = json_skip (p);
+        if (*p == ',') {
+            p = json_skip (p + 1);
+        } else if (*p != '}') {
+            goto fail;
+        }
+    }
+
+    g_ptr_array_add (kvs, NULL);
+
+    return (gchar**) g_ptr_array_free (kvs, FALSE);
+
+fail:
+    g_ptr_array_foreach (kvs, (GFunc) g_free, NULL);
+    g_ptr_array_free (kvs, TRUE);
+
+    return NULL;
+}
+
+static gpointer
+parse_thread (ParseJob *job)
+{
+    guint i;
+
+    for (i = job->start; i < job->end; i++) {
+        const gchar *line = g_ptr_array_index (job->lines, i);
+
+        job->why[i] = job->json ? "not a JSON object" : "not valid TSV";
+
+        if (!line[0]) {
+            g_ptr_array_index (job->entries, i) = NULL;
+        } else {
+            g_ptr_array_index (job->entries, i) = job->json ?
+                parse_json (line, &job->why[i]) : parse_tsv (line, job->header, &job->why[i]);
+        }
+    }
+
+    return NULL;
+}
+
+// Splits the lines between the parser threads, entries keep their order
+static void
+parse_lines (GPtrArray *lines, GPtrArray *entries, const gchar **why, gchar **header, gboolean json)
+{
+    ParseJob *jobs = g_new0 (ParseJob, threads);
+    GThread **workers = g_new0 (GThread*, threads);
+    guint per = (lines->len + threads - 1) / threads;
+    gint i;
+
+    g_ptr_array_set_size (entries, lines->len);
+
+    for (i = 0; i < threads; i++) {
+        jobs[i].lines = lines;
+        jobs[i].entries = entries;
+        jobs[i].why = why;
+        jobs[i].header = header;
+        jobs[i].json = json;
+        jobs[i].start = MIN (i * per, lines->len);
+        jobs[i].end = MIN ((i + 1) * per, lines->len);
+
+        // The last slice is parsed here
+        if (i + 1 < threads) {
+            workers[i] = g_thread_create ((GThreadFunc) parse_thread, &jobs[i], TRUE, NULL);
+        }
+
+        if (!workers[i]) {
+            parse_thread (&jobs[i]);
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (workers[i]) {
+            g_thread_join (workers[i]);
+        }
+    }
+
+    g_free (workers);
+    g_free (jobs);
+}
+
+// Reads a line without its end of line, NULL at the end of the input
+static gchar*
+read_line (FILE *in)
+{
+    GString *str = g_string_new (NULL);
+    gchar buf[4096];
+
+    while (fgets (buf, sizeof (buf), in)) {
+        g_string_append (str, buf);
+
+        if (str->len && str->str[str->len - 1] == '\n') {
+            break;
+        }
+    }
+
+    if (!str->len && feof (in)) {
+        g_string_free (str, TRUE);
+        return NULL;
+    }
+
+    while (str->len && (str->str[str->len - 1] == '\n' || str->str[str->len - 1] == '\r')) {
+        g_string_truncate (str, str->len - 1);
+    }
+
+    return g_string_free (str, FALSE);
+}
+
+static gboolean
+import_done (ImportState *st)
+{
+    g_main_loop_quit (st->loop);
+
+    return FALSE;
+}
+
+static gpointer
+import_thread (ImportState *st)
+{
+    gchar *line;
+    guint i;
+
+    GPtrArray *lines = g_ptr_array_sized_new (batch);
+    GPtrArray *entries = g_ptr_array_sized_new (batch);
+    const gchar **why = g_new0 (const gchar*, batch);
+
+    do {
+        g_ptr_array_set_size (lines, 0);
+
+        while (lines->len < batch && (line = read_line (st->in))) {
+            g_ptr_array_add (lines, line);
+        }
+
+        parse_lines (lines, entries, why, st->header, st->json);
+
+        // Lines that do not parse are reported and skipped
+        guint kept = 0;
+        for (i = 0; i < entries->len; i++) {
+            gchar **kvs = g_ptr_array_index (entries, i);
+
+            if (kvs) {
+                g_ptr_array_index (entries, kept++) = kvs;
+            } else if (((gchar*) g_ptr_array_index (lines, i))[0]) {
+                g_printerr ("Skipped line %d, %s\n", st->lineno + i + 1, why[i]);
+                st->skipped++;
+            }
+        }
+
+        g_ptr_array_set_size (entries, kept);
+
+        if (entries->len) {
+            gmediadb_lock (st->db);
+            gmediadb_add_entries (st->db, entries);
+            gmediadb_unlock (st->db);
+            st->added += entries->len;
+        }
+
+        st->lineno += lines->len;
+
+        g_ptr_array_foreach (entries, (GFunc) g_strfreev, NULL);
+        g_ptr_array_foreach (lines, (GFunc) g_free, NULL);
+    } while (lines->len == batch);
+
+    g_ptr_array_free (lines, TRUE);
+    g_ptr_array_free (entries, TRUE);
+    g_free (why);
+
+    g_idle_add ((GSourceFunc) import_done, st);
+
+    return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *err = NULL;
+    gchar **header = NULL;
+    gboolean json;
+    FILE *in = stdin;
+    gchar *line;
+    guint lineno = 0;
+
+    g_type_init ();
+    g_thread_init (NULL);
+
+    // The worker thread and the main loop share the session connection
+    dbus_g_thread_init ();
+
+    context = g_option_context_new ("MEDIATYPE [FILE] - add entries to a media database");
+    g_option_context_add_main_entries (context, options, NULL);
+    g_option_context_set_description (context,
+        "TSV input starts with a line naming the tag of each column, JSON input\n"
+        "has one object per line. Reads standard input without FILE. When no\n"
+        "program has the database open the store is written directly on exit,\n"
+        "otherwise each batch goes to the program that has it open.");
+
+    if (!g_option_context_parse (context, &argc, &argv, &err)) {
+        g_printerr ("%s\n", err->message);
+        return 1;
+    }
+
+    g_option_context_free (context);
+
+    if (argc < 2 || argc > 3) {
+        g_printerr ("Usage: %s [OPTION...] MEDIATYPE [FILE]\n", g_get_prgname ());
+        return 1;
+    }
+
+    json = !g_strcmp0 (format, "json");
+    if (!json && g_strcmp0 (format, "tsv")) {
+        g_printerr ("Unknown format %s\n", format);
+        return 1;
+    }
+
+    if (argc == 3 && g_strcmp0 (argv[2], "-") && !(in = fopen (argv[2], "r"))) {
+        g_printerr ("Unable to open %s\n", argv[2]);
+        return 1;
+    }
+
+    if (threads <= 0) {
+        threads = MAX (1, sysconf (_SC_NPROCESSORS_ONLN));
+    }
+
+    if (batch <= 0) {
+        batch = 4096;
+    }
+
+    if (!json) {
+        if (!(line = read_line (in))) {
+            g_printerr ("Missing header line\n");
+            return 1;
+        }
+
+        header = tsv_split (line);
+        lineno++;
+        g_free (line);
+
+        if (!header) {
+            g_printerr ("Header line is %s\n", BAD_UTF8);
+            return 1;
+        }
+    }
+
+    GMediaDB *db = gmediadb_new (argv[1]);
+
+    // Nothing is written until the import is done
+    gmediadb_set_flush_delay (db, 0);
+
+    // Other processes may open the database while the import runs, and
+    // when we own it their calls are answered from the main loop
+    ImportState state = { db, g_main_loop_new (NULL, FALSE), in, header, json, lineno, 0, 0 };
+    GThread *worker = g_thread_create ((GThreadFunc) import_thread, &state, TRUE, &err);
+
+    if (!worker) {
+        g_printerr ("Unable to start import: %s\n", err->message);
+        return 1;
+    }
+
+    g_main_loop_run (state.loop);
+    g_thread_join (worker);
+    g_main_loop_unref (state.loop);
+
+    g_strfreev (header);
+
+    if (in != stdin) {
+        fclose (in);
+    }
+
+    // Writes the store when we own the database
+    g_object_unref (db);
+
+    g_print ("Added %d entries, skipped %d lines\n", state.added, state.skipped);
+
+    return state.skipped ? 2 : 0;
+}